@@ -0,0 +1,852 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <vector>
+#include "defines.h"
+#include "ray.h"
+#include "scene.h"
+#include "scene_types.h"
+#include "raytracer.h"
+#include "kdtree.h"
+#include "kdtree_types.h"
+
+//! \file : micro benchmarks of the acceleration structures on synthetic scenes
+
+const char *accelNames[] = {"none", "kdtree", "bvh", "bvh4", "lbvh", "sbvh", "kdropes", "lazybvh", "grid", "bvh4c"};
+const Eaccel accelTypes[] = {ACCEL_KDTREE, ACCEL_BVH, ACCEL_BVH4, ACCEL_LBVH, ACCEL_SBVH, ACCEL_KDTREE_ROPES, ACCEL_LAZY_BVH, ACCEL_GRID, ACCEL_BVH4_COMPACT};
+const int accelTypeCount = sizeof(accelTypes) / sizeof(accelTypes[0]);
+
+float randf() {
+  return rand() / (float)RAND_MAX;
+}
+
+Material benchMaterial() {
+  Material mat;
+  mat.IOR = 1.3;
+  mat.roughness = 0.1;
+  mat.specularColor = color3(0.5f);
+  mat.diffuseColor = color3(0.5f);
+  return mat;
+}
+
+//! n small spheres and n small triangles scattered in a 10 units cube, above a plane
+Scene *initRandomScene(int n) {
+  Scene *scene = initScene();
+  Material mat = benchMaterial();
+  srand(1);
+  for (int i = 0; i < n; i++)
+    addObject(scene, initSphere(point3(randf()*10-5, randf()*10-5, randf()*10-5), randf()*0.05f+0.01f, mat));
+  for (int i = 0; i < n; i++) {
+    point3 a(randf()*10-5, randf()*10-5, randf()*10-5);
+    addObject(scene, initTriangle(a, a+0.1f*vec3(randf(), randf(), randf()), a+0.1f*vec3(randf(), randf(), randf()), mat));
+  }
+  addObject(scene, initPlane(vec3(0,1,0), 6, mat));
+  return scene;
+}
+
+//! build time of each acceleration structure with 1, 2, 4 ... threads
+void benchBuild(int n) {
+  Scene *scene = initRandomScene(n);
+  int maxThreads = omp_get_max_threads();
+  printf("build time, %d objects\n", 2 * n);
+  printf("threads");
+  for (int a = 0; a < accelTypeCount; a++)
+    printf("\t%s", accelNames[accelTypes[a]]);
+  printf("\n");
+
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    omp_set_num_threads(threads);
+    printf("%d", threads);
+    for (int a = 0; a < accelTypeCount; a++) {
+      double start = omp_get_wtime();
+      Accel *accel = initAccel(scene, accelTypes[a]);
+      printf("\t%.3fs", omp_get_wtime() - start);
+      freeAccel(accel);
+    }
+    printf("\n");
+    if (threads < maxThreads && threads * 2 > maxThreads)
+      threads = maxThreads / 2;
+  }
+  omp_set_num_threads(maxThreads);
+  freeScene(scene);
+}
+
+//! move a tenth of the spheres a little at each frame, refit the bvh and compare with a rebuild per frame
+void benchRefit(int n) {
+  Scene *scene = initRandomScene(n);
+  const int frames = 100;
+  std::vector<int> moved;
+  for (int i = 0; i < n; i += 10)
+    moved.push_back(i);
+
+  Eaccel types[] = {ACCEL_BVH, ACCEL_LBVH};
+  for (Eaccel type : types) {
+    Accel *accel = initAccel(scene, type);
+    double refitTime = 0, rebuildTime = 0;
+    int rebuilds = 0;
+    srand(2);
+    for (int f = 0; f < frames; f++) {
+      for (int i : moved)
+        scene->objects[i]->geom.sphere.center += 0.02f * vec3(randf()-.5f, randf()-.5f, randf()-.5f);
+
+      double start = omp_get_wtime();
+      rebuilds += refitAccel(scene, accel, moved.data(), moved.size());
+      refitTime += omp_get_wtime() - start;
+
+      start = omp_get_wtime();
+      Accel *rebuilt = initAccel(scene, type);
+      rebuildTime += omp_get_wtime() - start;
+      freeAccel(rebuilt);
+    }
+    printf("%s, %d frames moving %d of %d objects : refit %.3fs (%d rebuilds), rebuild %.3fs\n",
+           accelNames[type], frames, (int)moved.size(), 2 * n, refitTime, rebuilds, rebuildTime);
+    freeAccel(accel);
+  }
+  freeScene(scene);
+}
+
+//! shadow rays between random points answered by the nearest intersection or by the any hit query
+void benchShadow(int n) {
+  Scene *scene = initRandomScene(n);
+  const int rays = 1000000;
+  std::vector<Ray> shadowRays(rays);
+  srand(2);
+  for (Ray &ray : shadowRays) {
+    point3 a(randf()*10-5, randf()*10-5, randf()*10-5), b(randf()*10-5, randf()*10-5, randf()*10-5);
+    rayInit(&ray, a, normalize(b - a), 1e-4f, length(b - a));
+  }
+
+  printf("%d shadow rays, %d objects\n", rays, 2 * n + 1);
+  printf("accel\tnearest\toccluded\tblocked\n");
+  for (int a = 0; a < accelTypeCount; a++) {
+    Accel *accel = initAccel(scene, accelTypes[a]);
+    int nearest = 0, occluded = 0;
+    double start = omp_get_wtime();
+    for (Ray ray : shadowRays) {
+      Intersection intersection;
+      nearest += intersectAccel(scene, accel, &ray, &intersection);
+    }
+    double nearestTime = omp_get_wtime() - start;
+    start = omp_get_wtime();
+    for (Ray ray : shadowRays)
+      occluded += occludedAccel(scene, accel, &ray);
+    double occludedTime = omp_get_wtime() - start;
+    printf("%s\t%.3fs\t%.3fs\t%d%s\n", accelNames[accelTypes[a]], nearestTime, occludedTime, occluded,
+           nearest == occluded ? "" : " (mismatch)");
+    freeAccel(accel);
+  }
+  freeScene(scene);
+}
+
+//! kd-tree traversals on the coherent rays of a 1024x1024 pinhole camera and on random rays
+void benchKdTraversal(int n) {
+  Scene *scene = initRandomScene(n);
+  const int side = 1024;
+  std::vector<Ray> cameraRays(side * side), randomRays(side * side);
+  for (int j = 0; j < side; j++) {
+    for (int i = 0; i < side; i++) {
+      vec3 dir = normalize(vec3((i + .5f) / side - .5f, (j + .5f) / side - .5f, 1.f));
+      rayInit(&cameraRays[j * side + i], point3(0, 0, -15), dir);
+    }
+  }
+  srand(2);
+  for (Ray &ray : randomRays)
+    rayInit(&ray, point3(randf()*10-5, randf()*10-5, randf()*10-5), normalize(vec3(randf()-.5f, randf()-.5f, randf()-.5f)));
+
+  Eaccel types[] = {ACCEL_KDTREE, ACCEL_KDTREE_ROPES};
+  printf("%d objects, %d rays of each kind\n", 2 * n + 1, side * side);
+  printf("traversal\tcamera\trandom\n");
+  for (Eaccel type : types) {
+    Accel *accel = initAccel(scene, type);
+    printf("%s", accelNames[type]);
+    std::vector<Ray> *batches[] = {&cameraRays, &randomRays};
+    for (std::vector<Ray> *rays : batches) {
+      int hits = 0;
+      double start = omp_get_wtime();
+      for (Ray ray : *rays) {
+        Intersection intersection;
+        hits += intersectAccel(scene, accel, &ray, &intersection);
+      }
+      printf("\t%.3fs (%d)", omp_get_wtime() - start, hits);
+    }
+    printf("\n");
+    freeAccel(accel);
+  }
+  freeScene(scene);
+}
+
+//! side x side x layers spheres of radius 0.15 on a 0.3 grid, a big sphere and a ground plane,
+//  the rows of spheres of initScene1 and initScene2 grown into a block
+Scene *initSphereGridScene(int side, int layers) {
+  Scene *scene = initScene();
+  Material mat = benchMaterial();
+  for (int k = 0; k < layers; k++)
+    for (int j = 0; j < side; j++)
+      for (int i = 0; i < side; i++)
+        addObject(scene, initSphere(point3((i - side/2) * .3f, k * .3f, (j - side/2) * .3f), .15f, mat));
+  addObject(scene, initSphere(point3(-3.f, 1.f, 0.f), 2.f, mat));
+  addObject(scene, initPlane(vec3(0,1,0), .15f, mat));
+  return scene;
+}
+
+//! object tests of camera and shadow rays in the kd-tree, with and without mailboxing :
+//  spheres straddling the split planes are referenced by several leaves (the tests are only
+//  counted when the bench is compiled with ACCEL_STATS, the times are meaningful either way)
+void benchMailbox(int side) {
+  const int resolution = 512;
+  int layers[] = {1, 4};
+  printf("kdtree traversals of %dx%d camera rays and as many shadow rays\n", resolution, resolution);
+  printf("spheres\tmailbox\ttests\tskipped\ttime\thits\n");
+  for (int l : layers) {
+    Scene *scene = initSphereGridScene(side, l);
+    KdTree *tree = initKdTree(scene);
+    for (int enabled = 0; enabled < 2; enabled++) {
+      setKdTreeMailboxing(tree, enabled);
+      resetKdTreeTestCounts(tree);
+      int hits = 0;
+      double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+      for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+          Ray ray;
+          Intersection intersection;
+          vec3 dir = normalize(vec3((i + .5f) / resolution - .5f, (j + .5f) / resolution - .5f - .3f, 1.f));
+          rayInit(&ray, point3(0, 2, -side * .2f), dir);
+          if (intersectKdTree(scene, tree, &ray, &intersection)) {
+            hits++;
+            computeHitAttributes(scene, &ray, &intersection);
+            vec3 toLight = vec3(10, 10, 10) - intersection.position;
+            Ray shadowRay;
+            rayInit(&shadowRay, intersection.position, normalize(toLight), 1e-4f, length(toLight));
+            occludedKdTree(scene, tree, &shadowRay);
+          }
+        }
+      }
+      double time = omp_get_wtime() - start;
+      long long tests, skipped;
+      kdTreeTestCounts(tree, &tests, &skipped);
+      printf("%d\t%s\t%lld\t%lld\t%.3fs\t%d\n", (int)scene->objects.size() - 2, enabled ? "on" : "off", tests, skipped, time, hits);
+    }
+    freeKdTree(tree);
+    freeScene(scene);
+  }
+}
+
+//! time to the last pixel of a 512x512 camera close to one corner of the random scene, which sees a
+//  small part of it : the full BVH is built before tracing, the lazy one while tracing
+void benchLazy(int n) {
+  Scene *scene = initRandomScene(n);
+  const int resolution = 512;
+  Eaccel types[] = {ACCEL_BVH, ACCEL_LAZY_BVH};
+  printf("%d objects, %dx%d camera rays\n", 2 * n + 1, resolution, resolution);
+  printf("accel\tbuild\ttrace\ttotal\thits\n");
+  for (Eaccel type : types) {
+    double start = omp_get_wtime();
+    Accel *accel = initAccel(scene, type);
+    double buildTime = omp_get_wtime() - start;
+    int hits = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+    for (int j = 0; j < resolution; j++) {
+      for (int i = 0; i < resolution; i++) {
+        Ray ray;
+        Intersection intersection;
+        vec3 dir = normalize(vec3((i + .5f) / resolution - .5f, (j + .5f) / resolution - .5f, 1.f));
+        rayInit(&ray, point3(-4.5f, -4.5f, -4.5f), normalize(dir + vec3(-.5f, -.5f, 0)));
+        hits += intersectAccel(scene, accel, &ray, &intersection);
+      }
+    }
+    double totalTime = omp_get_wtime() - start;
+    printf("%s\t%.3fs\t%.3fs\t%.3fs\t%d\n", accelNames[type], buildTime, totalTime - buildTime, totalTime, hits);
+    freeAccel(accel);
+  }
+
+  LazyBvh *lazy = initLazyBvh(scene);
+  srand(4);
+  for (int r = 0; r < 1000; r++) {
+    Ray ray;
+    Intersection intersection;
+    rayInit(&ray, point3(-4.5f, -4.5f, -4.5f), normalize(vec3(randf()-.5f, randf()-.5f, randf())));
+    intersectLazyBvh(scene, lazy, &ray, &intersection);
+  }
+  int fullCount, built = lazyBvhNodeCount(lazy, &fullCount);
+  printf("1000 rays from the corner build %d of at most %d nodes\n", built, fullCount);
+  freeLazyBvh(lazy);
+  freeScene(scene);
+}
+
+//! n long and thin triangles along the axes, like the beams and boards of architectural meshes
+Scene *initSliverScene(int n) {
+  Scene *scene = initScene();
+  Material mat = benchMaterial();
+  srand(1);
+  for (int i = 0; i < n; i++) {
+    point3 a(randf()*10-5, randf()*10-5, randf()*10-5);
+    vec3 length = vec3(0.f), width = 0.05f * vec3(randf(), randf(), randf());
+    length[i % 3] = 2.f + 4.f * randf();
+    addObject(scene, initTriangle(a, a + length, a + width, mat));
+  }
+  return scene;
+}
+
+//! kd-tree parameters chosen by the autotuner on a sphere grid and on a triangle soup, and the time
+//  of 512x512 camera rays through the default and the tuned trees (best of 3)
+void benchTune(int n) {
+  Scene *scenes[] = {initSphereGridScene(200, 1), initSliverScene(2 * n)};
+  const char *names[] = {"sphere grid", "triangles"};
+  setCamera(scenes[0], point3(0, 8, -35), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  setCamera(scenes[1], point3(0, 0, -12), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  const int resolution = 512;
+  std::vector<Ray> rays;
+
+  printf("scene\ttuning\tleaf\tdepth\tratio\tdefault\ttuned\n");
+  for (int s = 0; s < 2; s++) {
+    Scene *scene = scenes[s];
+    double start = omp_get_wtime();
+    tuneKdTree(scene, 64);
+    double tuningTime = omp_get_wtime() - start;
+    KdTreeParams tuned = scene->kdParams;
+
+    double times[2];
+    KdTreeParams params[] = {defaultKdTreeParams(), tuned};
+    for (int p = 0; p < 2; p++) {
+      scene->kdParams = params[p];
+      Accel *accel = initAccel(scene, ACCEL_KDTREE);
+      times[p] = DBL_MAX;
+      for (int pass = 0; pass < 3; pass++) {
+        start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic)
+        for (int j = 0; j < resolution; j++) {
+          for (int i = 0; i < resolution; i++) {
+            Ray ray;
+            Intersection intersection;
+            const Camera &cam = scene->cam;
+            float x = (i + .5f) / resolution * 2.f - 1.f, y = (j + .5f) / resolution * 2.f - 1.f;
+            rayInit(&ray, cam.position, normalize(cam.center + x * cam.xdir + y / cam.aspect * cam.ydir));
+            intersectAccel(scene, accel, &ray, &intersection);
+          }
+        }
+        times[p] = std::min(times[p], omp_get_wtime() - start);
+      }
+      freeAccel(accel);
+    }
+    printf("%s\t%.3fs\t%d\t%.1f\t%.2f\t%.3fs\t%.3fs\n", names[s], tuningTime, tuned.leafSize, tuned.depthFactor,
+           tuned.costRatio, times[0], times[1]);
+    freeScene(scene);
+  }
+}
+
+//! shape of each acceleration structure, and nodes and objects visited per camera, shadow and reflection
+//  ray (those are only counted when the bench is compiled with ACCEL_STATS)
+void benchStats(int n) {
+  Scene *scene = initRandomScene(n);
+  const int resolution = 256;
+  const point3 light(0, 20, 0);
+  printf("%d objects, %dx%d camera rays, a shadow and a reflection ray per hit\n", 2 * n + 1, resolution, resolution);
+  for (int a = 0; a < accelTypeCount; a++) {
+    Accel *accel = initAccel(scene, accelTypes[a]);
+    resetTraversalStats();
+#pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < resolution; j++) {
+      for (int i = 0; i < resolution; i++) {
+        Ray ray;
+        Intersection intersection;
+        vec3 dir = normalize(vec3((i + .5f) / resolution - .5f, (j + .5f) / resolution - .5f, 1.f));
+        rayInit(&ray, point3(-4.5f, -4.5f, -4.5f), normalize(dir + vec3(-.5f, -.5f, 0)));
+        if (!intersectAccel(scene, accel, &ray, &intersection))
+          continue;
+        Ray shadow, reflected;
+        vec3 toLight = light - intersection.position;
+        rayInit(&shadow, intersection.position, normalize(toLight), 1e-4f, length(toLight));
+        occludedAccel(scene, accel, &shadow);
+        rayInit(&reflected, intersection.position, reflect(ray.dir, intersection.normal), 1e-4f, 100000, 1);
+        intersectAccel(scene, accel, &reflected, &intersection);
+      }
+    }
+    // after the rays, so that the lazy BVH shows the nodes they have built
+    printf("\n%s\n", accelNames[accelTypes[a]]);
+    printAccelStats(accel);
+    printTraversalStats();
+    freeAccel(accel);
+  }
+  freeScene(scene);
+}
+
+//! n spheres of radius 0.02 to 0.03 in a 10 units cube, like the particles of a fluid or a galaxy
+Scene *initParticleScene(int n) {
+  Scene *scene = initScene();
+  Material mat = benchMaterial();
+  srand(5);
+  for (int i = 0; i < n; i++)
+    addObject(scene, initSphere(point3(randf()*10-5, randf()*10-5, randf()*10-5), randf()*0.01f+0.02f, mat));
+  return scene;
+}
+
+//! build and trace times of the grid next to the trees, on a particle field and on the sphere grid
+//  of benchMailbox, with 512x512 camera rays and a shadow ray per hit
+void benchGrid(int n) {
+  Scene *scenes[] = {initParticleScene(n), initSphereGridScene(200, 4)};
+  const char *names[] = {"particles", "sphere grid"};
+  setCamera(scenes[0], point3(0, 0, -12), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  setCamera(scenes[1], point3(0, 8, -35), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  Eaccel types[] = {ACCEL_KDTREE, ACCEL_BVH, ACCEL_BVH4, ACCEL_GRID};
+  const int resolution = 512;
+  const point3 light(10, 20, -10);
+
+  printf("scene\t\taccel\tbuild\ttrace\thits\n");
+  for (int s = 0; s < 2; s++) {
+    Scene *scene = scenes[s];
+    for (Eaccel type : types) {
+      double start = omp_get_wtime();
+      Accel *accel = initAccel(scene, type);
+      double buildTime = omp_get_wtime() - start;
+      int hits = 0;
+      start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+      for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+          Ray ray;
+          Intersection intersection;
+          const Camera &cam = scene->cam;
+          float x = (i + .5f) / resolution * 2.f - 1.f, y = (j + .5f) / resolution * 2.f - 1.f;
+          rayInit(&ray, cam.position, normalize(cam.center + x * cam.xdir + y / cam.aspect * cam.ydir));
+          if (!intersectAccel(scene, accel, &ray, &intersection))
+            continue;
+          Ray shadow;
+          vec3 toLight = light - intersection.position;
+          rayInit(&shadow, intersection.position, normalize(toLight), 1e-4f, length(toLight));
+          hits += 1 + occludedAccel(scene, accel, &shadow);
+        }
+      }
+      printf("%s\t%s\t%.3fs\t%.3fs\t%d\n", names[s], accelNames[type], buildTime, omp_get_wtime() - start, hits);
+      freeAccel(accel);
+    }
+    freeScene(scene);
+  }
+}
+
+//! a side x side heightfield of 2 * side * side triangles, the kind of large mesh that scanned terrains
+//  and subdivided surfaces give. One object per triangle, or a single indexed mesh.
+Scene *initTerrainScene(int side, bool indexed = false) {
+  Scene *scene = initScene();
+  Material mat = benchMaterial();
+  std::vector<point3> vertices((side + 1) * (side + 1));
+  for (int j = 0; j <= side; j++) {
+    for (int i = 0; i <= side; i++) {
+      float x = i * 10.f / side - 5.f, z = j * 10.f / side - 5.f;
+      vertices[j * (side + 1) + i] = point3(x, .5f * sinf(2.f * x) * cosf(3.f * z) + .2f * sinf(7.f * x + 5.f * z), z);
+    }
+  }
+  if (indexed) {
+    std::vector<uint32_t> indices;
+    for (int j = 0; j < side; j++) {
+      for (int i = 0; i < side; i++) {
+        uint32_t v = j * (side + 1) + i;
+        uint32_t quad[6] = {v, v + 1, v + side + 2, v, v + side + 2, v + side + 1};
+        indices.insert(indices.end(), quad, quad + 6);
+      }
+    }
+    addMesh(scene, initMesh(vertices.data(), vertices.size(), indices.data(), indices.size() / 3, NULL, mat));
+    return scene;
+  }
+  for (int j = 0; j < side; j++) {
+    for (int i = 0; i < side; i++) {
+      const point3 *v = &vertices[j * (side + 1) + i];
+      addObject(scene, initTriangle(v[0], v[1], v[side + 2], mat));
+      addObject(scene, initTriangle(v[0], v[side + 2], v[side + 1], mat));
+    }
+  }
+  return scene;
+}
+
+//! memory and throughput of the 4-wide BVH with full float and with quantized child boxes, on a
+//  terrain of about n triangles seen from above at a grazing angle, and on the random scene. The compact
+//  tree keeps the leaves of the binary BVH : the full float tree with the same leaves (bvh4s) is the
+//  baseline of the quantization, the one with packet leaves (bvh4) shows the leaf policy.
+void benchCompact(int n) {
+  int side = std::max(1, (int)sqrtf(n / 2.f));
+  Scene *scenes[] = {initTerrainScene(side), initRandomScene(n / 2)};
+  const char *names[] = {"terrain", "random"};
+  setCamera(scenes[0], point3(0, 3, -7), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  setCamera(scenes[1], point3(-7, -7, -7), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+  const char *variants[] = {"bvh4", "bvh4s", "bvh4c"};
+  const int resolution = 1024;
+
+  printf("scene\taccel\tnodes\tmemory\t\tbuild\ttrace\tMrays/s\n");
+  for (int s = 0; s < 2; s++) {
+    Scene *scene = scenes[s];
+    for (int v = 0; v < 3; v++) {
+      Accel *accel = NULL;
+      Bvh4 *scalarLeaves = NULL;
+      AccelStats stats;
+      double start = omp_get_wtime();
+      if (v == 1)
+        scalarLeaves = buildBvh4(scene, 0);
+      else
+        accel = initAccel(scene, v == 0 ? ACCEL_BVH4 : ACCEL_BVH4_COMPACT);
+      double buildTime = omp_get_wtime() - start;
+      if (scalarLeaves)
+        bvh4Stats(scalarLeaves, &stats);
+      else
+        accelStats(accel, &stats);
+      // nodes of the wide trees only, their leaves are child slots
+      int nodes = stats.nodes - stats.leaves;
+      int hits = 0;
+      start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+      for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+          Ray ray;
+          Intersection intersection;
+          const Camera &cam = scene->cam;
+          float x = (i + .5f) / resolution * 2.f - 1.f, y = (j + .5f) / resolution * 2.f - 1.f;
+          rayInit(&ray, cam.position, normalize(cam.center + x * cam.xdir + y / cam.aspect * cam.ydir));
+          // the hit attributes are left out of the scalar leaf tree, they do not depend on the structure
+          hits += scalarLeaves ? intersectBvh4(scene, scalarLeaves, &ray, &intersection)
+                               : intersectAccel(scene, accel, &ray, &intersection);
+        }
+      }
+      double traceTime = omp_get_wtime() - start;
+      printf("%s\t%s\t%d\t%.1f MB\t\t%.3fs\t%.3fs\t%.2f (%d hits)\n", names[s], variants[v], nodes,
+             stats.memory / 1048576., buildTime, traceTime,
+             resolution * resolution / traceTime * 1e-6, hits);
+      if (scalarLeaves)
+        freeBvh4(scalarLeaves);
+      else
+        freeAccel(accel);
+    }
+    freeScene(scene);
+  }
+}
+
+//! sphere and triangle tests per second of the scalar tests on the compiled primitives and of the packet
+//  kernels (PACKET_WIDTH lanes), the n spheres and n triangles of the random scene against 1024 rays each.
+//  A packet counts one hit whatever the number of its lanes hit.
+void benchPackets(int n) {
+  Scene *scene = initRandomScene(n);
+  const ScenePrimitives *p = scenePrimitives(scene);
+  std::vector<SpherePacket> spheres((n + PACKET_WIDTH - 1) / PACKET_WIDTH);
+  std::vector<TrianglePacket> triangles(spheres.size());
+  for (int i = 0; i < n; i++) {
+    SpherePacket &sphere = spheres[i / PACKET_WIDTH];
+    TrianglePacket &triangle = triangles[i / PACKET_WIDTH];
+    int k = i % PACKET_WIDTH;
+    for (int a = 0; a < 3; a++) {
+      sphere.center[a][k] = p->sphereCenter[i][a];
+      triangle.v0[a][k] = p->triangleV0[i][a];
+      triangle.e1[a][k] = p->triangleEdge1[i][a];
+      triangle.e2[a][k] = p->triangleEdge2[i][a];
+    }
+    sphere.radius[k] = p->sphereRadius[i];
+    sphere.prim[k] = triangle.prim[k] = i;
+    sphere.count = triangle.count = k + 1;
+  }
+  const int rayCount = 1024;
+  std::vector<Ray> rays(rayCount);
+  for (int r = 0; r < rayCount; r++)
+    rayInit(&rays[r], point3(randf()*10-5, randf()*10-5, -6), normalize(vec3(randf()-.5f, randf()-.5f, 1.f)));
+
+  printf("%d spheres and triangles, %d rays, %d lanes\n", n, rayCount, PACKET_WIDTH);
+  printf("kernel\t\ttime\tMtests/s\thits\n");
+  const char *names[] = {"sphere", "sphere packet", "triangle", "triangle packet"};
+  for (int kernel = 0; kernel < 4; kernel++) {
+    long long hits = 0;
+    double best = DBL_MAX;
+    for (int pass = 0; pass < 3; pass++) {
+      hits = 0;
+      double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+      for (int r = 0; r < rayCount; r++) {
+        const Ray &ray = rays[r];
+        float t;
+        TriangleHit hit;
+        switch (kernel) {
+          case 0:
+            for (int i = 0; i < n; i++)
+              hits += hitSphere(&ray, p->sphereCenter[i], p->sphereRadius[i], &t);
+            break;
+          case 1:
+            for (const SpherePacket &packet : spheres)
+              hits += hitSpherePacket(&ray, &packet, &t) >= 0;
+            break;
+          case 2:
+            for (int i = 0; i < n; i++)
+              hits += hitTriangle(&ray, p->triangleV0[i], p->triangleEdge1[i], p->triangleEdge2[i], i, &hit);
+            break;
+          default:
+            for (const TrianglePacket &packet : triangles)
+              hits += hitTrianglePacket(&ray, &packet, &t) >= 0;
+        }
+      }
+      best = std::min(best, omp_get_wtime() - start);
+    }
+    printf("%-15s\t%.3fs\t%.1f\t\t%lld\n", names[kernel], best, (double)n * rayCount / best * 1e-6, hits);
+  }
+  freeScene(scene);
+}
+
+//! the terrain of about n triangles made of one object per triangle, then of one mesh : memory of the
+//  geometry (objects or mesh buffers, and compiled primitives), of the cached bounds and of the BVH4,
+//  and build and trace times of the BVH4
+void benchMesh(int n) {
+  int side = std::max(1, (int)sqrtf(n / 2.f));
+  const int resolution = 1024;
+  const char *names[] = {"objects", "mesh"};
+
+  printf("%d triangles\n", 2 * side * side);
+  printf("scene\tgeometry\tbounds\t\tbvh4\t\tbuild\ttrace\thits\n");
+  for (int indexed = 0; indexed < 2; indexed++) {
+    Scene *scene = initTerrainScene(side, indexed);
+    setCamera(scene, point3(0, 3, -7), vec3(0, 0, 0), vec3(0, 1, 0), 60, 1.f);
+    double start = omp_get_wtime();
+    Accel *accel = initAccel(scene, ACCEL_BVH4);
+    double buildTime = omp_get_wtime() - start;
+
+    const ScenePrimitives &p = scene->primitives;
+    size_t geometry = scene->objects.size() * (sizeof(Object *) + sizeof(Object))
+                    + p.type.size() * (sizeof(char) + sizeof(int))
+                    + p.triangleV0.size() * 4 * sizeof(vec3);
+    for (const Mesh *mesh : scene->meshes)
+      geometry += mesh->vertices.size() * sizeof(point3) + mesh->indices.size() * sizeof(uint32_t) + mesh->normals.size() * sizeof(vec3);
+    size_t bounds = scene->bounds.bounded.size() * (9 * sizeof(float) + sizeof(char));
+    AccelStats stats;
+    accelStats(accel, &stats);
+
+    int hits = 0;
+    start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+    for (int j = 0; j < resolution; j++) {
+      for (int i = 0; i < resolution; i++) {
+        Ray ray;
+        Intersection intersection;
+        const Camera &cam = scene->cam;
+        float x = (i + .5f) / resolution * 2.f - 1.f, y = (j + .5f) / resolution * 2.f - 1.f;
+        rayInit(&ray, cam.position, normalize(cam.center + x * cam.xdir + y / cam.aspect * cam.ydir));
+        hits += intersectAccel(scene, accel, &ray, &intersection);
+      }
+    }
+    double traceTime = omp_get_wtime() - start;
+    printf("%s\t%.1f MB\t\t%.1f MB\t\t%.1f MB\t\t%.3fs\t%.3fs\t%d\n", names[indexed], geometry / 1048576.,
+           bounds / 1048576., stats.memory / 1048576., buildTime, traceTime, hits);
+    freeAccel(accel);
+    freeScene(scene);
+  }
+}
+
+//! trace and occlusion times of the trees before and after sortSceneObjects on the random scene, whose
+//  objects are allocated in random spatial order (best of 3 passes of 1024x1024 camera rays and a shadow
+//  ray per hit). The gap is the mean distance in memory between the consecutive objects of the BVH leaves.
+void benchSort(int n) {
+  Scene *scene = initRandomScene(n);
+  Eaccel types[] = {ACCEL_KDTREE, ACCEL_BVH, ACCEL_BVH4};
+  const int resolution = 1024;
+  const point3 light(0, 20, 0);
+
+  printf("%d objects\n", 2 * n + 1);
+  printf("order\taccel\tgap\t\ttrace\n");
+  for (int sorted = 0; sorted < 2; sorted++) {
+    if (sorted) {
+      double start = omp_get_wtime();
+      sortSceneObjects(scene, NULL);
+      printf("sort time %.3fs\n", omp_get_wtime() - start);
+    }
+    Bvh *bvh = initBvh(scene);
+    double gap = 0;
+    for (unsigned int k = 1; k < bvh->prims.size(); k++)
+      gap += llabs((long long)((char *)scene->objects[bvh->prims[k]] - (char *)scene->objects[bvh->prims[k - 1]]));
+    gap /= std::max(1, (int)bvh->prims.size() - 1);
+    freeBvh(bvh);
+
+    for (Eaccel type : types) {
+      Accel *accel = initAccel(scene, type);
+      double best = DBL_MAX;
+      for (int pass = 0; pass < 3; pass++) {
+        double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic)
+        for (int j = 0; j < resolution; j++) {
+          for (int i = 0; i < resolution; i++) {
+            Ray ray;
+            Intersection intersection;
+            vec3 dir = normalize(vec3((i + .5f) / resolution - .5f, (j + .5f) / resolution - .5f, 1.f));
+            rayInit(&ray, point3(-4.5f, -4.5f, -4.5f), normalize(dir + vec3(-.5f, -.5f, 0)));
+            if (!intersectAccel(scene, accel, &ray, &intersection))
+              continue;
+            Ray shadow;
+            vec3 toLight = light - intersection.position;
+            rayInit(&shadow, intersection.position, normalize(toLight), 1e-4f, length(toLight));
+            occludedAccel(scene, accel, &shadow);
+          }
+        }
+        best = std::min(best, omp_get_wtime() - start);
+      }
+      printf("%s\t%s\t%.1f KB\t%.3fs\n", sorted ? "morton" : "insert", accelNames[type], gap / 1024., best);
+      freeAccel(accel);
+    }
+  }
+  freeScene(scene);
+}
+
+//! ray-triangle tests per second of the former edge test on the vertices and of the kernel on the
+//  precomputed triangles, n triangles of the random scene against 1024 rays each, without structure
+void benchTriangles(int n) {
+  Scene *scene = initRandomScene(n);
+  const ScenePrimitives *p = scenePrimitives(scene);
+  const int rayCount = 1024;
+  std::vector<Ray> rays(rayCount);
+  for (int r = 0; r < rayCount; r++)
+    rayInit(&rays[r], point3(randf()*10-5, randf()*10-5, -6), normalize(vec3(randf()-.5f, randf()-.5f, 1.f)));
+
+  printf("%d triangles, %d rays\n", n, rayCount);
+  printf("kernel\ttime\tMtests/s\thits\n");
+  for (int kernel = 0; kernel < 2; kernel++) {
+    long long hits = 0;
+    double best = DBL_MAX;
+    for (int pass = 0; pass < 3; pass++) {
+      hits = 0;
+      double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+      for (int r = 0; r < rayCount; r++) {
+        const Ray &ray = rays[r];
+        if (kernel == 0) {
+          for (int i = n; i < 2 * n; i++) {
+            const Geometry &geom = scene->objects[i]->geom;
+            float t;
+            hits += hitTriangleEdges(&ray, geom.triangle.v0, geom.triangle.v1, geom.triangle.v2, &t);
+          }
+        } else {
+          for (unsigned int k = 0; k < p->triangleV0.size(); k++) {
+            TriangleHit hit;
+            hits += hitTriangle(&ray, p->triangleV0[k], p->triangleEdge1[k], p->triangleEdge2[k], k, &hit);
+          }
+        }
+      }
+      best = std::min(best, omp_get_wtime() - start);
+    }
+    printf("%s\t%.3fs\t%.1f\t\t%lld\n", kernel ? "moller" : "edges", best, (double)n * rayCount / best * 1e-6, hits);
+  }
+  freeScene(scene);
+}
+
+//! rays per second of the binned BVH and of the spatial split BVH with several duplication budgets
+void benchSbvh(int n) {
+  Scene *scene = initSliverScene(n);
+  const int rays = 200000;
+  float budgets[] = {-1.f, 0.f, 0.1f, 0.3f, 1.f, 4.f};
+
+  printf("%d long triangles, %d random rays\n", n, rays);
+  printf("builder\tbudget\tbuild\tnodes\trefs\tsah\tMrays/s\thits\n");
+  for (float budget : budgets) {
+    double start = omp_get_wtime();
+    Bvh *bvh = budget < 0 ? initBvh(scene) : initSbvh(scene, budget);
+    double buildTime = omp_get_wtime() - start;
+
+    int hits = 0;
+    srand(2);
+    start = omp_get_wtime();
+    for (int r = 0; r < rays; r++) {
+      Ray ray;
+      Intersection intersection;
+      rayInit(&ray, point3(randf()*12-6, randf()*12-6, randf()*12-6), normalize(vec3(randf()-.5f, randf()-.5f, randf()-.5f)));
+      hits += intersectBvh(scene, bvh, &ray, &intersection);
+    }
+    double traceTime = omp_get_wtime() - start;
+    if (budget < 0)
+      printf("binned\t-");
+    else
+      printf("sbvh\t%.1f", budget);
+    printf("\t%.3fs\t%d\t%d\t%.1f\t%.2f\t%d\n", buildTime, (int)bvh->nodes.size(), (int)bvh->prims.size(),
+           bvh->buildCost, rays / traceTime * 1e-6, hits);
+    freeBvh(bvh);
+  }
+  freeScene(scene);
+}
+
+//! 10000 instances of a prototype of n spheres and n triangles : the objects are stored once,
+//  the structures are built for the prototype and for the instances
+void benchInstances(int n) {
+  Scene *prototype = initRandomScene(n);
+  // an unbounded plane would make every instance unbounded
+  freeObject(prototype->objects.back());
+  prototype->objects.pop_back();
+  Scene *scene = initScene();
+  addPrototype(scene, prototype);
+  const int side = 100;
+  for (int i = 0; i < side; i++)
+    for (int j = 0; j < side; j++)
+      addObject(scene, initInstance(prototype, mat3(0.1f), vec3((i - side/2) * 1.2f, 0, (j - side/2) * 1.2f)));
+
+  for (int a = 0; a < accelTypeCount; a++) {
+    scene->accel = prototype->accel = accelTypes[a];
+    double start = omp_get_wtime();
+    Accel *accel = initAccel(scene, accelTypes[a]);
+    double buildTime = omp_get_wtime() - start;
+
+    const int rays = 1000000;
+    int hits = 0;
+    srand(3);
+    start = omp_get_wtime();
+    for (int r = 0; r < rays; r++) {
+      Ray ray;
+      Intersection intersection;
+      rayInit(&ray, point3(randf()*120-60, 10, randf()*120-60), normalize(vec3(randf()-.5f, -1, randf()-.5f)));
+      hits += intersectAccel(scene, accel, &ray, &intersection);
+    }
+    printf("%s, %d instances of %d objects : build %.3fs, %d rays %.3fs (%d hits)\n",
+           accelNames[accelTypes[a]], side * side, (int)prototype->objects.size(), buildTime, rays, omp_get_wtime() - start, hits);
+    freeAccel(accel);
+    freeAccel(prototype->bottomLevel);
+    prototype->bottomLevel = NULL;
+  }
+  freeScene(scene);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    printf("usage : %s test n\n", argv[0]);
+    printf("        test : build, refit, instances, sbvh, shadow, kdtraversal, mailbox, lazy, tune, stats, grid, compact, sort, triangles, mesh, packets\n");
+    printf("        n : number of spheres and of triangles, spheres per side of the grid for mailbox, optional\n");
+    exit(0);
+  }
+
+  int n = 100000;
+  if (argc == 3)
+    n = atoi(argv[2]);
+
+  if (!strcmp(argv[1], "build")) {
+    benchBuild(n);
+  } else if (!strcmp(argv[1], "refit")) {
+    benchRefit(n);
+  } else if (!strcmp(argv[1], "instances")) {
+    benchInstances(n);
+  } else if (!strcmp(argv[1], "sbvh")) {
+    benchSbvh(n);
+  } else if (!strcmp(argv[1], "shadow")) {
+    benchShadow(n);
+  } else if (!strcmp(argv[1], "kdtraversal")) {
+    benchKdTraversal(n);
+  } else if (!strcmp(argv[1], "mailbox")) {
+    benchMailbox(argc == 3 ? n : 100);
+  } else if (!strcmp(argv[1], "lazy")) {
+    benchLazy(n);
+  } else if (!strcmp(argv[1], "tune")) {
+    benchTune(n);
+  } else if (!strcmp(argv[1], "stats")) {
+    benchStats(n);
+  } else if (!strcmp(argv[1], "grid")) {
+    benchGrid(n);
+  } else if (!strcmp(argv[1], "compact")) {
+    benchCompact(n);
+  } else if (!strcmp(argv[1], "sort")) {
+    benchSort(n);
+  } else if (!strcmp(argv[1], "triangles")) {
+    benchTriangles(n);
+  } else if (!strcmp(argv[1], "mesh")) {
+    benchMesh(n);
+  } else if (!strcmp(argv[1], "packets")) {
+    benchPackets(n);
+  } else {
+    printf("unknown test %s\n", argv[1]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,775 @@
+#include "kdtree.h"
+#include "kdtree_types.h"
+#include "defines.h"
+#include "scene.h"
+#include "scene_types.h"
+#include <stdio.h>
+#include <cassert>
+#include <climits>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	4-wide bounding volume hierarchy, obtained by collapsing the binary BVH.
+ *  The four child boxes of a node are stored as structure of arrays so that one
+ *  SSE slab test intersects the ray with all of them. Subtrees of up to PACKET_WIDTH
+ *  objects become leaves whose spheres and triangles are tested by packets.
+ */
+
+#define BVH4_WIDTH 4
+#define BVH4_EMPTY -1
+//! subtrees of the binary BVH with at most this many objects are collapsed into one leaf
+#define BVH4_PACKET_LEAF PACKET_WIDTH
+
+typedef struct s_bvh4Node {
+  float bmin[3][BVH4_WIDTH]; //! min pos of the child boxes, one row per axis
+  float bmax[3][BVH4_WIDTH]; //! max pos of the child boxes, one row per axis
+  int child[BVH4_WIDTH]; //! index of the child node, of the leaf in bvh4->leaves for a leaf, BVH4_EMPTY if unused
+  int count[BVH4_WIDTH]; //! number of objects if the child is a leaf, 0 otherwise
+} Bvh4Node;
+
+//! the objects of a leaf : those tested one by one first, then the packed spheres and triangles.
+//  Their rows only take as many lanes as the leaf has spheres or triangles, they are tested
+//  PACKET_WIDTH lanes at a time.
+typedef struct s_bvh4Leaf {
+  int firstPrim; //! in bvh4->prims
+  int otherCount; //! objects tested one by one
+  int sphereCount; //! packed spheres, after the other objects in bvh4->prims
+  int triangleCount; //! packed triangles, after the spheres
+  int lanes; //! first row of the spheres in bvh4->lanes, the rows of the triangles follow
+} Bvh4Leaf;
+
+struct s_bvh4 {
+  std::vector<Bvh4Node> nodes;
+  std::vector<Bvh4Leaf> leaves;
+  std::vector<int> prims; //! object indices referenced by the leaves
+  std::vector<float> lanes; //! rows of the packed leaves, PACKET_WIDTH floats of padding at the end
+
+  std::vector<int> outOfTree;
+};
+
+//! objects of the subtree of a binary node, they are consecutive in bvh->prims
+inline void bvhSubtreeRange(const Bvh *bvh, int index, int *first, int *count) {
+  int left = index, right = index;
+  while (bvh->nodes[left].count == 0)
+    left++;
+  while (bvh->nodes[right].count == 0)
+    right = bvh->nodes[right].secondChild;
+  *first = bvh->nodes[left].primOffset;
+  *count = bvh->nodes[right].primOffset + bvh->nodes[right].count - *first;
+}
+
+//! a binary node taken as a leaf of the wide tree
+inline bool bvh4Leaf(const Bvh *bvh, int index, int leafSize) {
+  if (bvh->nodes[index].count > 0)
+    return true;
+  int first, count;
+  bvhSubtreeRange(bvh, index, &first, &count);
+  return count <= leafSize;
+}
+
+// Pull up to four descendants of the binary node into one wide node, always opening the
+// interior child with the largest surface
+int collapseBvhNode(const Bvh *bvh, Bvh4 *wide, int binaryIndex, int leafSize) {
+  int children[BVH4_WIDTH];
+  int n = 0;
+
+  const BvhNode &binary = bvh->nodes[binaryIndex];
+  if (bvh4Leaf(bvh, binaryIndex, leafSize)) {
+    children[n++] = binaryIndex;
+  } else {
+    children[n++] = binaryIndex + 1;
+    children[n++] = binary.secondChild;
+  }
+
+  bool leaf[BVH4_WIDTH];
+  for (int i = 0; i < n; i++)
+    leaf[i] = bvh4Leaf(bvh, children[i], leafSize);
+  while (n < BVH4_WIDTH) {
+    int best = -1;
+    float bestArea = -1;
+    for (int i = 0; i < n; i++) {
+      const BvhNode &c = bvh->nodes[children[i]];
+      float area = surfaceArea(c.min, c.max);
+      if (!leaf[i] && area > bestArea) {
+        bestArea = area;
+        best = i;
+      }
+    }
+    if (best < 0) break;
+    int opened = children[best];
+    children[best] = opened + 1;
+    children[n++] = bvh->nodes[opened].secondChild;
+    leaf[best] = bvh4Leaf(bvh, children[best], leafSize);
+    leaf[n - 1] = bvh4Leaf(bvh, children[n - 1], leafSize);
+  }
+
+  int nodeIndex = wide->nodes.size();
+  wide->nodes.push_back(Bvh4Node());
+
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    Bvh4Node &node = wide->nodes[nodeIndex];
+    if (i >= n) {
+      // empty box, never hit
+      for (int a = 0; a < 3; a++) {
+        node.bmin[a][i] = FLT_MAX;
+        node.bmax[a][i] = -FLT_MAX;
+      }
+      node.child[i] = BVH4_EMPTY;
+      node.count[i] = 0;
+      continue;
+    }
+    const BvhNode &c = bvh->nodes[children[i]];
+    for (int a = 0; a < 3; a++) {
+      node.bmin[a][i] = c.min[a];
+      node.bmax[a][i] = c.max[a];
+    }
+    if (leaf[i]) {
+      Bvh4Leaf l;
+      bvhSubtreeRange(bvh, children[i], &l.firstPrim, &node.count[i]);
+      l.otherCount = node.count[i];
+      l.sphereCount = l.triangleCount = 0;
+      l.lanes = 0;
+      node.child[i] = wide->leaves.size();
+      wide->leaves.push_back(l);
+    } else {
+      node.count[i] = 0;
+      int child = collapseBvhNode(bvh, wide, children[i], leafSize);
+      wide->nodes[nodeIndex].child[i] = child;
+    }
+  }
+  return nodeIndex;
+}
+
+//! move the spheres and the triangles of the leaf at its end and pack them
+void packBvh4Leaf(const Scene *scene, Bvh4 *wide, Bvh4Leaf &leaf) {
+  const ScenePrimitives &p = scene->primitives;
+  int *prims = &wide->prims[leaf.firstPrim];
+  int count = leaf.otherCount;
+  int *spheres = std::stable_partition(prims, prims + count, [&](int i) { return p.type[i] != SPHERE && p.type[i] != TRIANGLE && p.type[i] != MESH; });
+  int *triangles = std::stable_partition(spheres, prims + count, [&](int i) { return p.type[i] == SPHERE; });
+  leaf.otherCount = spheres - prims;
+  leaf.sphereCount = triangles - spheres;
+  leaf.triangleCount = prims + count - triangles;
+  leaf.lanes = wide->lanes.size();
+
+  // rows of the hitSphereLanes and hitTriangleLanes layouts, as long as the leaf has lanes
+  int sphereCount = leaf.sphereCount, triangleCount = leaf.triangleCount;
+  wide->lanes.resize(leaf.lanes + 4 * sphereCount + 9 * triangleCount);
+  float *row = &wide->lanes[leaf.lanes];
+  for (int k = 0; k < sphereCount; k++) {
+    int slot = p.slot[spheres[k]];
+    for (int a = 0; a < 3; a++)
+      row[a * sphereCount + k] = p.sphereCenter[slot][a];
+    row[3 * sphereCount + k] = p.sphereRadius[slot];
+  }
+  row += 4 * sphereCount;
+  for (int k = 0; k < triangleCount; k++) {
+    point3 v[3];
+    primitiveTriangle(scene, triangles[k], v);
+    for (int a = 0; a < 3; a++) {
+      row[a * triangleCount + k] = v[0][a];
+      row[(3 + a) * triangleCount + k] = (v[1] - v[0])[a];
+      row[(6 + a) * triangleCount + k] = (v[2] - v[0])[a];
+    }
+  }
+}
+
+Bvh4* buildBvh4(Scene *scene, int leafSize) {
+  Bvh4 *wide = new Bvh4();
+  Bvh *bvh = initBvh(scene);
+
+  wide->outOfTree = bvh->outOfTree;
+  if (!bvh->nodes.empty()) {
+    wide->nodes.reserve(bvh->nodes.size() / 2 + 1);
+    collapseBvhNode(bvh, wide, 0, leafSize);
+    wide->prims.swap(bvh->prims);
+  }
+  if (leafSize > 0) {
+    for (Bvh4Leaf &leaf : wide->leaves)
+      packBvh4Leaf(scene, wide, leaf);
+    // the kernels load whole registers from the last rows
+    wide->lanes.resize(wide->lanes.size() + PACKET_WIDTH, 0.f);
+    wide->lanes.shrink_to_fit();
+  }
+
+  freeBvh(bvh);
+  return wide;
+}
+
+Bvh4* initBvh4(Scene *scene) {
+  return buildBvh4(scene, BVH4_PACKET_LEAF);
+}
+
+void freeBvh4(Bvh4 *wide) {
+  delete wide;
+}
+
+//! slab test of the ray against the four child boxes of node.
+//  Return a bit mask of the children hit and their entry distances in tnear.
+inline int intersectBvh4Node(const Bvh4Node &node, const Ray *ray, float tnear[BVH4_WIDTH]) {
+#ifdef __SSE__
+  const int sx = ray->sign[0], sy = ray->sign[1], sz = ray->sign[2];
+  // near and far planes are selected once from the ray direction
+  __m128 nearX = _mm_loadu_ps(sx ? node.bmax[0] : node.bmin[0]);
+  __m128 farX  = _mm_loadu_ps(sx ? node.bmin[0] : node.bmax[0]);
+  __m128 nearY = _mm_loadu_ps(sy ? node.bmax[1] : node.bmin[1]);
+  __m128 farY  = _mm_loadu_ps(sy ? node.bmin[1] : node.bmax[1]);
+  __m128 nearZ = _mm_loadu_ps(sz ? node.bmax[2] : node.bmin[2]);
+  __m128 farZ  = _mm_loadu_ps(sz ? node.bmin[2] : node.bmax[2]);
+
+  __m128 ox = _mm_set1_ps(ray->orig.x), oy = _mm_set1_ps(ray->orig.y), oz = _mm_set1_ps(ray->orig.z);
+  __m128 ix = _mm_set1_ps(ray->invdir.x), iy = _mm_set1_ps(ray->invdir.y), iz = _mm_set1_ps(ray->invdir.z);
+
+  __m128 t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearX, ox), ix), _mm_set1_ps(ray->tmin));
+  __m128 t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farX, ox), ix), _mm_set1_ps(ray->tmax));
+  t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(nearY, oy), iy));
+  t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(farY, oy), iy));
+  t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(nearZ, oz), iz));
+  t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(farZ, oz), iz));
+
+  _mm_storeu_ps(tnear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    float t0 = ray->tmin, t1 = ray->tmax;
+    for (int a = 0; a < 3; a++) {
+      float n = ((ray->sign[a] ? node.bmax[a][i] : node.bmin[a][i]) - ray->orig[a]) * ray->invdir[a];
+      float f = ((ray->sign[a] ? node.bmin[a][i] : node.bmax[a][i]) - ray->orig[a]) * ray->invdir[a];
+      t0 = n > t0 ? n : t0;
+      t1 = f < t1 ? f : t1;
+    }
+    tnear[i] = t0;
+    if (t0 <= t1) mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+//! the packet tests only give the lanes that may be hit and lower bounds of their distances, the scalar
+//  test confirms them and gives the attributes, nearest bound first, until the bound passes the hit.
+inline bool intersectPacketLanes(const Scene *scene, const int *prims, int mask, float t[PACKET_WIDTH], Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+  float nearest;
+  int lane;
+  while ((lane = nearestLane(mask, t, &nearest)) >= 0 && nearest <= ray->tmax) {
+    mask &= ~(1 << lane);
+    hasIntersection |= intersectPrimitive(scene, prims[lane], ray, intersection);
+  }
+  return hasIntersection;
+}
+
+inline bool intersectBvh4Leaf(const Scene *scene, const Bvh4 *wide, const Bvh4Leaf &leaf, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+  const int *prims = &wide->prims[leaf.firstPrim];
+  for (int p = 0; p < leaf.otherCount; p++)
+    hasIntersection |= intersectPrimitive(scene, prims[p], ray, intersection);
+
+  float t[PACKET_WIDTH];
+  const int *spheres = prims + leaf.otherCount;
+  const float *lanes = wide->lanes.data() + leaf.lanes;
+  for (int k = 0; k < leaf.sphereCount; k += PACKET_WIDTH) {
+    int mask = hitSphereLanes(ray, lanes + k, leaf.sphereCount, std::min(PACKET_WIDTH, leaf.sphereCount - k), t);
+    if (mask != 0)
+      hasIntersection |= intersectPacketLanes(scene, spheres + k, mask, t, ray, intersection);
+  }
+  const int *triangles = spheres + leaf.sphereCount;
+  lanes += 4 * leaf.sphereCount;
+  for (int k = 0; k < leaf.triangleCount; k += PACKET_WIDTH) {
+    int mask = hitTriangleLanes(ray, lanes + k, leaf.triangleCount, std::min(PACKET_WIDTH, leaf.triangleCount - k), t);
+    if (mask != 0)
+      hasIntersection |= intersectPacketLanes(scene, triangles + k, mask, t, ray, intersection);
+  }
+  return hasIntersection;
+}
+
+//! any of the lanes that may be hit is an occluder once confirmed by the scalar test
+inline bool occludedPacketLanes(const Scene *scene, const int *prims, int mask, Ray *ray) {
+  for (int k = 0; mask != 0; k++, mask >>= 1) {
+    if ((mask & 1) && occludedPrimitive(scene, prims[k], ray))
+      return true;
+  }
+  return false;
+}
+
+inline bool occludedBvh4Leaf(const Scene *scene, const Bvh4 *wide, const Bvh4Leaf &leaf, Ray *ray) {
+  const int *prims = &wide->prims[leaf.firstPrim];
+  for (int p = 0; p < leaf.otherCount; p++) {
+    if (occludedPrimitive(scene, prims[p], ray))
+      return true;
+  }
+  float t[PACKET_WIDTH];
+  const int *spheres = prims + leaf.otherCount;
+  const float *lanes = wide->lanes.data() + leaf.lanes;
+  for (int k = 0; k < leaf.sphereCount; k += PACKET_WIDTH) {
+    int mask = hitSphereLanes(ray, lanes + k, leaf.sphereCount, std::min(PACKET_WIDTH, leaf.sphereCount - k), t);
+    if (occludedPacketLanes(scene, spheres + k, mask, ray))
+      return true;
+  }
+  const int *triangles = spheres + leaf.sphereCount;
+  lanes += 4 * leaf.sphereCount;
+  for (int k = 0; k < leaf.triangleCount; k += PACKET_WIDTH) {
+    int mask = hitTriangleLanes(ray, lanes + k, leaf.triangleCount, std::min(PACKET_WIDTH, leaf.triangleCount - k), t);
+    if (occludedPacketLanes(scene, triangles + k, mask, ray))
+      return true;
+  }
+  return false;
+}
+
+typedef struct s_bvh4StackEntry {
+  float tnear;
+  int node;
+} Bvh4StackEntry;
+
+bool intersectBvh4(Scene *scene, Bvh4 *wide, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : wide->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  if (wide->nodes.empty())
+    return hasIntersection;
+
+  // the wide tree is no deeper than the binary one, less than BVH_STACK_SIZE levels, and each
+  // level leaves at most BVH4_WIDTH - 1 entries on the stack
+  Bvh4StackEntry stack[BVH_STACK_SIZE * BVH4_WIDTH];
+  int stackSize = 0;
+  stack[stackSize++] = {ray->tmin, 0};
+
+  while (stackSize > 0) {
+    Bvh4StackEntry entry = stack[--stackSize];
+    // a closer hit has been found since this node was pushed
+    if (entry.tnear > ray->tmax)
+      continue;
+
+    const Bvh4Node &node = wide->nodes[entry.node];
+    STATS_NODE();
+    float tnear[BVH4_WIDTH];
+    int mask = intersectBvh4Node(node, ray, tnear);
+
+    // sort the children hit by distance, the nearest one is pushed last
+    int order[BVH4_WIDTH];
+    int n = 0;
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (!(mask & (1 << i))) continue;
+      int j = n++;
+      while (j > 0 && tnear[order[j - 1]] < tnear[i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
+    }
+
+    for (int k = 0; k < n; k++) {
+      int i = order[k];
+      if (node.count[i] > 0) {
+        continue;
+      }
+      assert(stackSize < BVH_STACK_SIZE * BVH4_WIDTH);
+      stack[stackSize++] = {tnear[i], node.child[i]};
+    }
+
+    // leaves are intersected right away, nearest first
+    for (int k = n - 1; k >= 0; k--) {
+      int i = order[k];
+      if (node.count[i] == 0 || tnear[i] > ray->tmax)
+        continue;
+      hasIntersection |= intersectBvh4Leaf(scene, wide, wide->leaves[node.child[i]], ray, intersection);
+    }
+  }
+
+  return hasIntersection;
+}
+
+bool occludedBvh4(Scene *scene, Bvh4 *wide, Ray *ray) {
+  for (int i : wide->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  if (wide->nodes.empty())
+    return false;
+
+  int stack[BVH_STACK_SIZE * BVH4_WIDTH];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  // any hit will do, the children hit are not sorted
+  while (stackSize > 0) {
+    const Bvh4Node &node = wide->nodes[stack[--stackSize]];
+    STATS_NODE();
+    float tnear[BVH4_WIDTH];
+    int mask = intersectBvh4Node(node, ray, tnear);
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (!(mask & (1 << i))) continue;
+      if (node.count[i] == 0) {
+        assert(stackSize < BVH_STACK_SIZE * BVH4_WIDTH);
+        stack[stackSize++] = node.child[i];
+        continue;
+      }
+      if (occludedBvh4Leaf(scene, wide, wide->leaves[node.child[i]], ray))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+void bvh4Stats(const Bvh4 *wide, AccelStats *stats) {
+  initAccelStats(stats);
+  stats->objects = wide->prims.size();
+  stats->memory = sizeof(Bvh4) + wide->nodes.size() * sizeof(Bvh4Node) + wide->leaves.size() * sizeof(Bvh4Leaf)
+                + wide->lanes.size() * sizeof(float)
+                + (wide->prims.size() + wide->outOfTree.size()) * sizeof(int);
+  if (wide->nodes.empty())
+    return;
+
+  // the area of a wide node is the one of the union of its child boxes
+  float rootArea = 0;
+  std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+  while (!stack.empty()) {
+    int index = stack.back().first, depth = stack.back().second;
+    stack.pop_back();
+    const Bvh4Node &node = wide->nodes[index];
+    vec3 nodeMin = vec3(FLT_MAX), nodeMax = vec3(-FLT_MAX);
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (node.child[i] == BVH4_EMPTY)
+        continue;
+      vec3 childMin(node.bmin[0][i], node.bmin[1][i], node.bmin[2][i]);
+      vec3 childMax(node.bmax[0][i], node.bmax[1][i], node.bmax[2][i]);
+      nodeMin = min(nodeMin, childMin);
+      nodeMax = max(nodeMax, childMax);
+      if (node.count[i] > 0)
+        addNodeStats(stats, depth + 1, true, node.count[i], surfaceArea(childMin, childMax));
+      else
+        stack.push_back(std::make_pair(node.child[i], depth + 1));
+    }
+    addNodeStats(stats, depth, false, 0, surfaceArea(nodeMin, nodeMax));
+    if (index == 0)
+      rootArea = surfaceArea(nodeMin, nodeMax);
+  }
+  stats->sahCost /= rootArea;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Compact 4-wide BVH : the child boxes are quantized to 8 bits in the box of their
+ *  node, with a power of two step per axis, and rounded outwards so that a quantized
+ *  box always contains the exact one. The interior children of a node are stored next
+ *  to each other, as are the objects of its leaves, so a node only keeps two offsets.
+ */
+
+#define BVH4_QUANTA 255
+
+typedef struct s_compactBvh4Node {
+  float origin[3]; //! min corner of the node box, child box i spans origin + q * 2^exponent
+  int firstChild; //! index of the first interior child, the other ones follow
+  int firstPrim; //! first object of the leaves in compact->prims, the leaves follow in child order
+  signed char exponent[3];
+  unsigned char innerMask; //! bit i is set if child i is an interior node
+  unsigned char count[BVH4_WIDTH]; //! number of objects if child i is a leaf, 0 otherwise
+  unsigned char qmin[3][BVH4_WIDTH]; //! quantized child boxes, one row per axis, empty children never hit
+  unsigned char qmax[3][BVH4_WIDTH];
+} CompactBvh4Node;
+
+struct s_compactBvh4 {
+  std::vector<CompactBvh4Node> nodes;
+  std::vector<int> prims;
+
+  std::vector<int> outOfTree;
+};
+
+//! 2^exponent, built from the bits of the float
+inline float exponentScale(int exponent) {
+  unsigned int bits = (unsigned int)(exponent + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(float));
+  return scale;
+}
+
+//! smallest exponent whose step covers extent in less than BVH4_QUANTA steps
+int quantizationExponent(float extent) {
+  int exponent;
+  frexpf(extent / (BVH4_QUANTA - 1), &exponent);
+  return std::max(-126, std::min(127, exponent));
+}
+
+//! fill the compact node dst from the wide node src, then its interior children
+void compactBvh4Node(const Bvh4 *wide, CompactBvh4 *compact, int src, int dst) {
+  const Bvh4Node &node = wide->nodes[src];
+  CompactBvh4Node out;
+
+  vec3 nodeMin = vec3(FLT_MAX), nodeMax = vec3(-FLT_MAX);
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    if (node.child[i] == BVH4_EMPTY)
+      continue;
+    nodeMin = min(nodeMin, vec3(node.bmin[0][i], node.bmin[1][i], node.bmin[2][i]));
+    nodeMax = max(nodeMax, vec3(node.bmax[0][i], node.bmax[1][i], node.bmax[2][i]));
+  }
+
+  for (int a = 0; a < 3; a++) {
+    out.origin[a] = nodeMin[a];
+    out.exponent[a] = quantizationExponent(nodeMax[a] - nodeMin[a]);
+    float scale = exponentScale(out.exponent[a]);
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (node.child[i] == BVH4_EMPTY) {
+        out.qmin[a][i] = BVH4_QUANTA;
+        out.qmax[a][i] = 0;
+        continue;
+      }
+      // rounded outwards, checked against the decoding of the traversal
+      int lo = std::max(0, int(floorf((node.bmin[a][i] - out.origin[a]) / scale)));
+      int hi = std::min(BVH4_QUANTA, int(ceilf((node.bmax[a][i] - out.origin[a]) / scale)));
+      while (lo > 0 && out.origin[a] + lo * scale > node.bmin[a][i])
+        lo--;
+      while (hi < BVH4_QUANTA && out.origin[a] + hi * scale < node.bmax[a][i])
+        hi++;
+      out.qmin[a][i] = lo;
+      out.qmax[a][i] = hi;
+    }
+  }
+
+  out.firstChild = compact->nodes.size();
+  out.firstPrim = compact->prims.size();
+  out.innerMask = 0;
+  int inner = 0;
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    // leaves forced by the depth cap of the binary build could hold more objects than a byte
+    assert(node.child[i] == BVH4_EMPTY || node.count[i] <= UCHAR_MAX);
+    out.count[i] = node.child[i] == BVH4_EMPTY ? 0 : node.count[i];
+    if (node.child[i] != BVH4_EMPTY && node.count[i] == 0) {
+      out.innerMask |= 1 << i;
+      inner++;
+    }
+    for (int p = 0; p < out.count[i]; p++)
+      compact->prims.push_back(wide->prims[wide->leaves[node.child[i]].firstPrim + p]);
+  }
+  compact->nodes.resize(compact->nodes.size() + inner);
+  compact->nodes[dst] = out;
+
+  int child = out.firstChild;
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    if (out.innerMask & (1 << i))
+      compactBvh4Node(wide, compact, node.child[i], child++);
+  }
+}
+
+CompactBvh4* initCompactBvh4(Scene *scene) {
+  CompactBvh4 *compact = new CompactBvh4();
+  Bvh4 *wide = buildBvh4(scene, 0);
+
+  compact->outOfTree = wide->outOfTree;
+  if (!wide->nodes.empty()) {
+    compact->nodes.reserve(wide->nodes.size());
+    compact->prims.reserve(wide->prims.size());
+    compact->nodes.resize(1);
+    compactBvh4Node(wide, compact, 0, 0);
+  }
+
+  freeBvh4(wide);
+  return compact;
+}
+
+void freeCompactBvh4(CompactBvh4 *compact) {
+  delete compact;
+}
+
+//! same as intersectBvh4Node once the child boxes are decoded
+inline int intersectCompactBvh4Node(const CompactBvh4Node &node, const Ray *ray, float tnear[BVH4_WIDTH]) {
+#ifdef __SSE2__
+  __m128 t0 = _mm_set1_ps(ray->tmin), t1 = _mm_set1_ps(ray->tmax);
+  for (int a = 0; a < 3; a++) {
+    const unsigned char *qnear = ray->sign[a] ? node.qmax[a] : node.qmin[a];
+    const unsigned char *qfar = ray->sign[a] ? node.qmin[a] : node.qmax[a];
+    int nearBits, farBits;
+    memcpy(&nearBits, qnear, sizeof(int));
+    memcpy(&farBits, qfar, sizeof(int));
+    // four bytes widened to four floats
+    __m128i zero = _mm_setzero_si128();
+    __m128i qn = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(nearBits), zero), zero);
+    __m128i qf = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(farBits), zero), zero);
+    __m128 origin = _mm_set1_ps(node.origin[a]), scale = _mm_set1_ps(exponentScale(node.exponent[a]));
+    __m128 o = _mm_set1_ps(ray->orig[a]), inv = _mm_set1_ps(ray->invdir[a]);
+    __m128 nearPlane = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(qn), scale));
+    __m128 farPlane = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(qf), scale));
+    t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(nearPlane, o), inv));
+    t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(farPlane, o), inv));
+  }
+  _mm_storeu_ps(tnear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for (int i = 0; i < BVH4_WIDTH; i++) {
+    float t0 = ray->tmin, t1 = ray->tmax;
+    for (int a = 0; a < 3; a++) {
+      float scale = exponentScale(node.exponent[a]);
+      float n = node.origin[a] + (ray->sign[a] ? node.qmax[a][i] : node.qmin[a][i]) * scale;
+      float f = node.origin[a] + (ray->sign[a] ? node.qmin[a][i] : node.qmax[a][i]) * scale;
+      n = (n - ray->orig[a]) * ray->invdir[a];
+      f = (f - ray->orig[a]) * ray->invdir[a];
+      t0 = n > t0 ? n : t0;
+      t1 = f < t1 ? f : t1;
+    }
+    tnear[i] = t0;
+    if (t0 <= t1) mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+bool intersectCompactBvh4(Scene *scene, CompactBvh4 *compact, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : compact->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  if (compact->nodes.empty())
+    return hasIntersection;
+
+  // same bound as the wide tree it is compacted from
+  Bvh4StackEntry stack[BVH_STACK_SIZE * BVH4_WIDTH];
+  int stackSize = 0;
+  stack[stackSize++] = {ray->tmin, 0};
+
+  while (stackSize > 0) {
+    Bvh4StackEntry entry = stack[--stackSize];
+    if (entry.tnear > ray->tmax)
+      continue;
+
+    const CompactBvh4Node &node = compact->nodes[entry.node];
+    STATS_NODE();
+    float tnear[BVH4_WIDTH];
+    int mask = intersectCompactBvh4Node(node, ray, tnear);
+
+    // offsets of the interior children and of the leaves, in child order
+    int childIndex[BVH4_WIDTH], primIndex[BVH4_WIDTH];
+    int child = node.firstChild, prim = node.firstPrim;
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      childIndex[i] = child;
+      primIndex[i] = prim;
+      child += (node.innerMask >> i) & 1;
+      prim += node.count[i];
+    }
+
+    int order[BVH4_WIDTH];
+    int n = 0;
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (!(mask & (1 << i))) continue;
+      int j = n++;
+      while (j > 0 && tnear[order[j - 1]] < tnear[i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
+    }
+
+    for (int k = 0; k < n; k++) {
+      int i = order[k];
+      if (node.innerMask & (1 << i)) {
+        assert(stackSize < BVH_STACK_SIZE * BVH4_WIDTH);
+        stack[stackSize++] = {tnear[i], childIndex[i]};
+      }
+    }
+
+    for (int k = n - 1; k >= 0; k--) {
+      int i = order[k];
+      if (node.count[i] == 0 || tnear[i] > ray->tmax)
+        continue;
+      for (int p = primIndex[i]; p < primIndex[i] + node.count[i]; p++)
+        hasIntersection |= intersectPrimitive(scene, compact->prims[p], ray, intersection);
+    }
+  }
+
+  return hasIntersection;
+}
+
+bool occludedCompactBvh4(Scene *scene, CompactBvh4 *compact, Ray *ray) {
+  for (int i : compact->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  if (compact->nodes.empty())
+    return false;
+
+  int stack[BVH_STACK_SIZE * BVH4_WIDTH];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+    const CompactBvh4Node &node = compact->nodes[stack[--stackSize]];
+    STATS_NODE();
+    float tnear[BVH4_WIDTH];
+    int mask = intersectCompactBvh4Node(node, ray, tnear);
+    int child = node.firstChild, prim = node.firstPrim;
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      if (mask & (1 << i)) {
+        if (node.innerMask & (1 << i)) {
+          assert(stackSize < BVH_STACK_SIZE * BVH4_WIDTH);
+          stack[stackSize++] = child;
+        }
+        for (int p = prim; p < prim + node.count[i]; p++) {
+          if (occludedPrimitive(scene, compact->prims[p], ray))
+            return true;
+        }
+      }
+      child += (node.innerMask >> i) & 1;
+      prim += node.count[i];
+    }
+  }
+
+  return false;
+}
+
+void compactBvh4Stats(const CompactBvh4 *compact, AccelStats *stats) {
+  initAccelStats(stats);
+  stats->objects = compact->prims.size();
+  stats->memory = sizeof(CompactBvh4) + compact->nodes.size() * sizeof(CompactBvh4Node)
+                + (compact->prims.size() + compact->outOfTree.size()) * sizeof(int);
+  if (compact->nodes.empty())
+    return;
+
+  // areas of the quantized boxes, the ones actually traversed
+  float rootArea = 0;
+  std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+  while (!stack.empty()) {
+    int index = stack.back().first, depth = stack.back().second;
+    stack.pop_back();
+    const CompactBvh4Node &node = compact->nodes[index];
+    vec3 nodeMin = vec3(FLT_MAX), nodeMax = vec3(-FLT_MAX);
+    int child = node.firstChild;
+    for (int i = 0; i < BVH4_WIDTH; i++) {
+      bool inner = node.innerMask & (1 << i);
+      if (!inner && node.count[i] == 0)
+        continue;
+      vec3 childMin, childMax;
+      for (int a = 0; a < 3; a++) {
+        float scale = exponentScale(node.exponent[a]);
+        childMin[a] = node.origin[a] + node.qmin[a][i] * scale;
+        childMax[a] = node.origin[a] + node.qmax[a][i] * scale;
+      }
+      nodeMin = min(nodeMin, childMin);
+      nodeMax = max(nodeMax, childMax);
+      if (inner)
+        stack.push_back(std::make_pair(child++, depth + 1));
+      else
+        addNodeStats(stats, depth + 1, true, node.count[i], surfaceArea(childMin, childMax));
+    }
+    addNodeStats(stats, depth, false, 0, surfaceArea(nodeMin, nodeMax));
+    if (index == 0)
+      rootArea = surfaceArea(nodeMin, nodeMax);
+  }
+  stats->sahCost /= rootArea;
+}
@@ -15,6 +15,9 @@
 #define TP33
 #define AA
 #define KDTREE
+//#define AUTOTUNE
+//#define SORT_OBJECTS
+//#define ACCEL_STATS
 //#define SAMPLEGLOSSY
 
 #include <stdbool.h>
@@ -0,0 +1,356 @@
+#include "kdtree.h"
+#include "kdtree_types.h"
+#include "defines.h"
+#include "scene.h"
+#include "scene_types.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Two level grid : a coarse uniform grid over the scene, each non empty top cell is
+ *  subdivided again according to the number of objects it holds. Objects are listed in
+ *  every cell their box overlaps, the lists of all the sub-cells are packed in one array
+ *  indexed by cell offsets. Rays walk both levels with a 3D-DDA and stop at the first
+ *  cell that ends after the nearest hit found so far.
+ */
+
+//! top cells per object in the grid
+#define GRID_TOP_DENSITY 0.125f
+//! sub-cells per object of a top cell
+#define GRID_CELL_DENSITY 2.f
+#define GRID_MAX_TOP_RES 256
+#define GRID_MAX_CELL_RES 16
+
+typedef struct s_gridTopCell {
+  int firstCell; //! index of its first sub-cell in cellOffsets
+  int res[3]; //! resolution of its sub-grid, 0 for an empty top cell
+} GridTopCell;
+
+struct s_grid {
+  vec3 min;
+  vec3 max;
+  vec3 cellSize; //! of the top cells
+  int res[3];
+  std::vector<GridTopCell> top;
+  std::vector<int> cellOffsets; //! sub-cell c holds objects[cellOffsets[c]] to objects[cellOffsets[c+1]-1]
+  std::vector<int> objects;
+  std::vector<int> outOfTree;
+};
+
+//! state of a 3D-DDA walk through the cells of a grid
+typedef struct s_gridWalk {
+  int cell[3];
+  int step[3];
+  int stop[3]; //! first cell index out of the grid along each axis
+  float tNext[3]; //! t at which the ray crosses into the next cell along each axis
+  float tDelta[3];
+} GridWalk;
+
+//! resolution giving about cellCount cubic cells in a box of the given extent
+void gridResolution(vec3 extent, float cellCount, int maxRes, int res[3]) {
+  float scale = cbrtf(cellCount / (extent.x * extent.y * extent.z));
+  for (int a = 0; a < 3; a++)
+    res[a] = std::max(1, std::min(maxRes, int(extent[a] * scale + .5f)));
+}
+
+//! cells overlapped by the box [aabbmin, aabbmax] in a res grid starting at gridMin,
+//  slightly enlarged so that the rounding of the walk never misses a cell
+void cellRange(vec3 aabbmin, vec3 aabbmax, vec3 gridMin, vec3 cellSize, const int res[3], int lo[3], int hi[3]) {
+  for (int a = 0; a < 3; a++) {
+    float margin = 1e-4f * cellSize[a];
+    lo[a] = std::max(0, std::min(res[a] - 1, int((aabbmin[a] - margin - gridMin[a]) / cellSize[a])));
+    hi[a] = std::max(0, std::min(res[a] - 1, int((aabbmax[a] + margin - gridMin[a]) / cellSize[a])));
+  }
+}
+
+inline int cellIndex(const int res[3], const int cell[3]) {
+  return (cell[2] * res[1] + cell[1]) * res[0] + cell[0];
+}
+
+//! start walking the cells of a grid at the point of the ray at t
+void initGridWalk(const Ray *ray, vec3 gridMin, vec3 cellSize, const int res[3], float t, GridWalk *walk) {
+  point3 p = rayAt(*ray, t);
+  for (int a = 0; a < 3; a++) {
+    int c = std::max(0, std::min(res[a] - 1, int((p[a] - gridMin[a]) / cellSize[a])));
+    walk->cell[a] = c;
+    // a null direction component never crosses a cell boundary
+    if (ray->dir[a] > 0) {
+      walk->step[a] = 1;
+      walk->stop[a] = res[a];
+      walk->tNext[a] = (gridMin[a] + (c + 1) * cellSize[a] - ray->orig[a]) * ray->invdir[a];
+      walk->tDelta[a] = cellSize[a] * ray->invdir[a];
+    } else if (ray->dir[a] < 0) {
+      walk->step[a] = -1;
+      walk->stop[a] = -1;
+      walk->tNext[a] = (gridMin[a] + c * cellSize[a] - ray->orig[a]) * ray->invdir[a];
+      walk->tDelta[a] = -cellSize[a] * ray->invdir[a];
+    } else {
+      walk->step[a] = 0;
+      walk->stop[a] = -1;
+      walk->tNext[a] = FLT_MAX;
+      walk->tDelta[a] = 0;
+    }
+  }
+}
+
+//! t at which the ray leaves the current cell
+inline float cellExit(const GridWalk *walk) {
+  return std::min(walk->tNext[0], std::min(walk->tNext[1], walk->tNext[2]));
+}
+
+//! move to the next cell along the ray, false once the ray leaves the grid
+inline bool stepGridWalk(GridWalk *walk) {
+  int axis = walk->tNext[0] < walk->tNext[1] ? 0 : 1;
+  if (walk->tNext[2] < walk->tNext[axis])
+    axis = 2;
+  walk->cell[axis] += walk->step[axis];
+  if (walk->cell[axis] == walk->stop[axis])
+    return false;
+  walk->tNext[axis] += walk->tDelta[axis];
+  return true;
+}
+
+inline vec3 topCellMin(const Grid *grid, const int cell[3]) {
+  return grid->min + vec3(cell[0], cell[1], cell[2]) * grid->cellSize;
+}
+
+inline vec3 subCellSize(const Grid *grid, const GridTopCell &top) {
+  return grid->cellSize / vec3(top.res[0], top.res[1], top.res[2]);
+}
+
+Grid* initGrid(Scene *scene) {
+  Grid *grid = new Grid();
+  grid->res[0] = grid->res[1] = grid->res[2] = 0;
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  std::vector<int> inGrid;
+  grid->min = vec3(FLT_MAX);
+  grid->max = vec3(-FLT_MAX);
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    if (bounds->bounded[i]) {
+      inGrid.push_back(i);
+      grid->min = min(grid->min, boundsMin(bounds, i));
+      grid->max = max(grid->max, boundsMax(bounds, i));
+    } else {
+      grid->outOfTree.push_back(i);
+    }
+  }
+
+  int n = inGrid.size();
+  if (n == 0)
+    return grid;
+
+  // flat scenes still get cells of some thickness
+  vec3 extent = grid->max - grid->min;
+  float thickness = std::max(1e-3f * std::max(extent.x, std::max(extent.y, extent.z)), 1e-4f);
+  for (int a = 0; a < 3; a++) {
+    if (extent[a] < thickness) {
+      grid->min[a] -= .5f * thickness;
+      grid->max[a] += .5f * thickness;
+    }
+  }
+  extent = grid->max - grid->min;
+  gridResolution(extent, GRID_TOP_DENSITY * n, GRID_MAX_TOP_RES, grid->res);
+  grid->cellSize = extent / vec3(grid->res[0], grid->res[1], grid->res[2]);
+  int topCount = grid->res[0] * grid->res[1] * grid->res[2];
+
+  // objects of each top cell, counted then scattered
+  std::vector<int> topOffsets(topCount + 1, 0);
+  std::vector<int> lo(3 * n), hi(3 * n);
+  for (int k = 0; k < n; k++) {
+    int i = inGrid[k];
+    cellRange(boundsMin(bounds, i), boundsMax(bounds, i), grid->min, grid->cellSize, grid->res, &lo[3 * k], &hi[3 * k]);
+    int cell[3];
+    for (cell[2] = lo[3 * k + 2]; cell[2] <= hi[3 * k + 2]; cell[2]++)
+      for (cell[1] = lo[3 * k + 1]; cell[1] <= hi[3 * k + 1]; cell[1]++)
+        for (cell[0] = lo[3 * k]; cell[0] <= hi[3 * k]; cell[0]++)
+          topOffsets[cellIndex(grid->res, cell) + 1]++;
+  }
+  for (int c = 0; c < topCount; c++)
+    topOffsets[c + 1] += topOffsets[c];
+  std::vector<int> topObjects(topOffsets[topCount]);
+  std::vector<int> cursor(topOffsets.begin(), topOffsets.end() - 1);
+  for (int k = 0; k < n; k++) {
+    int cell[3];
+    for (cell[2] = lo[3 * k + 2]; cell[2] <= hi[3 * k + 2]; cell[2]++)
+      for (cell[1] = lo[3 * k + 1]; cell[1] <= hi[3 * k + 1]; cell[1]++)
+        for (cell[0] = lo[3 * k]; cell[0] <= hi[3 * k]; cell[0]++)
+          topObjects[cursor[cellIndex(grid->res, cell)]++] = inGrid[k];
+  }
+
+  // the sub-grid resolution of a top cell follows its own density
+  grid->top.resize(topCount);
+  int cellCount = 0;
+  for (int c = 0; c < topCount; c++) {
+    GridTopCell &top = grid->top[c];
+    int count = topOffsets[c + 1] - topOffsets[c];
+    top.firstCell = cellCount;
+    if (count == 0) {
+      top.res[0] = top.res[1] = top.res[2] = 0;
+      continue;
+    }
+    gridResolution(grid->cellSize, GRID_CELL_DENSITY * count, GRID_MAX_CELL_RES, top.res);
+    cellCount += top.res[0] * top.res[1] * top.res[2];
+  }
+
+  // the same two passes in each top cell, which only writes its own sub-cells
+  grid->cellOffsets.assign(cellCount + 1, 0);
+  for (int pass = 0; pass < 2; pass++) {
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int c = 0; c < topCount; c++) {
+      const GridTopCell &top = grid->top[c];
+      if (top.res[0] == 0)
+        continue;
+      int topCell[3] = {c % grid->res[0], c / grid->res[0] % grid->res[1], c / (grid->res[0] * grid->res[1])};
+      vec3 cellMin = topCellMin(grid, topCell), size = subCellSize(grid, top);
+      for (int k = topOffsets[c]; k < topOffsets[c + 1]; k++) {
+        int i = topObjects[k];
+        int subLo[3], subHi[3], cell[3];
+        cellRange(boundsMin(bounds, i), boundsMax(bounds, i), cellMin, size, top.res, subLo, subHi);
+        for (cell[2] = subLo[2]; cell[2] <= subHi[2]; cell[2]++)
+          for (cell[1] = subLo[1]; cell[1] <= subHi[1]; cell[1]++)
+            for (cell[0] = subLo[0]; cell[0] <= subHi[0]; cell[0]++) {
+              int sub = top.firstCell + cellIndex(top.res, cell);
+              if (pass == 0)
+                grid->cellOffsets[sub + 1]++;
+              else
+                grid->objects[cursor[sub]++] = i;
+            }
+      }
+    }
+    if (pass == 0) {
+      for (int c = 0; c < cellCount; c++)
+        grid->cellOffsets[c + 1] += grid->cellOffsets[c];
+      grid->objects.resize(grid->cellOffsets[cellCount]);
+      cursor.assign(grid->cellOffsets.begin(), grid->cellOffsets.end() - 1);
+    }
+  }
+
+  return grid;
+}
+
+void freeGrid(Grid *grid) {
+  delete grid;
+}
+
+//! walk the sub-grid of a top cell between t and tEnd
+bool intersectTopCell(Scene *scene, const Grid *grid, const GridTopCell &top, const int topCell[3], Ray *ray,
+                      float t, float tEnd, Intersection *intersection) {
+  bool hasIntersection = false;
+  GridWalk walk;
+  initGridWalk(ray, topCellMin(grid, topCell), subCellSize(grid, top), top.res, t, &walk);
+  do {
+    STATS_NODE();
+    float tExit = std::min(cellExit(&walk), tEnd);
+    int cell = top.firstCell + cellIndex(top.res, walk.cell);
+    for (int i = grid->cellOffsets[cell]; i < grid->cellOffsets[cell + 1]; i++)
+      hasIntersection |= intersectPrimitive(scene, grid->objects[i], ray, intersection);
+    // the objects of the next cells are all beyond the nearest hit
+    if (ray->tmax <= tExit)
+      break;
+    t = tExit;
+  } while (t < tEnd && stepGridWalk(&walk));
+  return hasIntersection;
+}
+
+bool intersectGrid(Scene *scene, Grid *grid, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : grid->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  float t, tEnd;
+  if (grid->top.empty() || !intersectAabb(ray, grid->min, grid->max, &t, &tEnd))
+    return hasIntersection;
+
+  GridWalk walk;
+  initGridWalk(ray, grid->min, grid->cellSize, grid->res, t, &walk);
+  do {
+    STATS_NODE();
+    float tExit = std::min(cellExit(&walk), tEnd);
+    const GridTopCell &top = grid->top[cellIndex(grid->res, walk.cell)];
+    if (top.res[0] > 0)
+      hasIntersection |= intersectTopCell(scene, grid, top, walk.cell, ray, t, tExit, intersection);
+    if (ray->tmax <= tExit)
+      break;
+    t = tExit;
+  } while (t < tEnd && stepGridWalk(&walk));
+
+  return hasIntersection;
+}
+
+bool occludedTopCell(Scene *scene, const Grid *grid, const GridTopCell &top, const int topCell[3], Ray *ray,
+                     float t, float tEnd) {
+  GridWalk walk;
+  initGridWalk(ray, topCellMin(grid, topCell), subCellSize(grid, top), top.res, t, &walk);
+  do {
+    STATS_NODE();
+    int cell = top.firstCell + cellIndex(top.res, walk.cell);
+    for (int i = grid->cellOffsets[cell]; i < grid->cellOffsets[cell + 1]; i++) {
+      if (occludedPrimitive(scene, grid->objects[i], ray))
+        return true;
+    }
+    t = cellExit(&walk);
+  } while (t < tEnd && stepGridWalk(&walk));
+  return false;
+}
+
+bool occludedGrid(Scene *scene, Grid *grid, Ray *ray) {
+  for (int i : grid->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  float t, tEnd;
+  if (grid->top.empty() || !intersectAabb(ray, grid->min, grid->max, &t, &tEnd))
+    return false;
+
+  GridWalk walk;
+  initGridWalk(ray, grid->min, grid->cellSize, grid->res, t, &walk);
+  do {
+    STATS_NODE();
+    float tExit = std::min(cellExit(&walk), tEnd);
+    const GridTopCell &top = grid->top[cellIndex(grid->res, walk.cell)];
+    if (top.res[0] > 0 && occludedTopCell(scene, grid, top, walk.cell, ray, t, tExit))
+      return true;
+    t = tExit;
+  } while (t < tEnd && stepGridWalk(&walk));
+
+  return false;
+}
+
+void gridStats(const Grid *grid, AccelStats *stats) {
+  initAccelStats(stats);
+  stats->objects = grid->outOfTree.size();
+  stats->memory = sizeof(Grid) + grid->top.size() * sizeof(GridTopCell)
+                + (grid->cellOffsets.size() + grid->objects.size() + grid->outOfTree.size()) * sizeof(int);
+  if (grid->top.empty())
+    return;
+
+  // the grid is the root, top cells are at depth 1 and sub-cells at depth 2
+  std::vector<char> referenced;
+  for (int object : grid->objects) {
+    if (object >= (int)referenced.size())
+      referenced.resize(object + 1, 0);
+    stats->objects += !referenced[object];
+    referenced[object] = 1;
+  }
+  addNodeStats(stats, 0, false, 0, surfaceArea(grid->min, grid->max));
+  for (unsigned int c = 0; c < grid->top.size(); c++) {
+    const GridTopCell &top = grid->top[c];
+    int topCell[3] = {int(c) % grid->res[0], int(c) / grid->res[0] % grid->res[1], int(c) / (grid->res[0] * grid->res[1])};
+    vec3 cellMin = topCellMin(grid, topCell);
+    if (top.res[0] == 0) {
+      addNodeStats(stats, 1, true, 0, surfaceArea(cellMin, cellMin + grid->cellSize));
+      continue;
+    }
+    addNodeStats(stats, 1, false, 0, surfaceArea(cellMin, cellMin + grid->cellSize));
+    vec3 size = subCellSize(grid, top);
+    for (int sub = top.firstCell; sub < top.firstCell + top.res[0] * top.res[1] * top.res[2]; sub++)
+      addNodeStats(stats, 2, true, grid->cellOffsets[sub + 1] - grid->cellOffsets[sub], surfaceArea(vec3(0.f), size));
+  }
+  stats->sahCost /= surfaceArea(grid->min, grid->max);
+}
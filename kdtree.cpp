@@ -1,121 +1,367 @@
 #include "kdtree.h"
+#include "kdtree_types.h"
 #include "defines.h"
 #include "scene.h"
 #include "scene_types.h"
 #include <stdio.h>
+#include <omp.h>
+#include <cassert>
 
 #include <vector>
-#include <stack>
-
-typedef struct s_kdtreeNode KdTreeNode;
-Scene *sceneGlobal = nullptr;
-int axisGlobal = 0;
-
-struct s_kdtreeNode {
-  bool leaf; //! is this node a leaf ?
-  int axis;//! axis index of the split, if not leaf
-  float split;//!position of the split
-  int depth; //!depth in the tree
-  std::vector<int> objects;//! index of objects, if leaf
-  KdTreeNode* left;//!ptr to left child
-  KdTreeNode* right;//! ptr to right child
-  vec3 min;//! min pos of node bounding box
-  vec3 max;//! max pos of node bounding box
-};
+#include <algorithm>
 
-KdTreeNode * initNode(bool l, int a, int d) {
-    KdTreeNode *ret = new KdTreeNode();
-    ret->leaf = l;
-    ret->axis = a;
-    ret->depth = d;
-    ret->left = NULL;
-    ret->right = NULL;
-    return ret;
-}
+#define KD_LEAF 3
+//! nodes with at least this many objects are built with parallel tasks
+#define KD_TASK_THRESHOLD 1024
+//! the depth limit 8 + 1.3 log2(n) stays below it for any object count
+#define KD_STACK_SIZE 64
+//! no neighbour across this face, the ray leaves the tree
+#define KD_NO_ROPE -1
+//! entries of the per ray mailbox, a power of two
+#define KD_MAILBOX_SIZE 16
+//! the sample rays go through each candidate tree at least this many times and this long (s),
+//  the fastest pass is kept
+#define KD_TUNING_PASSES 5
+#define KD_TUNING_TIME 0.05
+//! a candidate must be this much faster than the best parameters so far to replace them
+#define KD_TUNING_MARGIN 0.95
+
+//! 8 bytes node, the whole tree is one array in depth first order :
+//  the left child of an interior node is the next node, only the right child index is stored
+typedef struct s_kdtreeNode {
+  union {
+    float split;//!position of the split, if not leaf
+    int primOffset;//! first object in tree->prims, or the object itself for a single object leaf
+  };
+  unsigned int flags;//! 2 low bits : axis index of the split or KD_LEAF, other bits : right child index or number of objects
+} KdTreeNode;
+static_assert(sizeof(KdTreeNode) == 8, "kd-tree nodes must stay 8 bytes");
+
+inline bool kdIsLeaf(const KdTreeNode &node) { return (node.flags & 3) == KD_LEAF; }
+inline int kdAxis(const KdTreeNode &node) { return node.flags & 3; }
+inline unsigned int kdRightChild(const KdTreeNode &node) { return node.flags >> 2; }
+inline unsigned int kdObjectCount(const KdTreeNode &node) { return node.flags >> 2; }
 
 typedef struct s_stackNode {
     float tmin;
     float tmax;
-    KdTreeNode *node;
+    unsigned int node;
 } StackNode;
 
+//! per ray traversal stack, on the program stack
+typedef struct s_kdStack {
+    StackNode nodes[KD_STACK_SIZE];
+    int size;
+} KdStack;
+
+//! objects already tested by the current ray, hashed on their index (Shevtsov et al. 2007).
+//  One per ray on the program stack, so nothing is shared between the render threads.
+typedef struct s_kdMailbox {
+    int objects[KD_MAILBOX_SIZE];
+    bool enabled;
+    int tests;//! objects tested by the ray
+    int skipped;//! tests saved by the mailbox
+} KdMailbox;
+
+// the tests of a ray are counted, like the other traversal counters, only when ACCEL_STATS is defined
+#ifdef ACCEL_STATS
+#define STATS_MAILBOX(count) (count)
+#else
+#define STATS_MAILBOX(count)
+#endif
+
+//! object tests of the rays traced by one thread, padded to its own cache line
+typedef struct s_kdTestCounters {
+    long long tests;
+    long long skipped;
+    char pad[48];
+} KdTestCounters;
+
+//! box of a leaf and its neighbours across the faces -x, +x, -y, +y, -z, +z :
+//  the smallest node containing the whole face, or KD_NO_ROPE on the tree boundary
+typedef struct s_kdRopes {
+    vec3 min;
+    vec3 max;
+    int ropes[6];
+} KdRopes;
+
+//! a candidate split plane : the min (start) or max (end) of an object bounding box along one axis
+typedef struct s_splitEvent {
+    float pos;
+    bool start;
+    int object;
+} SplitEvent;
+
+//! events ordered by position, starts before ends at the same position, then by object : the planar
+//  objects of a position are found by merging its starts and its ends. Renumbering the objects of a
+//  child keeps their order.
+inline bool eventLess(const SplitEvent &a, const SplitEvent &b) {
+  if (a.pos != b.pos) return a.pos < b.pos;
+  if (a.start != b.start) return a.start;
+  return a.object < b.object;
+}
+
 struct s_kdtree {
     int depthLimit;
     size_t objLimit;
-    KdTreeNode *root;
+    float traversalCost;//! SAH cost of a traversal step
+    vec3 min;//! min pos of the tree bounding box
+    vec3 max;//! max pos of the tree bounding box
+
+    std::vector<KdTreeNode> nodes;
+    std::vector<int> prims;//! object indices referenced by leaves with several objects
 
     std::vector<int> outOfTree;
     std::vector<int> inTree;
+
+    std::vector<KdRopes> ropes;//! indexed by node, filled for the leaves by buildKdTreeRopes
+
+    bool mailboxing;
+    std::vector<KdTestCounters> counters;//! one per thread
 };
 
-void subdivide(Scene *scene, KdTree *tree, KdTreeNode *node);
+inline void initMailbox(KdMailbox *mailbox, const KdTree *tree) {
+  std::fill(mailbox->objects, mailbox->objects + KD_MAILBOX_SIZE, -1);
+  mailbox->enabled = tree->mailboxing;
+  mailbox->tests = mailbox->skipped = 0;
+}
+
+//! false if the ray has already tested the object, else remember it
+inline bool mailboxTest(KdMailbox *mailbox, int object) {
+  int &slot = mailbox->objects[object & (KD_MAILBOX_SIZE - 1)];
+  if (mailbox->enabled && slot == object) {
+    STATS_MAILBOX(mailbox->skipped++);
+    return false;
+  }
+  slot = object;
+  STATS_MAILBOX(mailbox->tests++);
+  return true;
+}
+
+//! add the tests of one ray to the counters of the calling thread, only with ACCEL_STATS :
+//  the atomic adds would otherwise cost every ray
+inline void recordMailbox(KdTree *tree, const KdMailbox &mailbox) {
+#ifdef ACCEL_STATS
+  KdTestCounters &counters = tree->counters[omp_get_thread_num() % tree->counters.size()];
+#pragma omp atomic
+  counters.tests += mailbox.tests;
+#pragma omp atomic
+  counters.skipped += mailbox.skipped;
+#endif
+}
+
+//! test the objects of a leaf that the ray has not tested yet, the nearest hit is kept
+inline bool intersectLeaf(Scene *scene, const KdTree *tree, const KdTreeNode &leaf, KdMailbox *mailbox, Ray *ray, Intersection *intersection) {
+  unsigned int count = kdObjectCount(leaf);
+  // an empty leaf may be the last one, its offset is then the end of tree->prims
+  const int *prims = count == 1 ? &leaf.primOffset : tree->prims.data() + leaf.primOffset;
+  bool hasIntersection = false;
+  for (unsigned int i = 0; i < count; i++) {
+    if (mailboxTest(mailbox, prims[i]))
+      hasIntersection |= intersectPrimitive(scene, prims[i], ray, intersection);
+  }
+  return hasIntersection;
+}
+
+inline bool occludedLeaf(Scene *scene, const KdTree *tree, const KdTreeNode &leaf, KdMailbox *mailbox, Ray *ray) {
+  unsigned int count = kdObjectCount(leaf);
+  const int *prims = count == 1 ? &leaf.primOffset : tree->prims.data() + leaf.primOffset;
+  for (unsigned int i = 0; i < count; i++) {
+    if (mailboxTest(mailbox, prims[i]) && occludedPrimitive(scene, prims[i], ray))
+      return true;
+  }
+  return false;
+}
+
+//! nodes and leaf objects of a subtree under construction. Subtrees built by parallel tasks
+//  are built in their own buffer and appended to the parent one.
+typedef struct s_kdBuildBuffer {
+    std::vector<KdTreeNode> nodes;
+    std::vector<int> prims;
+} KdBuildBuffer;
+
+//! objects of a node under construction and, along each axis, the events of their boxes
+//  clipped to the node. Events are sorted once at the root and stay sorted when a node is
+//  split (Wald and Havran 2006), so the build is O(N log N).
+typedef struct s_kdBuildNode {
+    std::vector<int> objects;
+    std::vector<SplitEvent> events[3];//! event objects are indices into objects
+} KdBuildNode;
+
+//! read only state shared by the build tasks
+typedef struct s_kdBuild {
+    Scene *scene;
+    const KdTree *tree;
+    const ObjectBounds *bounds;
+} KdBuild;
+
+void subdivide(const KdBuild *build, KdBuildBuffer *buffer, KdBuildNode &node, vec3 nodeMin, vec3 nodeMax, int depth);
+
+bool objectBounds(Object *object, vec3 *aabbmin, vec3 *aabbmax) {
+  Geometry &geom = object->geom;
+  switch (geom.type) {
+    case SPHERE:
+      *aabbmin = geom.sphere.center - vec3(geom.sphere.radius);
+      *aabbmax = geom.sphere.center + vec3(geom.sphere.radius);
+      return true;
+    case TRIANGLE:
+      *aabbmin = min(min(geom.triangle.v0, geom.triangle.v1), geom.triangle.v2);
+      *aabbmax = max(max(geom.triangle.v0, geom.triangle.v1), geom.triangle.v2);
+      return true;
+    case INSTANCE: {
+      // box of the 8 transformed corners of the prototype box, the prototype structure is built first
+      vec3 pmin, pmax;
+      if (!accelBounds(geom.instance.prototype->bottomLevel, &pmin, &pmax))
+        return false;
+      *aabbmin = vec3(FLT_MAX);
+      *aabbmax = vec3(-FLT_MAX);
+      for (int c = 0; c < 8; c++) {
+        vec3 corner((c & 1) ? pmax.x : pmin.x, (c & 2) ? pmax.y : pmin.y, (c & 4) ? pmax.z : pmin.z);
+        vec3 p = object->orientation * corner + object->tranlation;
+        *aabbmin = min(*aabbmin, p);
+        *aabbmax = max(*aabbmax, p);
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+//! cache the bounds of primitive i
+void computeObjectBounds(Scene *scene, int i) {
+  ObjectBounds &bounds = scene->bounds;
+  vec3 omin, omax;
+  point3 v[3];
+  if (i >= (int)scene->objects.size() && primitiveTriangle(scene, i, v)) {
+    omin = min(min(v[0], v[1]), v[2]);
+    omax = max(max(v[0], v[1]), v[2]);
+    bounds.bounded[i] = true;
+  } else {
+    bounds.bounded[i] = objectBounds(scene->objects[i], &omin, &omax);
+  }
+  if (!bounds.bounded[i])
+    return;
+  vec3 centroid = 0.5f * (omin + omax);
+  for (int axis = 0; axis < 3; axis++) {
+    bounds.min[axis][i] = omin[axis];
+    bounds.max[axis][i] = omax[axis];
+    bounds.centroid[axis][i] = centroid[axis];
+  }
+}
+
+const ObjectBounds* sceneObjectBounds(Scene *scene) {
+  scenePrimitives(scene);
+  ObjectBounds &bounds = scene->bounds;
+  int n = primitiveCount(scene);
+  int first = firstMovedPrimitive(scene, bounds.bounded.size(), bounds.objectCount);
+  bounds.objectCount = scene->objects.size();
+  if (first == n)
+    return &bounds;
+
+  for (int axis = 0; axis < 3; axis++) {
+    bounds.min[axis].resize(n);
+    bounds.max[axis].resize(n);
+    bounds.centroid[axis].resize(n);
+  }
+  bounds.bounded.resize(n);
+#pragma omp parallel for
+  for (int i = first; i < n; i++)
+    computeObjectBounds(scene, i);
+  return &bounds;
+}
+
+void updateObjectBounds(Scene *scene, const int *modified, size_t count) {
+  sceneObjectBounds(scene);
+#pragma omp parallel for
+  for (size_t m = 0; m < count; m++)
+    computeObjectBounds(scene, modified[m]);
+  updateScenePrimitives(scene, modified, count);
+}
 
 KdTree*  initKdTree(Scene *scene) {
   KdTree* tree = new KdTree();
-  tree->root = initNode(false, 0, 0);
-  tree->root->objects.clear();
-  
-  vec3 aabbmin = vec3(0);
-  vec3 aabbmax = vec3(0);
-  
-  for (unsigned int i = 0; i < scene->objects.size(); i++) {
-    Object *object = scene->objects.at(i);
-    
-    tree->root->objects.push_back(i);
-    
-    Geometry geom = object->geom;
-    
-    float minx, miny, minz, maxx, maxy, maxz;
-    
-    switch (object->geom.type) {
-      case SPHERE:
-	minx = geom.sphere.center.x - geom.sphere.radius;
-	miny = geom.sphere.center.y - geom.sphere.radius;
-	minz = geom.sphere.center.z - geom.sphere.radius;
-	
-	if (aabbmin.x > minx) aabbmin.x = minx;
-	if (aabbmin.y > miny) aabbmin.y = miny;
-	if (aabbmin.z > minz) aabbmin.z = minz;
-	
-	maxx = geom.sphere.center.x + geom.sphere.radius;
-	maxy = geom.sphere.center.y + geom.sphere.radius;
-	maxz = geom.sphere.center.z + geom.sphere.radius;
-	
-	if (aabbmax.x < maxx) aabbmax.x = maxx;
-	if (aabbmax.y < maxy) aabbmax.y = maxy;
-	if (aabbmax.z < maxz) aabbmax.z = maxz;
-	break;
-      case TRIANGLE:
-	point3 a = geom.triangle.v0;
-	point3 b = geom.triangle.v1;
-	point3 c = geom.triangle.v2;
-	
-	minx = (a.x < b.x) ? (a.x < c.x) ? a.x : c.x : (b.x < c.x) ? b.x : c.x;
-	miny = (a.y < b.y) ? (a.y < c.y) ? a.y : c.y : (b.y < c.y) ? b.y : c.y;
-	minz = (a.z < b.z) ? (a.z < c.z) ? a.z : c.z : (b.z < c.z) ? b.z : c.z;
-	
-	if (aabbmin.x > minx) aabbmin.x = minx;
-	if (aabbmin.y > miny) aabbmin.y = miny;
-	if (aabbmin.z > minz) aabbmin.z = minz;
-	
-	maxx = (a.x > b.x) ? (a.x > c.x) ? a.x : c.x : (b.x > c.x) ? b.x : c.x;
-	maxy = (a.y > b.y) ? (a.y > c.y) ? a.y : c.y : (b.y > c.y) ? b.y : c.y;
-	maxz = (a.z > b.z) ? (a.z > c.z) ? a.z : c.z : (b.z > c.z) ? b.z : c.z;
-	
-	if (aabbmax.x < maxx) aabbmax.x = maxx;
-	if (aabbmax.y < maxy) aabbmax.y = maxy;
-	if (aabbmax.z < maxz) aabbmax.z = maxz;
-	break;
-    }
-  }
-  
-  tree->root->min = aabbmin;
-  tree->root->max = aabbmax;
-  tree->depthLimit = ceil(log(scene->objects.size()));
-  
-  subdivide(scene, tree, tree->root);
-  
-  return NULL;
+  tree->objLimit = scene->kdParams.leafSize;
+  tree->traversalCost = scene->kdParams.costRatio * KD_INTERSECT_COST;
+  tree->mailboxing = true;
+  tree->counters.resize(omp_get_max_threads());
+  resetKdTreeTestCounts(tree);
+
+  KdBuild build;
+  build.scene = scene;
+  build.tree = tree;
+  build.bounds = sceneObjectBounds(scene);
+  const ObjectBounds *bounds = build.bounds;
+
+  vec3 aabbmin = vec3(FLT_MAX);
+  vec3 aabbmax = vec3(-FLT_MAX);
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    if (bounds->bounded[i]) {
+      tree->inTree.push_back(i);
+      aabbmin = min(aabbmin, boundsMin(bounds, i));
+      aabbmax = max(aabbmax, boundsMax(bounds, i));
+    } else {
+      tree->outOfTree.push_back(i);
+    }
+  }
+
+  if (tree->inTree.empty())
+    return tree;
+
+  tree->min = aabbmin;
+  tree->max = aabbmax;
+  // a ray stacks at most one far node per level, the traversal stack bounds the depth whatever the factor
+  tree->depthLimit = std::min(KD_STACK_SIZE - 1, int(8 + scene->kdParams.depthFactor * log2f(tree->inTree.size())));
+
+  KdBuildNode root;
+  root.objects = tree->inTree;
+  int n = root.objects.size();
+  KdBuildBuffer buffer;
+#pragma omp parallel
+#pragma omp single
+  {
+    for (int axis = 0; axis < 3; axis++) {
+#pragma omp task shared(root) firstprivate(axis)
+      {
+        std::vector<SplitEvent> &events = root.events[axis];
+        events.resize(2 * n);
+        for (int i = 0; i < n; i++) {
+          events[2 * i] = {bounds->min[axis][root.objects[i]], true, i};
+          events[2 * i + 1] = {bounds->max[axis][root.objects[i]], false, i};
+        }
+        std::sort(events.begin(), events.end(), eventLess);
+      }
+    }
+#pragma omp taskwait
+    subdivide(&build, &buffer, root, aabbmin, aabbmax, 0);
+  }
+  tree->nodes.swap(buffer.nodes);
+  tree->prims.swap(buffer.prims);
+  tree->nodes.shrink_to_fit();
+  tree->prims.shrink_to_fit();
+
+  return tree;
+}
+
+void setKdTreeMailboxing(KdTree *tree, bool enabled) {
+  tree->mailboxing = enabled;
+}
+
+void kdTreeTestCounts(const KdTree *tree, long long *tests, long long *skipped) {
+  *tests = *skipped = 0;
+  for (const KdTestCounters &counters : tree->counters) {
+    *tests += counters.tests;
+    *skipped += counters.skipped;
+  }
+}
+
+void resetKdTreeTestCounts(KdTree *tree) {
+  for (KdTestCounters &counters : tree->counters)
+    counters.tests = counters.skipped = 0;
+}
+
+void freeKdTree(KdTree *tree) {
+  delete tree;
 }
 
 
@@ -125,94 +371,286 @@ bool intersectSphereAabb(vec3 sphereCenter, float sphereRadius, vec3 aabbMin, ve
     vec3 seg = closestPointInAabb -  sphereCenter;
     float distanceSquared = dot(seg, seg);
     // The AABB and the sphere overlap if the closest point within the rectangle is
-    // within the sphere's radius
-    return distanceSquared < (sphereRadius * sphereRadius);
-}
-
-
-// Generate children, compute split position, move objets to children and subdivide if needed.
-void subdivide(Scene *scene, KdTree *tree, KdTreeNode *node) {
-  
-  if (tree->depthLimit == node->depth) {
-    node->leaf = true;
-  }
-  
-  if (node->objects.size() == 1) {
-    node->leaf = true;
-  }
-  
-  std::size_t size = scene->objects.size();
-  sceneGlobal = scene;
-  axisGlobal = node->axis;
-  
-  std::qsort (node->objects.data(), size, sizeof (int), [](const void* a, const void* b) {
-    int arg1 = *static_cast<const int*>(a);
-    int arg2 = *static_cast<const int*>(b);
-    
-    Object* o1 = sceneGlobal->objects.at(arg1);
-    Object* o2 = sceneGlobal->objects.at(arg2);
-    
-    int v1 = 0, v2 = 0;
-    
-    switch (axisGlobal) {
-      case 0: // X axis
-	v1 = o1->geom.sphere.center.x;
-	v2 = o2->geom.sphere.center.x;
-	break;
-      case 1: // Y axis
-	v1 = o1->geom.sphere.center.y;
-	v2 = o2->geom.sphere.center.y;
-	break;
-      case 2: // Z axis
-	v1 = o1->geom.sphere.center.z;
-	v2 = o2->geom.sphere.center.z;
-	break;
-    }
-    
-    if (v1 < v2) 
-      return -1;
-    if (v1 > v2)
-      return 1;
-    return 0;
-  });
-  
-  int med = ceil(size / 2);
-  Object *median = scene->objects.at(med);
-  
-  switch (axisGlobal) {
-    case 0:
-      node->split = median->geom.sphere.center.x;
-      break;
-    case 1:
-      node->split = median->geom.sphere.center.y;
-      break;
-    case 2:
-      node->split = median->geom.sphere.center.z;
-      break;
+    // within the sphere's radius (a sphere touching the box is kept, its surface may be hit there)
+    return distanceSquared <= (sphereRadius * sphereRadius);
+}
+
+float surfaceArea(vec3 aabbmin, vec3 aabbmax) {
+  vec3 d = aabbmax - aabbmin;
+  return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+//! does the primitive really overlap the box (tighter than its own bounding box for spheres)
+bool primitiveOverlapsAabb(const Scene *scene, int i, vec3 aabbmin, vec3 aabbmax) {
+  const ScenePrimitives &p = scene->primitives;
+  if (p.type[i] == SPHERE)
+    return intersectSphereAabb(p.sphereCenter[p.slot[i]], p.sphereRadius[p.slot[i]], aabbmin, aabbmax);
+  return true;
+}
+
+void makeLeaf(KdBuildBuffer *buffer, const std::vector<int> &objects) {
+  KdTreeNode leaf;
+  leaf.flags = KD_LEAF | (objects.size() << 2);
+  if (objects.size() == 1) {
+    leaf.primOffset = objects[0];
+  } else {
+    leaf.primOffset = buffer->prims.size();
+    buffer->prims.insert(buffer->prims.end(), objects.begin(), objects.end());
+  }
+  buffer->nodes.push_back(leaf);
+}
+
+//! append a subtree built in its own buffer, its node and object offsets are shifted
+void appendSubtree(KdBuildBuffer *buffer, const KdBuildBuffer &subtree) {
+  unsigned int nodeOffset = buffer->nodes.size();
+  int primOffset = buffer->prims.size();
+  for (KdTreeNode node : subtree.nodes) {
+    if (!kdIsLeaf(node))
+      node.flags += nodeOffset << 2;
+    else if (kdObjectCount(node) != 1)
+      node.primOffset += primOffset;
+    buffer->nodes.push_back(node);
+  }
+  buffer->prims.insert(buffer->prims.end(), subtree.prims.begin(), subtree.prims.end());
+}
+
+// sweep the sorted events of the n objects of the node along axis and evaluate the SAH once per
+// candidate plane, with the objects as subdivide distributes them : those ending at the plane are
+// below it, those starting there above it, the planar ones below
+void findBestSplit(const std::vector<SplitEvent> &events, size_t n, vec3 nodeMin, vec3 nodeMax, int axis, float traversalCost,
+                   float *bestCost, float *bestSplit) {
+  float invArea = 1.f / surfaceArea(nodeMin, nodeMax);
+
+  int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+  vec3 d = nodeMax - nodeMin;
+  float capArea = d[other0] * d[other1];
+  float perimeter = d[other0] + d[other1];
+
+  *bestCost = FLT_MAX;
+  size_t nBelow = 0, nAbove = n;
+  for (size_t e = 0; e < events.size();) {
+    float pos = events[e].pos;
+    size_t starts = e, ends = e;
+    while (ends < events.size() && events[ends].pos == pos && events[ends].start) ends++;
+    size_t last = ends;
+    while (last < events.size() && events[last].pos == pos) last++;
+    size_t startCount = ends - starts, endCount = last - ends;
+
+    nAbove -= endCount;
+    if (pos > nodeMin[axis] && pos < nodeMax[axis]) {
+      // objects with both their events here, the starts and the ends are sorted by object
+      size_t planar = 0;
+      for (size_t i = starts, j = ends; i < ends && j < last;) {
+        if (events[i].object < events[j].object) i++;
+        else if (events[j].object < events[i].object) j++;
+        else { planar++; i++; j++; }
+      }
+      size_t below = nBelow + planar;
+      float belowArea = 2.f * (capArea + (pos - nodeMin[axis]) * perimeter);
+      float aboveArea = 2.f * (capArea + (nodeMax[axis] - pos) * perimeter);
+      float bonus = (below == 0 || nAbove == 0) ? KD_EMPTY_BONUS : 0.f;
+      float cost = traversalCost + KD_INTERSECT_COST * (1.f - bonus)
+                 * (belowArea * invArea * below + aboveArea * invArea * nAbove);
+      if (cost < *bestCost) {
+        *bestCost = cost;
+        *bestSplit = pos;
+      }
+    }
+    nBelow += startCount;
+    e = last;
+  }
+}
+
+
+//! events of a child in order, their objects renumbered by childIndex (-1 if not in the child).
+//  Along the split axis, the events beyond the plane are clipped onto it : the ends of the
+//  left child, or the starts of the right child, move together to its boundary.
+void splitEvents(const std::vector<SplitEvent> &events, const std::vector<int> &childIndex, bool clip, bool left,
+                 float split, size_t childObjects, std::vector<SplitEvent> *childEvents) {
+  std::vector<SplitEvent> clipped;
+  childEvents->reserve(2 * childObjects);
+  for (const SplitEvent &event : events) {
+    int object = childIndex[event.object];
+    if (object < 0)
+      continue;
+    if (clip && (left ? event.pos > split : event.pos < split))
+      clipped.push_back({split, event.start, object});
+    else
+      childEvents->push_back({event.pos, event.start, object});
+  }
+  childEvents->insert(left ? childEvents->end() : childEvents->begin(), clipped.begin(), clipped.end());
+}
+
+// Find the best SAH split, move objets and their events to children and subdivide if needed.
+// The node is appended to the buffer, followed by its left then its right subtree.
+// Large nodes evaluate their three axes and build their two subtrees as parallel tasks.
+void subdivide(const KdBuild *build, KdBuildBuffer *buffer, KdBuildNode &node, vec3 nodeMin, vec3 nodeMax, int depth) {
+
+  const KdTree *tree = build->tree;
+  size_t n = node.objects.size();
+
+  if (tree->depthLimit <= depth || n <= tree->objLimit) {
+    makeLeaf(buffer, node.objects);
+    return;
+  }
+
+  bool parallel = n >= KD_TASK_THRESHOLD;
+  float axisCost[3], axisSplit[3];
+  if (parallel) {
+    for (int axis = 0; axis < 3; axis++) {
+#pragma omp task shared(node, axisCost, axisSplit) firstprivate(axis)
+      findBestSplit(node.events[axis], n, nodeMin, nodeMax, axis, tree->traversalCost, &axisCost[axis], &axisSplit[axis]);
+    }
+#pragma omp taskwait
+  } else {
+    for (int axis = 0; axis < 3; axis++)
+      findBestSplit(node.events[axis], n, nodeMin, nodeMax, axis, tree->traversalCost, &axisCost[axis], &axisSplit[axis]);
+  }
+
+  float leafCost = KD_INTERSECT_COST * n;
+  float bestCost = FLT_MAX;
+  int bestAxis = -1;
+  float bestSplit = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    if (axisCost[axis] < bestCost) {
+      bestCost = axisCost[axis];
+      bestAxis = axis;
+      bestSplit = axisSplit[axis];
+    }
+  }
+
+  if (bestAxis < 0 || bestCost >= leafCost) {
+    makeLeaf(buffer, node.objects);
+    return;
+  }
+
+  vec3 leftMax = nodeMax;
+  leftMax[bestAxis] = bestSplit;
+  vec3 rightMin = nodeMin;
+  rightMin[bestAxis] = bestSplit;
+
+  // objects straddling the split are referenced by both children
+  KdBuildNode left, right;
+  std::vector<int> leftIndex(n, -1), rightIndex(n, -1);
+  for (size_t i = 0; i < n; i++) {
+    int o = node.objects[i];
+    float omin = build->bounds->min[bestAxis][o], omax = build->bounds->max[bestAxis][o];
+    bool planar = (omin == bestSplit && omax == bestSplit);
+    if ((omin < bestSplit || planar) && primitiveOverlapsAabb(build->scene, o, nodeMin, leftMax)) {
+      leftIndex[i] = left.objects.size();
+      left.objects.push_back(o);
+    }
+    if (omax > bestSplit && primitiveOverlapsAabb(build->scene, o, rightMin, nodeMax)) {
+      rightIndex[i] = right.objects.size();
+      right.objects.push_back(o);
+    }
+  }
+  std::vector<int>().swap(node.objects);
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (parallel) {
+#pragma omp task shared(node, left, right, leftIndex, rightIndex) firstprivate(axis)
+      {
+        splitEvents(node.events[axis], leftIndex, axis == bestAxis, true, bestSplit, left.objects.size(), &left.events[axis]);
+        splitEvents(node.events[axis], rightIndex, axis == bestAxis, false, bestSplit, right.objects.size(), &right.events[axis]);
+        std::vector<SplitEvent>().swap(node.events[axis]);
+      }
+    } else {
+      splitEvents(node.events[axis], leftIndex, axis == bestAxis, true, bestSplit, left.objects.size(), &left.events[axis]);
+      splitEvents(node.events[axis], rightIndex, axis == bestAxis, false, bestSplit, right.objects.size(), &right.events[axis]);
+      std::vector<SplitEvent>().swap(node.events[axis]);
+    }
+  }
+  if (parallel) {
+#pragma omp taskwait
+  }
+
+  unsigned int nodeIndex = buffer->nodes.size();
+  KdTreeNode interior;
+  interior.split = bestSplit;
+  interior.flags = bestAxis;
+  buffer->nodes.push_back(interior);
+
+  if (parallel) {
+    KdBuildBuffer leftBuffer, rightBuffer;
+#pragma omp task shared(leftBuffer, left)
+    subdivide(build, &leftBuffer, left, nodeMin, leftMax, depth + 1);
+#pragma omp task shared(rightBuffer, right)
+    subdivide(build, &rightBuffer, right, rightMin, nodeMax, depth + 1);
+#pragma omp taskwait
+    appendSubtree(buffer, leftBuffer);
+    buffer->nodes[nodeIndex].flags |= buffer->nodes.size() << 2;
+    appendSubtree(buffer, rightBuffer);
+  } else {
+    subdivide(build, buffer, left, nodeMin, leftMax, depth + 1);
+    buffer->nodes[nodeIndex].flags |= buffer->nodes.size() << 2;
+    subdivide(build, buffer, right, rightMin, nodeMax, depth + 1);
+  }
+}
+
+// Walk down from node to the leaf the ray enters first in [tmin, *tmax], the far children
+// also crossed by the ray are pushed on the stack. *tmax is updated to the exit of the leaf.
+inline unsigned int kdDescend(const KdTreeNode *nodes, const Ray *ray, KdStack *stack,
+                              unsigned int current, float tmin, float *tmax) {
+  STATS_NODE();
+  while (!kdIsLeaf(nodes[current])) {
+    STATS_NODE();
+    const KdTreeNode &node = nodes[current];
+    int axis = kdAxis(node);
+    float orig = ray->orig[axis];
+    float dir = ray->dir[axis];
+    bool belowFirst = (orig < node.split) || (orig == node.split && dir <= 0);
+    unsigned int nearNode = belowFirst ? current + 1 : kdRightChild(node);
+    unsigned int farNode = belowFirst ? kdRightChild(node) : current + 1;
+
+    if (dir == 0) {
+      current = nearNode;
+      continue;
+    }
+
+    float tsplit = (node.split - orig) * ray->invdir[axis];
+    if (tsplit > *tmax || tsplit <= 0) {
+      current = nearNode;
+    } else if (tsplit < tmin) {
+      current = farNode;
+    } else {
+      assert(stack->size < KD_STACK_SIZE);
+      stack->nodes[stack->size++] = {tsplit, *tmax, farNode};
+      current = nearNode;
+      *tmax = tsplit;
+    }
+  }
+  return current;
+}
+
+// Traverse kdtree front to back to find the nearest intersection
+bool traverse(Scene * scene, KdTree * tree, KdStack *stack, KdMailbox *mailbox, StackNode currentNode, Ray * ray, Intersection *intersection) {
+  bool hasIntersection = false;
+  const KdTreeNode *nodes = tree->nodes.data();
+
+  while (true) {
+    float tmax = currentNode.tmax;
+
+    // nearest hit is already closer than this node
+    if (currentNode.tmin <= ray->tmax) {
+      const KdTreeNode &leaf = nodes[kdDescend(nodes, ray, stack, currentNode.node, currentNode.tmin, &tmax)];
+      hasIntersection |= intersectLeaf(scene, tree, leaf, mailbox, ray, intersection);
+
+      // the nearest hit lies in this leaf, nothing behind can be closer
+      if (hasIntersection && ray->tmax <= tmax)
+        return true;
+    }
+
+    if (stack->size == 0)
+      return hasIntersection;
+    currentNode = stack->nodes[--stack->size];
   }
-  
-  node->left = initNode(false, ((node->axis + 1) % 3), node->depth+1);
-  node->right = initNode(false, ((node->axis + 1) % 3), node->depth+1);
-  
-  for (size_t i = med; i < node->objects.size(); i++)
-    node->right->objects.push_back(node->objects.at(i));
-  
-  node->left->objects = node->objects;
-  node->left->objects.resize(med-1);
-  
-}
-
-// Traverse kdtree to find intersection
-bool traverse(Scene * scene, KdTree * tree, std::stack<StackNode> *stack, StackNode currentNode, Ray * ray, Intersection *intersection) {
-  
-  
-  return false;
 }
 
 
 
 // from http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-7-intersecting-simple-shapes/ray-box-intersection/
-bool intersectAabb(Ray *theRay,  vec3 min, vec3 max) {
+bool intersectAabb(Ray *theRay,  vec3 min, vec3 max, float *tnear, float *tfar) {
     float tmin, tmax, tymin, tymax, tzmin, tzmax;
     vec3 bounds[2] = {min, max};
     tmin = (bounds[theRay->sign[0]].x - theRay->orig.x) * theRay->invdir.x;
@@ -227,31 +665,1078 @@ bool intersectAabb(Ray *theRay,  vec3 min, vec3 max) {
     if ((tmin > tzmax) || (tzmin > tmax)) return false;
     if (tzmin > tmin) tmin = tzmin;
     if (tzmax < tmax) tmax = tzmax;
-    if (tmin > theRay->tmin) theRay->tmin = tmin;
-    if (tmax < theRay->tmax) theRay->tmax = tmax;
-    return true;
+    *tnear = (tmin > theRay->tmin) ? tmin : theRay->tmin;
+    *tfar = (tmax < theRay->tmax) ? tmax : theRay->tmax;
+    return *tnear <= *tfar;
 }
 
 
 bool intersectKdTree(Scene *scene, KdTree *tree, Ray *ray, Intersection *intersection) {
     bool hasIntersection = false;
 
-    //!\todo call vanilla intersection on non kdtree object, then traverse the tree to compute other intersections
-    
-    for (Object *o : scene->objects) {
-    switch (o->geom.type) {
-      case PLANE:
-	hasIntersection |= intersectPlane(ray, intersection, o);
-	break;
-      case SPHERE:
-      case TRIANGLE:
-	StackNode currentNode;
-	hasIntersection |= traverse(scene, tree, nullptr, currentNode, ray, intersection);
-	break;
-      default:
-	perror("An unhandeld object have been found\n");
-    }
-  }
-    
+    // unbounded objects are not in the tree, test them first to shorten the ray
+    for (int i : tree->outOfTree)
+      hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+    if (tree->nodes.empty())
+      return hasIntersection;
+
+    StackNode currentNode;
+    if (!intersectAabb(ray, tree->min, tree->max, &currentNode.tmin, &currentNode.tmax))
+      return hasIntersection;
+    currentNode.node = 0;
+
+    KdStack stack;
+    stack.size = 0;
+    KdMailbox mailbox;
+    initMailbox(&mailbox, tree);
+    hasIntersection |= traverse(scene, tree, &stack, &mailbox, currentNode, ray, intersection);
+    recordMailbox(tree, mailbox);
+
+    return hasIntersection;
+}
+
+bool occludedKdTree(Scene *scene, KdTree *tree, Ray *ray) {
+  for (int i : tree->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  StackNode currentNode;
+  if (tree->nodes.empty() || !intersectAabb(ray, tree->min, tree->max, &currentNode.tmin, &currentNode.tmax))
+    return false;
+  currentNode.node = 0;
+
+  // same walk as traverse, stopped by the first hit in any leaf
+  const KdTreeNode *nodes = tree->nodes.data();
+  KdStack stack;
+  stack.size = 0;
+  KdMailbox mailbox;
+  initMailbox(&mailbox, tree);
+  bool occluded = false;
+  while (!occluded) {
+    float tmax = currentNode.tmax;
+    const KdTreeNode &leaf = nodes[kdDescend(nodes, ray, &stack, currentNode.node, currentNode.tmin, &tmax)];
+    occluded = occludedLeaf(scene, tree, leaf, &mailbox, ray);
+
+    if (stack.size == 0)
+      break;
+    currentNode = stack.nodes[--stack.size];
+  }
+  recordMailbox(tree, mailbox);
+  return occluded;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Ropes (Havran 2001, Popov et al. 2007) : each leaf knows its neighbours across its six faces,
+ *  a ray walks from leaf to leaf through the face it exits by, without any stack.
+ */
+
+// Move the rope of the face down the neighbour subtree while one child covers the whole face
+// of the box [bmin, bmax] : the child next to the face for a split parallel to it, the child
+// on the face side of a perpendicular split that does not cut the face.
+void optimizeRope(const KdTree *tree, int *rope, int face, vec3 bmin, vec3 bmax) {
+  if (*rope == KD_NO_ROPE)
+    return;
+  int faceAxis = face / 2;
+  bool maxFace = face & 1;
+  while (!kdIsLeaf(tree->nodes[*rope])) {
+    const KdTreeNode &node = tree->nodes[*rope];
+    int axis = kdAxis(node);
+    if (axis == faceAxis)
+      *rope = maxFace ? *rope + 1 : kdRightChild(node);
+    else if (node.split <= bmin[axis])
+      *rope = kdRightChild(node);
+    else if (node.split >= bmax[axis])
+      *rope = *rope + 1;
+    else
+      break;
+  }
+}
+
+void buildRopes(KdTree *tree, unsigned int nodeIndex, const int ropes[6], vec3 bmin, vec3 bmax) {
+  int optimized[6];
+  for (int face = 0; face < 6; face++) {
+    optimized[face] = ropes[face];
+    optimizeRope(tree, &optimized[face], face, bmin, bmax);
+  }
+
+  const KdTreeNode &node = tree->nodes[nodeIndex];
+  if (kdIsLeaf(node)) {
+    KdRopes &leaf = tree->ropes[nodeIndex];
+    leaf.min = bmin;
+    leaf.max = bmax;
+    std::copy(optimized, optimized + 6, leaf.ropes);
+    return;
+  }
+
+  // each child is the neighbour of the other across the split plane
+  int axis = kdAxis(node);
+  unsigned int left = nodeIndex + 1, right = kdRightChild(node);
+  int leftRopes[6], rightRopes[6];
+  std::copy(optimized, optimized + 6, leftRopes);
+  std::copy(optimized, optimized + 6, rightRopes);
+  leftRopes[2 * axis + 1] = right;
+  rightRopes[2 * axis] = left;
+
+  vec3 leftMax = bmax, rightMin = bmin;
+  leftMax[axis] = node.split;
+  rightMin[axis] = node.split;
+  buildRopes(tree, left, leftRopes, bmin, leftMax);
+  buildRopes(tree, right, rightRopes, rightMin, bmax);
+}
+
+void buildKdTreeRopes(KdTree *tree) {
+  if (tree->nodes.empty())
+    return;
+  tree->ropes.resize(tree->nodes.size());
+  int ropes[6] = {KD_NO_ROPE, KD_NO_ROPE, KD_NO_ROPE, KD_NO_ROPE, KD_NO_ROPE, KD_NO_ROPE};
+  buildRopes(tree, 0, ropes, tree->min, tree->max);
+}
+
+bool intersectKdTreeRopes(Scene *scene, KdTree *tree, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : tree->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  float tentry, texit;
+  if (tree->nodes.empty() || !intersectAabb(ray, tree->min, tree->max, &tentry, &texit))
+    return hasIntersection;
+
+  const KdTreeNode *nodes = tree->nodes.data();
+  KdMailbox mailbox;
+  initMailbox(&mailbox, tree);
+  int current = 0;
+  int entryAxis = -1;
+  float entryPlane = 0;
+
+  while (current != KD_NO_ROPE && tentry <= texit && tentry <= ray->tmax) {
+    // find the leaf containing the entry point, put back exactly on the face it came through
+    point3 p = rayAt(*ray, tentry);
+    if (entryAxis >= 0)
+      p[entryAxis] = entryPlane;
+    STATS_NODE();
+    while (!kdIsLeaf(nodes[current])) {
+      STATS_NODE();
+      const KdTreeNode &node = nodes[current];
+      int axis = kdAxis(node);
+      bool below = (p[axis] < node.split) || (p[axis] == node.split && ray->dir[axis] <= 0);
+      current = below ? current + 1 : kdRightChild(node);
+    }
+
+    hasIntersection |= intersectLeaf(scene, tree, nodes[current], &mailbox, ray, intersection);
+
+    // exit face of the leaf
+    const KdRopes &ropes = tree->ropes[current];
+    float tleaf = FLT_MAX;
+    int face = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      if (ray->dir[axis] == 0) continue;
+      float plane = ray->sign[axis] ? ropes.min[axis] : ropes.max[axis];
+      float t = (plane - ray->orig[axis]) * ray->invdir[axis];
+      if (t < tleaf) {
+        tleaf = t;
+        face = 2 * axis + (ray->sign[axis] ? 0 : 1);
+        entryAxis = axis;
+        entryPlane = plane;
+      }
+    }
+
+    // the nearest hit lies in this leaf, nothing behind can be closer
+    if (hasIntersection && ray->tmax <= tleaf)
+      break;
+    tentry = std::max(tentry, tleaf);
+    current = ropes.ropes[face];
+  }
+
+  recordMailbox(tree, mailbox);
+  return hasIntersection;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Bounding volume hierarchy, built with a binned surface area heuristic.
+ */
+
+void initRange(BvhRange *range) {
+  range->bmin = range->cmin = vec3(FLT_MAX);
+  range->bmax = range->cmax = vec3(-FLT_MAX);
+}
+
+void initBins(BvhBin bins[3][BVH_BINS]) {
+  for (int a = 0; a < 3; a++) {
+    for (int b = 0; b < BVH_BINS; b++) {
+      bins[a][b].min = vec3(FLT_MAX);
+      bins[a][b].max = vec3(-FLT_MAX);
+      bins[a][b].count = 0;
+    }
+  }
+}
+
+void rangeBounds(const BvhRef *refs, int begin, int end, BvhRange *range) {
+  initRange(range);
+  for (int i = begin; i < end; i++) {
+    range->bmin = min(range->bmin, refs[i].min);
+    range->bmax = max(range->bmax, refs[i].max);
+    range->cmin = min(range->cmin, refs[i].centroid);
+    range->cmax = max(range->cmax, refs[i].centroid);
+  }
+}
+
+//! bin the centroids of the range along the three axes
+void binRange(const BvhRef *refs, int begin, int end, const BvhRange &range, BvhBin bins[3][BVH_BINS]) {
+  initBins(bins);
+  for (int axis = 0; axis < 3; axis++) {
+    float extent = range.cmax[axis] - range.cmin[axis];
+    if (extent <= 0) continue;
+    float scale = BVH_BINS / extent;
+    for (int i = begin; i < end; i++) {
+      BvhBin &bin = bins[axis][binIndex(refs[i], axis, range, scale)];
+      bin.count++;
+      bin.min = min(bin.min, refs[i].min);
+      bin.max = max(bin.max, refs[i].max);
+    }
+  }
+}
+
+// Bounds and bins of a large range are computed by one task per chunk of references, then merged
+void parallelBinRange(const BvhRef *refs, int begin, int end, BvhRange *range, BvhBin bins[3][BVH_BINS]) {
+  int chunks = omp_get_num_threads();
+  int chunkSize = (end - begin + chunks - 1) / chunks;
+  std::vector<BvhRange> ranges(chunks);
+  for (int c = 0; c < chunks; c++) {
+#pragma omp task shared(ranges) firstprivate(c)
+    rangeBounds(refs, begin + c * chunkSize, std::min(end, begin + (c + 1) * chunkSize), &ranges[c]);
+  }
+#pragma omp taskwait
+  initRange(range);
+  for (int c = 0; c < chunks; c++) {
+    range->bmin = min(range->bmin, ranges[c].bmin);
+    range->bmax = max(range->bmax, ranges[c].bmax);
+    range->cmin = min(range->cmin, ranges[c].cmin);
+    range->cmax = max(range->cmax, ranges[c].cmax);
+  }
+
+  std::vector<BvhBin> chunkBins(chunks * 3 * BVH_BINS);
+  for (int c = 0; c < chunks; c++) {
+#pragma omp task shared(chunkBins) firstprivate(c)
+    binRange(refs, begin + c * chunkSize, std::min(end, begin + (c + 1) * chunkSize), *range,
+             (BvhBin (*)[BVH_BINS]) &chunkBins[c * 3 * BVH_BINS]);
+  }
+#pragma omp taskwait
+  initBins(bins);
+  for (int c = 0; c < chunks; c++) {
+    for (int a = 0; a < 3; a++) {
+      for (int b = 0; b < BVH_BINS; b++) {
+        const BvhBin &bin = chunkBins[(c * 3 + a) * BVH_BINS + b];
+        bins[a][b].count += bin.count;
+        bins[a][b].min = min(bins[a][b].min, bin.min);
+        bins[a][b].max = max(bins[a][b].max, bin.max);
+      }
+    }
+  }
+}
+
+float findBinnedSplit(const BvhBin bins[3][BVH_BINS], const BvhRange &range, int *bestAxis, int *bestBin) {
+  float bestCost = FLT_MAX;
+  *bestAxis = -1;
+  *bestBin = 0;
+
+  // sweep the bin boundaries of each axis
+  for (int axis = 0; axis < 3; axis++) {
+    if (range.cmax[axis] <= range.cmin[axis]) continue;
+
+    float rightArea[BVH_BINS];
+    int rightCount[BVH_BINS];
+    vec3 rmin = vec3(FLT_MAX), rmax = vec3(-FLT_MAX);
+    int count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      rmin = min(rmin, bins[axis][b].min);
+      rmax = max(rmax, bins[axis][b].max);
+      count += bins[axis][b].count;
+      rightArea[b] = surfaceArea(rmin, rmax);
+      rightCount[b] = count;
+    }
+
+    vec3 lmin = vec3(FLT_MAX), lmax = vec3(-FLT_MAX);
+    count = 0;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+      lmin = min(lmin, bins[axis][b].min);
+      lmax = max(lmax, bins[axis][b].max);
+      count += bins[axis][b].count;
+      if (count == 0 || rightCount[b + 1] == 0) continue;
+      float cost = surfaceArea(lmin, lmax) * count + rightArea[b + 1] * rightCount[b + 1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        *bestAxis = axis;
+        *bestBin = b;
+      }
+    }
+  }
+  return bestCost;
+}
+
+// Build the subtree of refs[begin, end[ in the node slot nodeIndex.
+// A subtree of n references has at most 2n-1 nodes : the left child gets the slots following
+// its parent and the right child the ones after, so that both subtrees can be built by
+// independent tasks. Leaves reference their objects in place in bvh->prims. Nodes at depth
+// BVH_STACK_SIZE - 1 are leaves whatever their size, so that the traversal stacks cannot overflow.
+void buildBvhNode(Bvh *bvh, BvhRef *refs, int begin, int end, int nodeIndex, int depth) {
+  int n = end - begin;
+
+  BvhRange range;
+  BvhBin bins[3][BVH_BINS];
+  if (n >= BVH_PARALLEL_BINNING) {
+    parallelBinRange(refs, begin, end, &range, bins);
+  } else {
+    rangeBounds(refs, begin, end, &range);
+    binRange(refs, begin, end, range, bins);
+  }
+
+  float leafCost = KD_INTERSECT_COST * n;
+  int bestAxis = -1, bestBin = 0;
+  float bestCost = n > 1 ? findBinnedSplit(bins, range, &bestAxis, &bestBin) : FLT_MAX;
+  // FLT_MAX when no split has been found, the scaled cost would overflow
+  if (bestAxis >= 0)
+    bestCost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * bestCost / surfaceArea(range.bmin, range.bmax);
+
+  BvhNode &node = bvh->nodes[nodeIndex];
+  node.min = range.bmin;
+  node.max = range.bmax;
+  node.axis = 0;
+
+  bool medianSplit = false;
+  bool leaf = depth >= BVH_STACK_SIZE - 1;
+  if (!leaf && (bestCost == FLT_MAX || (bestCost >= leafCost && n <= BVH_MAX_LEAF))) {
+    // all centroids are at the same place, split in the middle of the list
+    medianSplit = n > BVH_MAX_LEAF;
+    leaf = !medianSplit;
+    bestAxis = 0;
+  }
+  if (leaf) {
+    node.primOffset = begin;
+    node.count = n;
+    for (int i = begin; i < end; i++)
+      bvh->prims[i] = refs[i].object;
+    return;
+  }
+
+  int mid;
+  if (medianSplit) {
+    mid = begin + n / 2;
+  } else {
+    float scale = BVH_BINS / (range.cmax[bestAxis] - range.cmin[bestAxis]);
+    int axis = bestAxis, bin = bestBin;
+    BvhRef *split = std::partition(refs + begin, refs + end, [&](const BvhRef &r) {
+      return binIndex(r, axis, range, scale) <= bin;
+    });
+    mid = split - refs;
+  }
+
+  node.count = 0;
+  node.axis = bestAxis;
+  node.secondChild = nodeIndex + 2 * (mid - begin);
+
+  if (n >= BVH_TASK_THRESHOLD) {
+#pragma omp task
+    buildBvhNode(bvh, refs, begin, mid, nodeIndex + 1, depth + 1);
+#pragma omp task
+    buildBvhNode(bvh, refs, mid, end, nodeIndex + 2 * (mid - begin), depth + 1);
+  } else {
+    buildBvhNode(bvh, refs, begin, mid, nodeIndex + 1, depth + 1);
+    buildBvhNode(bvh, refs, mid, end, nodeIndex + 2 * (mid - begin), depth + 1);
+  }
+}
+
+void compactBvhNodes(Bvh *bvh) {
+  std::vector<BvhNode> dense;
+  dense.reserve(bvh->nodes.size());
+
+  // (sparse node, dense parent waiting for its right child index)
+  std::vector<std::pair<int, int> > stack;
+  stack.push_back(std::make_pair(0, -1));
+  while (!stack.empty()) {
+    int sparse = stack.back().first;
+    int parent = stack.back().second;
+    stack.pop_back();
+    if (parent >= 0)
+      dense[parent].secondChild = dense.size();
+    const BvhNode &node = bvh->nodes[sparse];
+    dense.push_back(node);
+    if (node.count == 0) {
+      stack.push_back(std::make_pair(node.secondChild, int(dense.size()) - 1));
+      stack.push_back(std::make_pair(sparse + 1, -1));
+    }
+  }
+
+  dense.shrink_to_fit();
+  bvh->nodes.swap(dense);
+}
+
+Bvh* initBvh(Scene *scene) {
+  Bvh *bvh = new Bvh();
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  std::vector<BvhRef> refs;
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    BvhRef ref;
+    if (bounds->bounded[i]) {
+      ref.min = boundsMin(bounds, i);
+      ref.max = boundsMax(bounds, i);
+      ref.centroid = boundsCentroid(bounds, i);
+      ref.object = i;
+      refs.push_back(ref);
+    } else {
+      bvh->outOfTree.push_back(i);
+    }
+  }
+
+  if (!refs.empty()) {
+    bvh->nodes.resize(2 * refs.size() - 1);
+    bvh->prims.resize(refs.size());
+#pragma omp parallel
+#pragma omp single
+    buildBvhNode(bvh, refs.data(), 0, refs.size(), 0, 0);
+    compactBvhNodes(bvh);
+  }
+  bvh->buildCost = bvhCost(bvh);
+
+  return bvh;
+}
+
+void freeBvh(Bvh *bvh) {
+  delete bvh;
+}
+
+bool intersectBvh(Scene *scene, Bvh *bvh, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : bvh->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  if (bvh->nodes.empty())
     return hasIntersection;
+
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  int current = 0;
+
+  while (true) {
+    STATS_NODE();
+    const BvhNode &node = bvh->nodes[current];
+    float tnear, tfar;
+    if (intersectAabb(ray, node.min, node.max, &tnear, &tfar)) {
+      if (node.count > 0) {
+        for (int i = node.primOffset; i < node.primOffset + node.count; i++)
+          hasIntersection |= intersectPrimitive(scene, bvh->prims[i], ray, intersection);
+      } else {
+        // visit the child on the ray origin side first
+        assert(stackSize < BVH_STACK_SIZE);
+        if (ray->sign[node.axis]) {
+          stack[stackSize++] = current + 1;
+          current = node.secondChild;
+        } else {
+          stack[stackSize++] = node.secondChild;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+    if (stackSize == 0)
+      break;
+    current = stack[--stackSize];
+  }
+
+  return hasIntersection;
+}
+
+bool occludedBvh(Scene *scene, Bvh *bvh, Ray *ray) {
+  for (int i : bvh->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  if (bvh->nodes.empty())
+    return false;
+
+  // any hit will do, children are visited in storage order
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  int current = 0;
+
+  while (true) {
+    STATS_NODE();
+    const BvhNode &node = bvh->nodes[current];
+    float tnear, tfar;
+    if (intersectAabb(ray, node.min, node.max, &tnear, &tfar)) {
+      if (node.count > 0) {
+        for (int i = node.primOffset; i < node.primOffset + node.count; i++) {
+          if (occludedPrimitive(scene, bvh->prims[i], ray))
+            return true;
+        }
+      } else {
+        assert(stackSize < BVH_STACK_SIZE);
+        stack[stackSize++] = node.secondChild;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (stackSize == 0)
+      return false;
+    current = stack[--stackSize];
+  }
+}
+
+float bvhCost(const Bvh *bvh) {
+  if (bvh->nodes.empty())
+    return 0;
+  double cost = 0;
+  int n = bvh->nodes.size();
+#pragma omp parallel for reduction(+:cost)
+  for (int i = 0; i < n; i++) {
+    const BvhNode &node = bvh->nodes[i];
+    float area = surfaceArea(node.min, node.max);
+    cost += (node.count > 0) ? KD_INTERSECT_COST * node.count * area : KD_TRAVERSAL_COST * area;
+  }
+  return cost / surfaceArea(bvh->nodes[0].min, bvh->nodes[0].max);
+}
+
+//! parent links and leaf of each object, needed to walk up from the moved objects
+void initRefitData(Bvh *bvh, int objectCount) {
+  bvh->parents.assign(bvh->nodes.size(), -1);
+  bvh->objectLeaf.assign(objectCount, -1);
+  for (unsigned int i = 0; i < bvh->nodes.size(); i++) {
+    const BvhNode &node = bvh->nodes[i];
+    if (node.count > 0) {
+      for (int p = node.primOffset; p < node.primOffset + node.count; p++)
+        bvh->objectLeaf[bvh->prims[p]] = i;
+    } else {
+      bvh->parents[i + 1] = i;
+      bvh->parents[node.secondChild] = i;
+    }
+  }
+}
+
+// Recompute the bounds of the leaves holding the modified objects and of their ancestors.
+// The dirty nodes are marked first, each one counting its dirty children. Then one walk per dirty
+// leaf goes up in parallel : the last child to arrive at a node recomputes it and carries on.
+void refitBvh(Scene *scene, Bvh *bvh, const int *modified, size_t count) {
+  if (bvh->parents.size() != bvh->nodes.size() || (int)bvh->objectLeaf.size() != primitiveCount(scene))
+    initRefitData(bvh, primitiveCount(scene));
+
+  int n = bvh->nodes.size();
+  std::vector<int> dirty(n, 0);
+  std::vector<int> pending(n, 0);
+  std::vector<int> leaves(count);
+  int leafCount = 0;
+
+#pragma omp parallel for
+  for (size_t m = 0; m < count; m++) {
+    int node = bvh->objectLeaf[modified[m]];
+    bool first = true;
+    while (node >= 0) {
+      int wasDirty;
+#pragma omp atomic capture
+      { wasDirty = dirty[node]; dirty[node] = 1; }
+      if (wasDirty) break;
+      if (first) {
+        int slot;
+#pragma omp atomic capture
+        slot = leafCount++;
+        leaves[slot] = node;
+        first = false;
+      }
+      int parent = bvh->parents[node];
+      if (parent >= 0) {
+#pragma omp atomic
+        pending[parent]++;
+      }
+      node = parent;
+    }
+  }
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+#pragma omp parallel for
+  for (int l = 0; l < leafCount; l++) {
+    BvhNode &leaf = bvh->nodes[leaves[l]];
+    vec3 bmin = vec3(FLT_MAX), bmax = vec3(-FLT_MAX);
+    for (int p = leaf.primOffset; p < leaf.primOffset + leaf.count; p++) {
+      bmin = min(bmin, boundsMin(bounds, bvh->prims[p]));
+      bmax = max(bmax, boundsMax(bounds, bvh->prims[p]));
+    }
+    leaf.min = bmin;
+    leaf.max = bmax;
+
+    int node = bvh->parents[leaves[l]];
+    while (node >= 0) {
+      int remaining;
+#pragma omp atomic capture seq_cst
+      remaining = --pending[node];
+      if (remaining > 0) break;
+      BvhNode &parent = bvh->nodes[node];
+      const BvhNode &left = bvh->nodes[node + 1];
+      const BvhNode &right = bvh->nodes[parent.secondChild];
+      parent.min = min(left.min, right.min);
+      parent.max = max(left.max, right.max);
+      node = bvh->parents[node];
+    }
+  }
+}
+
+/* --------------------------------------------------------------------------- */
+
+struct s_accel {
+  Eaccel type;
+  size_t objectCount; //! number of scene primitives when the structure was built
+  bool bounded; //! false if the scene has unbounded (or no) objects
+  vec3 min; //! bounds of the scene objects when the structure was built
+  vec3 max;
+  KdTree *kdtree;
+  Bvh *bvh;
+  Bvh4 *bvh4;
+  CompactBvh4 *compactBvh4;
+  LazyBvh *lazyBvh;
+  Grid *grid;
+};
+
+void updateInstanceBounds(Scene *scene) {
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  std::vector<int> stale;
+  for (unsigned int i = 0; i < scene->objects.size(); i++) {
+    if (!bounds->bounded[i] && scene->objects[i]->geom.type == INSTANCE)
+      stale.push_back(i);
+  }
+  updateObjectBounds(scene, stale.data(), stale.size());
+}
+
+//! (re)build the structure of accel->type, previous one must have been released
+void buildAccel(Scene *scene, Accel *accel) {
+  accel->objectCount = primitiveCount(scene);
+  accel->kdtree = NULL;
+  accel->bvh = NULL;
+  accel->bvh4 = NULL;
+  accel->compactBvh4 = NULL;
+  accel->lazyBvh = NULL;
+  accel->grid = NULL;
+
+  // the instanced scenes must be ready before the bounds of their instances are asked,
+  // a prototype always gets a structure since its bounds are kept there
+  for (Scene *prototype : scene->prototypes) {
+    if (prototype->bottomLevel == NULL)
+      prototype->bottomLevel = initAccel(prototype, prototype->accel == ACCEL_NONE ? accel->type : prototype->accel);
+  }
+
+  updateInstanceBounds(scene);
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+
+  accel->bounded = !bounds->bounded.empty();
+  accel->min = vec3(FLT_MAX);
+  accel->max = vec3(-FLT_MAX);
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    if (!bounds->bounded[i]) {
+      accel->bounded = false;
+      break;
+    }
+    accel->min = min(accel->min, boundsMin(bounds, i));
+    accel->max = max(accel->max, boundsMax(bounds, i));
+  }
+
+  switch (accel->type) {
+    case ACCEL_KDTREE:
+      accel->kdtree = initKdTree(scene);
+      break;
+    case ACCEL_KDTREE_ROPES:
+      accel->kdtree = initKdTree(scene);
+      buildKdTreeRopes(accel->kdtree);
+      break;
+    case ACCEL_BVH:
+      accel->bvh = initBvh(scene);
+      break;
+    case ACCEL_BVH4:
+      accel->bvh4 = initBvh4(scene);
+      break;
+    case ACCEL_BVH4_COMPACT:
+      accel->compactBvh4 = initCompactBvh4(scene);
+      break;
+    case ACCEL_LBVH:
+      accel->bvh = initLbvh(scene);
+      break;
+    case ACCEL_SBVH:
+      accel->bvh = initSbvh(scene, SBVH_DUPLICATION_BUDGET);
+      break;
+    case ACCEL_LAZY_BVH:
+      accel->lazyBvh = initLazyBvh(scene);
+      break;
+    case ACCEL_GRID:
+      accel->grid = initGrid(scene);
+      break;
+    default:
+      perror("An unhandeld acceleration structure have been requested\n");
+  }
+}
+
+void releaseAccel(Accel *accel) {
+  freeKdTree(accel->kdtree);
+  freeBvh(accel->bvh);
+  freeBvh4(accel->bvh4);
+  freeCompactBvh4(accel->compactBvh4);
+  freeLazyBvh(accel->lazyBvh);
+  freeGrid(accel->grid);
+}
+
+Accel* initAccel(Scene *scene, Eaccel type) {
+  if (type == ACCEL_NONE)
+    return NULL;
+
+  Accel *accel = new Accel();
+  accel->type = type;
+  buildAccel(scene, accel);
+  return accel;
+}
+
+bool intersectStructure(Scene *scene, Accel *accel, Ray *ray, Intersection *intersection) {
+  switch (accel->type) {
+    case ACCEL_KDTREE:
+      return intersectKdTree(scene, accel->kdtree, ray, intersection);
+    case ACCEL_KDTREE_ROPES:
+      return intersectKdTreeRopes(scene, accel->kdtree, ray, intersection);
+    case ACCEL_BVH:
+    case ACCEL_LBVH:
+    case ACCEL_SBVH:
+      return intersectBvh(scene, accel->bvh, ray, intersection);
+    case ACCEL_BVH4:
+      return intersectBvh4(scene, accel->bvh4, ray, intersection);
+    case ACCEL_BVH4_COMPACT:
+      return intersectCompactBvh4(scene, accel->compactBvh4, ray, intersection);
+    case ACCEL_LAZY_BVH:
+      return intersectLazyBvh(scene, accel->lazyBvh, ray, intersection);
+    case ACCEL_GRID:
+      return intersectGrid(scene, accel->grid, ray, intersection);
+    default:
+      return intersectScene(scene, ray, intersection);
+  }
+}
+
+bool intersectAccel(Scene *scene, Accel *accel, Ray *ray, Intersection *intersection) {
+  STATS_BEGIN_RAY();
+  bool hasIntersection = intersectStructure(scene, accel, ray, intersection);
+  STATS_END_RAY(ray->depth > 0 ? STATS_REFLECTION : STATS_CAMERA);
+  if (hasIntersection)
+    computeHitAttributes(scene, ray, intersection);
+  return hasIntersection;
+}
+
+bool occludedStructure(Scene *scene, Accel *accel, Ray *ray) {
+  switch (accel->type) {
+    case ACCEL_KDTREE:
+    case ACCEL_KDTREE_ROPES:
+      return occludedKdTree(scene, accel->kdtree, ray);
+    case ACCEL_BVH:
+    case ACCEL_LBVH:
+    case ACCEL_SBVH:
+      return occludedBvh(scene, accel->bvh, ray);
+    case ACCEL_BVH4:
+      return occludedBvh4(scene, accel->bvh4, ray);
+    case ACCEL_BVH4_COMPACT:
+      return occludedCompactBvh4(scene, accel->compactBvh4, ray);
+    case ACCEL_LAZY_BVH:
+      return occludedLazyBvh(scene, accel->lazyBvh, ray);
+    case ACCEL_GRID:
+      return occludedGrid(scene, accel->grid, ray);
+    default:
+      return occludedScene(scene, ray);
+  }
+}
+
+bool occludedAccel(Scene *scene, Accel *accel, Ray *ray) {
+  STATS_BEGIN_RAY();
+  bool occluded = occludedStructure(scene, accel, ray);
+  STATS_END_RAY(STATS_SHADOW);
+  return occluded;
+}
+
+bool accelBounds(const Accel *accel, vec3 *aabbmin, vec3 *aabbmax) {
+  if (accel == NULL || !accel->bounded)
+    return false;
+  *aabbmin = accel->min;
+  *aabbmax = accel->max;
+  return true;
+}
+
+bool refitAccel(Scene *scene, Accel *accel, const int *modified, size_t count) {
+  updateObjectBounds(scene, modified, count);
+  bool refittable = (accel->type == ACCEL_BVH || accel->type == ACCEL_LBVH);
+  if (refittable && (int)accel->objectCount == primitiveCount(scene)) {
+    refitBvh(scene, accel->bvh, modified, count);
+    if (bvhCost(accel->bvh) <= BVH_REFIT_DEGRADATION * accel->bvh->buildCost)
+      return false;
+  }
+
+  releaseAccel(accel);
+  buildAccel(scene, accel);
+  return true;
+}
+
+void freeAccel(Accel *accel) {
+  if (accel == NULL) return;
+  releaseAccel(accel);
+  delete accel;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Autotuning of the kd-tree build parameters : candidate trees are traced with a
+ *  small stratified sample of camera rays, one parameter at a time.
+ */
+
+KdTreeParams defaultKdTreeParams() {
+  KdTreeParams params;
+  params.leafSize = 1;
+  params.depthFactor = 1.3f;
+  params.costRatio = KD_TRAVERSAL_COST / KD_INTERSECT_COST;
+  params.tuned = false;
+  return params;
+}
+
+//! one ray through a random point of each cell of a side x side grid on the image plane
+void stratifiedCameraRays(const Scene *scene, int side, std::vector<Ray> *rays) {
+  const Camera &cam = scene->cam;
+  unsigned int seed = 1;
+  rays->resize(side * side);
+  for (int j = 0; j < side; j++) {
+    for (int i = 0; i < side; i++) {
+      float x = (i + rand_r(&seed) / (float)RAND_MAX) / side * 2.f - 1.f;
+      float y = (j + rand_r(&seed) / (float)RAND_MAX) / side * 2.f - 1.f;
+      vec3 dir = cam.center + x * cam.xdir + y / cam.aspect * cam.ydir;
+      rayInit(&(*rays)[j * side + i], cam.position, normalize(dir));
+    }
+  }
+}
+
+//! best time of several passes of the rays through a kd-tree built with the parameters of the scene
+double timeKdTree(Scene *scene, const std::vector<Ray> &rays) {
+  Accel *accel = initAccel(scene, ACCEL_KDTREE);
+  double best = DBL_MAX, total = 0;
+  for (int pass = 0; pass < KD_TUNING_PASSES || total < KD_TUNING_TIME; pass++) {
+    double start = omp_get_wtime();
+    for (Ray ray : rays) {
+      Intersection intersection;
+      intersectAccel(scene, accel, &ray, &intersection);
+    }
+    double time = omp_get_wtime() - start;
+    best = std::min(best, time);
+    total += time;
+  }
+  freeAccel(accel);
+  return best;
+}
+
+double tuneKdTree(Scene *scene, int side) {
+  const int leafSizes[] = {1, 2, 4, 8};
+  const float depthFactors[] = {1.f, 1.3f, 1.6f, 2.f};
+  const float costRatios[] = {.25f, .5f, KD_TRAVERSAL_COST / KD_INTERSECT_COST, 1.f, 2.f};
+  const int candidates[] = {4, 4, 5};
+
+  std::vector<Ray> rays;
+  stratifiedCameraRays(scene, side, &rays);
+
+  const KdTreeParams defaults = defaultKdTreeParams();
+  KdTreeParams best = defaults;
+  scene->kdParams = best;
+  double bestTime = timeKdTree(scene, rays);
+  for (int param = 0; param < 3; param++) {
+    for (int c = 0; c < candidates[param]; c++) {
+      KdTreeParams candidate = best;
+      if (param == 0) candidate.leafSize = leafSizes[c];
+      if (param == 1) candidate.depthFactor = depthFactors[c];
+      if (param == 2) candidate.costRatio = costRatios[c];
+      if (candidate.leafSize == best.leafSize && candidate.depthFactor == best.depthFactor
+          && candidate.costRatio == best.costRatio)
+        continue;
+      scene->kdParams = candidate;
+      double time = timeKdTree(scene, rays);
+      if (time < KD_TUNING_MARGIN * bestTime) {
+        bestTime = time;
+        best = candidate;
+      }
+    }
+  }
+
+  // each step is compared with a single noisy time : the tuned parameters must beat the defaults
+  // again, timed afresh, or the defaults are kept
+  if (best.leafSize != defaults.leafSize || best.depthFactor != defaults.depthFactor
+      || best.costRatio != defaults.costRatio) {
+    scene->kdParams = defaults;
+    double defaultTime = timeKdTree(scene, rays);
+    scene->kdParams = best;
+    bestTime = timeKdTree(scene, rays);
+    if (bestTime >= KD_TUNING_MARGIN * defaultTime) {
+      best = defaults;
+      bestTime = defaultTime;
+    }
+  }
+
+  best.tuned = true;
+  scene->kdParams = best;
+  return bestTime;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Statistics : shape of the built structures, and nodes and objects visited by the
+ *  traversals when ACCEL_STATS is defined.
+ */
+
+TraversalCounters traversalCounters[STATS_THREADS];
+
+void initAccelStats(AccelStats *stats) {
+  stats->nodes = stats->leaves = stats->emptyLeaves = stats->maxDepth = 0;
+  std::fill(stats->leafDepths, stats->leafDepths + STATS_DEPTHS, 0);
+  stats->references = 0;
+  stats->maxLeafObjects = stats->objects = 0;
+  stats->sahCost = 0;
+  stats->memory = 0;
+}
+
+void addNodeStats(AccelStats *stats, int depth, bool leaf, int objects, float area) {
+  stats->nodes++;
+  stats->maxDepth = std::max(stats->maxDepth, depth);
+  if (!leaf) {
+    stats->sahCost += KD_TRAVERSAL_COST * area;
+    return;
+  }
+  stats->leaves++;
+  stats->emptyLeaves += objects == 0;
+  stats->leafDepths[std::min(depth, STATS_DEPTHS - 1)]++;
+  stats->references += objects;
+  stats->maxLeafObjects = std::max(stats->maxLeafObjects, objects);
+  stats->sahCost += KD_INTERSECT_COST * objects * area;
+}
+
+void kdNodeStats(const KdTree *tree, unsigned int index, vec3 nodeMin, vec3 nodeMax, int depth, AccelStats *stats) {
+  const KdTreeNode &node = tree->nodes[index];
+  float area = surfaceArea(nodeMin, nodeMax);
+  if (kdIsLeaf(node)) {
+    addNodeStats(stats, depth, true, kdObjectCount(node), area);
+    return;
+  }
+  addNodeStats(stats, depth, false, 0, area);
+  int axis = kdAxis(node);
+  vec3 leftMax = nodeMax, rightMin = nodeMin;
+  leftMax[axis] = rightMin[axis] = node.split;
+  kdNodeStats(tree, index + 1, nodeMin, leftMax, depth + 1, stats);
+  kdNodeStats(tree, kdRightChild(node), rightMin, nodeMax, depth + 1, stats);
+}
+
+void kdTreeStats(const KdTree *tree, AccelStats *stats) {
+  initAccelStats(stats);
+  stats->objects = tree->inTree.size();
+  stats->memory = sizeof(KdTree) + tree->nodes.size() * sizeof(KdTreeNode) + tree->prims.size() * sizeof(int)
+                + tree->ropes.size() * sizeof(KdRopes) + (tree->inTree.size() + tree->outOfTree.size()) * sizeof(int);
+  if (tree->nodes.empty())
+    return;
+  kdNodeStats(tree, 0, tree->min, tree->max, 0, stats);
+  stats->sahCost /= surfaceArea(tree->min, tree->max);
+}
+
+void bvhStats(const Bvh *bvh, AccelStats *stats) {
+  initAccelStats(stats);
+  // leaves of a SBVH may share objects
+  std::vector<char> referenced;
+  for (int object : bvh->prims) {
+    if (object >= (int)referenced.size())
+      referenced.resize(object + 1, 0);
+    stats->objects += !referenced[object];
+    referenced[object] = 1;
+  }
+  stats->memory = sizeof(Bvh) + bvh->nodes.size() * sizeof(BvhNode) + bvh->prims.size() * sizeof(int)
+                + (bvh->outOfTree.size() + bvh->parents.size() + bvh->objectLeaf.size()) * sizeof(int);
+  if (bvh->nodes.empty())
+    return;
+
+  std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+  while (!stack.empty()) {
+    int index = stack.back().first, depth = stack.back().second;
+    stack.pop_back();
+    const BvhNode &node = bvh->nodes[index];
+    addNodeStats(stats, depth, node.count > 0, node.count, surfaceArea(node.min, node.max));
+    if (node.count == 0) {
+      stack.push_back(std::make_pair(node.secondChild, depth + 1));
+      stack.push_back(std::make_pair(index + 1, depth + 1));
+    }
+  }
+  stats->sahCost /= surfaceArea(bvh->nodes[0].min, bvh->nodes[0].max);
+}
+
+void accelStats(const Accel *accel, AccelStats *stats) {
+  initAccelStats(stats);
+  switch (accel->type) {
+    case ACCEL_KDTREE:
+    case ACCEL_KDTREE_ROPES:
+      kdTreeStats(accel->kdtree, stats);
+      break;
+    case ACCEL_BVH:
+    case ACCEL_LBVH:
+    case ACCEL_SBVH:
+      bvhStats(accel->bvh, stats);
+      break;
+    case ACCEL_BVH4:
+      bvh4Stats(accel->bvh4, stats);
+      break;
+    case ACCEL_BVH4_COMPACT:
+      compactBvh4Stats(accel->compactBvh4, stats);
+      break;
+    case ACCEL_LAZY_BVH:
+      lazyBvhStats(accel->lazyBvh, stats);
+      break;
+    case ACCEL_GRID:
+      gridStats(accel->grid, stats);
+      break;
+    default:
+      break;
+  }
+  stats->memory += sizeof(Accel);
+}
+
+void printAccelStats(const Accel *accel) {
+  if (accel == NULL) {
+    printf("no acceleration structure\n");
+    return;
+  }
+  AccelStats stats;
+  accelStats(accel, &stats);
+  printf("nodes\t\t%d (%d leaves, %d empty)\n", stats.nodes, stats.leaves, stats.emptyLeaves);
+  printf("objects/leaf\t%.2f mean, %d max\n", stats.leaves ? stats.references / (double)stats.leaves : 0., stats.maxLeafObjects);
+  printf("duplication\t%.2f references per object\n", stats.objects ? stats.references / (double)stats.objects : 0.);
+  printf("sah cost\t%.2f\n", stats.sahCost);
+  printf("memory\t\t%.1f KB\n", stats.memory / 1024.);
+  printf("leaf depths\tmax %d :", stats.maxDepth);
+  for (int d = 0; d <= std::min(stats.maxDepth, STATS_DEPTHS - 1); d++)
+    printf(" %d", stats.leafDepths[d]);
+  printf("\n");
+}
+
+void resetTraversalStats() {
+  std::fill(traversalCounters, traversalCounters + STATS_THREADS, TraversalCounters());
+}
+
+void printTraversalStats() {
+#ifdef ACCEL_STATS
+  const char *kinds[STATS_RAY_KINDS] = {"camera", "shadow", "reflection"};
+  printf("rays\t\tcount\tnodes/ray\tobjects/ray\n");
+  for (int k = 0; k < STATS_RAY_KINDS; k++) {
+    long long rays = 0, nodes = 0, objects = 0;
+    for (const TraversalCounters &counters : traversalCounters) {
+      rays += counters.rays[k];
+      nodes += counters.nodes[k];
+      objects += counters.objects[k];
+    }
+    printf("%s\t%s%lld\t%.2f\t\t%.2f\n", kinds[k], k == STATS_REFLECTION ? "" : "\t", rays,
+           rays ? nodes / (double)rays : 0., rays ? objects / (double)rays : 0.);
+  }
+#else
+  printf("traversal statistics need ACCEL_STATS to be defined\n");
+#endif
 }
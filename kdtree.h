@@ -6,9 +6,117 @@
 
 #include <cstdlib>
 #include <climits>
+#include <cfloat>
 
 typedef struct s_kdtree KdTree;
+typedef struct s_bvh Bvh;
+typedef struct s_bvh4 Bvh4;
+typedef struct s_compactBvh4 CompactBvh4;
+typedef struct s_lazyBvh LazyBvh;
+typedef struct s_grid Grid;
 
+//! an acceleration structure of any kind, built according to scene->accel
+typedef struct s_accel Accel;
+
+//! The intersect* traversals of the structures only record the nearest hit, like intersectPrimitive :
+//  intersectAccel, or a call to computeHitAttributes, completes the intersection.
 bool intersectKdTree(Scene *scene, KdTree *tree, Ray *ray, Intersection *intersection);
+//! any hit query, same contract as occludedScene
+bool occludedKdTree(Scene *scene, KdTree *tree, Ray *ray);
+//! mailboxing (on by default) skips the objects a ray has already tested in a previous leaf
+void setKdTreeMailboxing(KdTree *tree, bool enabled);
+//! objects tested by the traversals, and tests saved by mailboxing, since the last reset.
+//  Only counted when ACCEL_STATS is defined, both are 0 otherwise.
+void kdTreeTestCounts(const KdTree *tree, long long *tests, long long *skipped);
+void resetKdTreeTestCounts(KdTree *tree);
+//! link each leaf to its neighbours, needed by intersectKdTreeRopes
+void buildKdTreeRopes(KdTree *tree);
+//! stackless traversal from leaf to leaf through the ropes, same result as intersectKdTree
+bool intersectKdTreeRopes(Scene *scene, KdTree *tree, Ray *ray, Intersection *intersection);
+//! built with scene->kdParams
 KdTree*  initKdTree(Scene *scene);
+KdTreeParams defaultKdTreeParams();
+//! build kd-trees with several leaf sizes, depth limits and SAH cost ratios, trace a stratified
+//  side x side sample of camera rays through each and keep the fastest parameters in scene->kdParams,
+//  the defaults unless the tuned ones are faster. They only live as long as the scene in memory.
+//  Return the time of the sample with them.
+double tuneKdTree(Scene *scene, int side);
+void freeKdTree(KdTree *tree);
+
+//! bounding volume hierarchy built with a binned surface area heuristic
+bool intersectBvh(Scene *scene, Bvh *bvh, Ray *ray, Intersection *intersection);
+bool occludedBvh(Scene *scene, Bvh *bvh, Ray *ray);
+Bvh* initBvh(Scene *scene);
+void freeBvh(Bvh *bvh);
+//! linear BVH read from the Morton order of the object centroids, much faster to build
+//  but of lower quality than initBvh. Traced by intersectBvh, released by freeBvh.
+Bvh* initLbvh(Scene *scene);
+//! spatial split BVH : references straddling a split plane may be clipped and duplicated,
+//  at most duplicationBudget * (number of objects) times, to reduce the overlap of long
+//  thin triangles. Leaves may share objects. Traced by intersectBvh, released by freeBvh.
+Bvh* initSbvh(Scene *scene, float duplicationBudget);
+
+//! 4-wide BVH collapsed from the binary one, child boxes are tested together with SIMD
+bool intersectBvh4(Scene *scene, Bvh4 *wide, Ray *ray, Intersection *intersection);
+bool occludedBvh4(Scene *scene, Bvh4 *wide, Ray *ray);
+Bvh4* initBvh4(Scene *scene);
+void freeBvh4(Bvh4 *wide);
+//! the same tree with the child boxes quantized to 8 bits in the box of their node, rounded outwards :
+//  nodes are less than half the size, rays may enter a few more of them
+bool intersectCompactBvh4(Scene *scene, CompactBvh4 *compact, Ray *ray, Intersection *intersection);
+bool occludedCompactBvh4(Scene *scene, CompactBvh4 *compact, Ray *ray);
+CompactBvh4* initCompactBvh4(Scene *scene);
+void freeCompactBvh4(CompactBvh4 *compact);
+
+//! bounds and centroids of the objects, cached in the scene and shared by every builder : only the
+//  objects added since the last call are computed, in parallel. Objects whose geometry changes
+//  must be reported to updateObjectBounds (refitAccel does it). The primitives read by the traversals
+//  are compiled at the same time, see scenePrimitives.
+const ObjectBounds* sceneObjectBounds(Scene *scene);
+void updateObjectBounds(Scene *scene, const int *modified, size_t count);
+//! sort the objects along a Morton curve of their centroids and move them, materials included, into
+//  one block of memory in that order, so that objects close in space are close in memory. Objects of
+//  the prototypes are sorted too. Structures built before are invalid. If newIndex is not NULL it
+//  receives the new index of each object.
+void sortSceneObjects(Scene *scene, int *newIndex);
+
+//! BVH built on demand : nodes are subdivided the first time a ray reaches them, by the first thread
+//  to get there while the others wait. initLazyBvh only bounds the objects.
+bool intersectLazyBvh(Scene *scene, LazyBvh *bvh, Ray *ray, Intersection *intersection);
+bool occludedLazyBvh(Scene *scene, LazyBvh *bvh, Ray *ray);
+LazyBvh* initLazyBvh(Scene *scene);
+//! nodes built so far, *fullCount is the number of nodes of the complete tree at most
+int lazyBvhNodeCount(const LazyBvh *bvh, int *fullCount);
+void freeLazyBvh(LazyBvh *bvh);
+
+//! two level uniform grid walked with a 3D-DDA, for dense fields of objects of similar sizes :
+//  the resolution of the top grid follows the number of objects, and the one of the sub-grid of
+//  each top cell the number of objects in it
+bool intersectGrid(Scene *scene, Grid *grid, Ray *ray, Intersection *intersection);
+bool occludedGrid(Scene *scene, Grid *grid, Ray *ray);
+Grid* initGrid(Scene *scene);
+void freeGrid(Grid *grid);
+
+//! build the acceleration structure of the given type, NULL for ACCEL_NONE
+Accel* initAccel(Scene *scene, Eaccel type);
+//! nearest intersection through the acceleration structure, same contract as intersectScene : the
+//  attributes are computed once, for the nearest hit
+bool intersectAccel(Scene *scene, Accel *accel, Ray *ray, Intersection *intersection);
+//! any hit through the acceleration structure, same contract as occludedScene
+bool occludedAccel(Scene *scene, Accel *accel, Ray *ray);
+//! bounds of the objects of the scene when accel was built, false if NULL or some objects are unbounded
+bool accelBounds(const Accel *accel, vec3 *aabbmin, vec3 *aabbmax);
+//! update the structure after the geometry of the objects listed in modified has changed.
+//  BVHs (ACCEL_BVH, ACCEL_LBVH) recompute the bounds of the affected nodes, and are rebuilt once their
+//  SAH cost has degraded by more than BVH_REFIT_DEGRADATION. Other structures, or a scene with
+//  added objects, are rebuilt. Return true if the structure has been rebuilt.
+bool refitAccel(Scene *scene, Accel *accel, const int *modified, size_t count);
+void freeAccel(Accel *accel);
+
+//! shape of the structure : nodes, leaves, depths, objects per leaf, SAH cost and memory. Nothing for NULL.
+void printAccelStats(const Accel *accel);
+//! nodes visited and objects tested per ray, by kind of ray (camera, shadow, reflection).
+//  The traversals only count them, and the kd-tree mailbox tests (kdTreeTestCounts), when ACCEL_STATS is defined.
+void resetTraversalStats();
+void printTraversalStats();
 #endif
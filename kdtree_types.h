@@ -0,0 +1,197 @@
+#ifndef __KDTREE_TYPES_H__
+#define __KDTREE_TYPES_H__
+
+#include "defines.h"
+#include "kdtree.h"
+#include "scene.h"
+#include "scene_types.h"
+#include <omp.h>
+#include <vector>
+#include <algorithm>
+
+//! \file : internal types shared by the acceleration structures
+
+//! SAH constants : cost of one traversal step, cost of one primitive intersection
+//  and the bonus given to splits that cut off empty space
+#define KD_TRAVERSAL_COST 1.f
+#define KD_INTERSECT_COST 1.5f
+#define KD_EMPTY_BONUS 0.2f
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 8
+#define BVH_STACK_SIZE 64
+//! nodes with at least this many objects build their two subtrees as parallel tasks
+#define BVH_TASK_THRESHOLD 1024
+//! nodes with at least this many objects are binned by parallel tasks
+#define BVH_PARALLEL_BINNING 65536
+//! a refitted BVH is rebuilt once its SAH cost exceeds its build cost by this factor
+#define BVH_REFIT_DEGRADATION 1.3f
+//! duplicated references allowed to the spatial splits of ACCEL_SBVH, relative to the object count
+#define SBVH_DUPLICATION_BUDGET 0.3f
+
+//! 32 bytes node, the hierarchy is one array in depth first order :
+//  the left child of an interior node is the next node, only the index of the right child is stored.
+typedef struct s_bvhNode {
+  vec3 min; //! min pos of node bounding box
+  union {
+    int primOffset; //! first object in bvh->prims, if leaf
+    int secondChild; //! index of the right child, if not leaf
+  };
+  vec3 max; //! max pos of node bounding box
+  unsigned short count; //! number of objects, 0 if not leaf
+  unsigned char axis; //! split axis, used to visit the nearest child first
+  unsigned char pad;
+} BvhNode;
+
+struct s_bvh {
+  std::vector<BvhNode> nodes;
+  std::vector<int> prims; //! object indices referenced by the leaves
+
+  std::vector<int> outOfTree;
+
+  float buildCost; //! SAH cost of the hierarchy when it was built, refits compare against it
+  std::vector<int> parents; //! parent of each node (-1 for the root), computed by the first refit
+  std::vector<int> objectLeaf; //! leaf of each primitive (-1 if out of the tree), computed by the first refit
+};
+
+//! an object as seen by the BVH builders
+typedef struct s_bvhRef {
+  vec3 min;
+  vec3 max;
+  vec3 centroid;
+  int object;
+} BvhRef;
+
+typedef struct s_bvhBin {
+  vec3 min;
+  vec3 max;
+  int count;
+} BvhBin;
+
+//! bounds of a range of references and of their centroids
+typedef struct s_bvhRange {
+  vec3 bmin, bmax;
+  vec3 cmin, cmax;
+} BvhRange;
+
+inline int binIndex(const BvhRef &ref, int axis, const BvhRange &range, float scale) {
+  return std::min(BVH_BINS - 1, int((ref.centroid[axis] - range.cmin[axis]) * scale));
+}
+
+void rangeBounds(const BvhRef *refs, int begin, int end, BvhRange *range);
+//! bin the centroids of the range along the three axes
+void binRange(const BvhRef *refs, int begin, int end, const BvhRange &range, BvhBin bins[3][BVH_BINS]);
+//! best SAH split between the bins, return the sum of the child areas weighted by their counts
+//  (FLT_MAX and axis -1 if the references cannot be split), the split is after bin *bestBin
+float findBinnedSplit(const BvhBin bins[3][BVH_BINS], const BvhRange &range, int *bestAxis, int *bestBin);
+
+//! compute the bounding box of a bounded object, return false for unbounded ones (planes)
+bool objectBounds(Object *object, vec3 *aabbmin, vec3 *aabbmax);
+//! instances cached before their prototype had a structure were taken as unbounded, bound them now
+void updateInstanceBounds(Scene *scene);
+//! cached bounds of object i, see sceneObjectBounds
+inline vec3 boundsMin(const ObjectBounds *bounds, int i) {
+  return vec3(bounds->min[0][i], bounds->min[1][i], bounds->min[2][i]);
+}
+inline vec3 boundsMax(const ObjectBounds *bounds, int i) {
+  return vec3(bounds->max[0][i], bounds->max[1][i], bounds->max[2][i]);
+}
+inline vec3 boundsCentroid(const ObjectBounds *bounds, int i) {
+  return vec3(bounds->centroid[0][i], bounds->centroid[1][i], bounds->centroid[2][i]);
+}
+float surfaceArea(vec3 aabbmin, vec3 aabbmax);
+//! expected cost of a ray traversal according to the surface area heuristic
+float bvhCost(const Bvh *bvh);
+//! remove the unused node slots of a BVH built in 2n-1 preallocated slots, keeping the depth first order
+void compactBvhNodes(Bvh *bvh);
+//! the wide tree of the binary BVH of the scene, packed leaves of up to leafSize objects or the
+//  leaves of the binary BVH if leafSize is 0, as the compact tree is built
+Bvh4* buildBvh4(Scene *scene, int leafSize);
+//! slab test, the entry and exit distances clamped to [ray->tmin, ray->tmax] are returned in tnear and tfar
+bool intersectAabb(Ray *theRay,  vec3 min, vec3 max, float *tnear, float *tfar);
+
+//! leaves deeper than this are counted in the last entry of the depth histogram
+#define STATS_DEPTHS 64
+
+//! shape of a built structure, see accelStats
+typedef struct s_accelStats {
+  int nodes; //! interior nodes and leaves
+  int leaves;
+  int emptyLeaves;
+  int maxDepth;
+  int leafDepths[STATS_DEPTHS]; //! leaves at each depth
+  long long references; //! objects referenced by the leaves, several times for the objects split by a kd-tree or a SBVH
+  int maxLeafObjects;
+  int objects; //! objects in the structure, the unbounded ones are tested by every ray
+  double sahCost; //! expected cost of a ray hitting the root box
+  size_t memory; //! bytes
+} AccelStats;
+
+void initAccelStats(AccelStats *stats);
+//! stats of the structure of any type, as printed by printAccelStats
+void accelStats(const Accel *accel, AccelStats *stats);
+//! add a node of the given box area, the SAH cost is divided by the root area by the caller
+void addNodeStats(AccelStats *stats, int depth, bool leaf, int objects, float area);
+void kdTreeStats(const KdTree *tree, AccelStats *stats);
+void bvhStats(const Bvh *bvh, AccelStats *stats);
+void bvh4Stats(const Bvh4 *wide, AccelStats *stats);
+void compactBvh4Stats(const CompactBvh4 *compact, AccelStats *stats);
+//! the nodes not built yet count as leaves
+void lazyBvhStats(const LazyBvh *bvh, AccelStats *stats);
+//! the grid is the root node, its top cells are at depth 1 and their sub-cells are the leaves
+void gridStats(const Grid *grid, AccelStats *stats);
+
+//! kinds of rays told apart by the traversal statistics
+#define STATS_CAMERA 0
+#define STATS_SHADOW 1
+#define STATS_REFLECTION 2
+#define STATS_RAY_KINDS 3
+#define STATS_THREADS 256
+
+//! traversal counters of one thread, padded to their own cache lines. The nodes and objects of the
+//  current ray are pending until the outermost intersectAccel or occludedAccel returns.
+typedef struct s_traversalCounters {
+  long long rays[STATS_RAY_KINDS];
+  long long nodes[STATS_RAY_KINDS];
+  long long objects[STATS_RAY_KINDS];
+  long long pendingNodes;
+  long long pendingObjects;
+  int nesting; //! intersectAccel calls in progress, instances trace their prototype from inside one
+  char pad[36];
+} TraversalCounters;
+
+extern TraversalCounters traversalCounters[STATS_THREADS];
+
+inline TraversalCounters &threadCounters() {
+  return traversalCounters[omp_get_thread_num() % STATS_THREADS];
+}
+
+inline void beginRayStats() {
+  TraversalCounters &counters = threadCounters();
+  if (counters.nesting++ == 0)
+    counters.pendingNodes = counters.pendingObjects = 0;
+}
+
+inline void endRayStats(int kind) {
+  TraversalCounters &counters = threadCounters();
+  if (--counters.nesting > 0)
+    return;
+  counters.rays[kind]++;
+  counters.nodes[kind] += counters.pendingNodes;
+  counters.objects[kind] += counters.pendingObjects;
+}
+
+// the traversals count their nodes and objects only when ACCEL_STATS is defined
+#ifdef ACCEL_STATS
+#define STATS_BEGIN_RAY() beginRayStats()
+#define STATS_END_RAY(kind) endRayStats(kind)
+#define STATS_NODE() (threadCounters().pendingNodes++)
+#define STATS_OBJECT() (threadCounters().pendingObjects++)
+#else
+#define STATS_BEGIN_RAY()
+#define STATS_END_RAY(kind)
+#define STATS_NODE()
+#define STATS_OBJECT()
+#endif
+
+#endif
@@ -0,0 +1,295 @@
+#include "kdtree.h"
+#include "kdtree_types.h"
+#include "defines.h"
+#include "scene.h"
+#include "scene_types.h"
+#include <omp.h>
+#include <cassert>
+
+#include <vector>
+#include <algorithm>
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Lazy BVH : initLazyBvh only sets up the root, a node is subdivided with the binned
+ *  SAH the first time a ray enters its box. The first thread reaching an unbuilt node
+ *  claims it, the others wait until its children are published. Subtrees that no ray
+ *  reaches are never built.
+ */
+
+#define LAZY_UNBUILT 0
+#define LAZY_BUILT 1
+
+typedef struct s_lazyBvhNode {
+  vec3 min;
+  int offset; //! first reference of a leaf or of an unbuilt node, else index of the left child, the right one follows
+  vec3 max;
+  int count; //! references of a leaf or of an unbuilt node, 0 for an interior node
+  int axis;
+  int depth; //! depth in the tree, nodes at BVH_STACK_SIZE - 1 are leaves so that the traversal stacks cannot overflow
+  int state; //! LAZY_UNBUILT or LAZY_BUILT, read and written atomically
+  int claims; //! threads that have reached the node unbuilt, the first one builds it
+} LazyBvhNode;
+
+struct s_lazyBvh {
+  std::vector<LazyBvhNode> nodes; //! room for the 2n-1 nodes of the full tree, so they never move
+  int nodeCount; //! nodes created so far, children are allocated in pairs
+  std::vector<BvhRef> refs; //! each node partitions its own range when built
+  std::vector<int> outOfTree;
+};
+
+//! turn an unbuilt node into a leaf or an interior node with two unbuilt children.
+//  Only the thread that has claimed the node calls this, its range of references is its own.
+void buildLazyNode(LazyBvh *bvh, LazyBvhNode &node) {
+  BvhRef *refs = bvh->refs.data();
+  int begin = node.offset, end = node.offset + node.count;
+  int n = node.count;
+  if (node.depth >= BVH_STACK_SIZE - 1)
+    return;
+
+  BvhRange range;
+  BvhBin bins[3][BVH_BINS];
+  rangeBounds(refs, begin, end, &range);
+  binRange(refs, begin, end, range, bins);
+
+  float leafCost = KD_INTERSECT_COST * n;
+  int bestAxis = -1, bestBin = 0;
+  float bestCost = n > 1 ? findBinnedSplit(bins, range, &bestAxis, &bestBin) : FLT_MAX;
+  // FLT_MAX when no split has been found, the scaled cost would overflow
+  if (bestAxis >= 0)
+    bestCost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * bestCost / surfaceArea(range.bmin, range.bmax);
+
+  bool medianSplit = false;
+  if (bestCost == FLT_MAX || (bestCost >= leafCost && n <= BVH_MAX_LEAF)) {
+    if (n <= BVH_MAX_LEAF)
+      return;
+    // all centroids are at the same place, split in the middle of the list
+    medianSplit = true;
+    bestAxis = 0;
+  }
+
+  int mid;
+  if (medianSplit) {
+    mid = begin + n / 2;
+  } else {
+    float scale = BVH_BINS / (range.cmax[bestAxis] - range.cmin[bestAxis]);
+    int axis = bestAxis, bin = bestBin;
+    BvhRef *split = std::partition(refs + begin, refs + end, [&](const BvhRef &r) {
+      return binIndex(r, axis, range, scale) <= bin;
+    });
+    mid = split - refs;
+  }
+
+  int child;
+#pragma omp atomic capture
+  { child = bvh->nodeCount; bvh->nodeCount += 2; }
+
+  int childBegin[2] = {begin, mid}, childEnd[2] = {mid, end};
+  for (int c = 0; c < 2; c++) {
+    BvhRange childRange;
+    rangeBounds(refs, childBegin[c], childEnd[c], &childRange);
+    LazyBvhNode &childNode = bvh->nodes[child + c];
+    childNode.min = childRange.bmin;
+    childNode.max = childRange.bmax;
+    childNode.offset = childBegin[c];
+    childNode.count = childEnd[c] - childBegin[c];
+    childNode.axis = 0;
+    childNode.depth = node.depth + 1;
+    childNode.state = LAZY_UNBUILT;
+    childNode.claims = 0;
+  }
+
+  node.offset = child;
+  node.count = 0;
+  node.axis = bestAxis;
+}
+
+//! build the node if no thread has done it yet, or wait for the thread building it
+void claimLazyNode(LazyBvh *bvh, LazyBvhNode &node) {
+  int claim;
+#pragma omp atomic capture
+  claim = node.claims++;
+
+  if (claim == 0) {
+    buildLazyNode(bvh, node);
+    // children and node fields are written before the state
+#pragma omp atomic write seq_cst
+    node.state = LAZY_BUILT;
+    return;
+  }
+
+  int state;
+  do {
+#pragma omp atomic read seq_cst
+    state = node.state;
+  } while (state != LAZY_BUILT);
+}
+
+//! the node fields may be read once this has returned
+inline const LazyBvhNode &builtLazyNode(LazyBvh *bvh, int index) {
+  LazyBvhNode &node = bvh->nodes[index];
+  int state;
+#pragma omp atomic read seq_cst
+  state = node.state;
+  if (state != LAZY_BUILT)
+    claimLazyNode(bvh, node);
+  return node;
+}
+
+LazyBvh* initLazyBvh(Scene *scene) {
+  LazyBvh *bvh = new LazyBvh();
+  bvh->nodeCount = 0;
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    BvhRef ref;
+    if (bounds->bounded[i]) {
+      ref.min = boundsMin(bounds, i);
+      ref.max = boundsMax(bounds, i);
+      ref.centroid = boundsCentroid(bounds, i);
+      ref.object = i;
+      bvh->refs.push_back(ref);
+    } else {
+      bvh->outOfTree.push_back(i);
+    }
+  }
+
+  int n = bvh->refs.size();
+  if (n == 0)
+    return bvh;
+
+  bvh->nodes.resize(2 * n - 1);
+  BvhRange range;
+  rangeBounds(bvh->refs.data(), 0, n, &range);
+  LazyBvhNode &root = bvh->nodes[0];
+  root.min = range.bmin;
+  root.max = range.bmax;
+  root.offset = 0;
+  root.count = n;
+  root.axis = 0;
+  root.depth = 0;
+  root.state = LAZY_UNBUILT;
+  root.claims = 0;
+  bvh->nodeCount = 1;
+  return bvh;
+}
+
+int lazyBvhNodeCount(const LazyBvh *bvh, int *fullCount) {
+  *fullCount = bvh->nodes.size();
+  int count;
+#pragma omp atomic read seq_cst
+  count = bvh->nodeCount;
+  return count;
+}
+
+void freeLazyBvh(LazyBvh *bvh) {
+  delete bvh;
+}
+
+bool intersectLazyBvh(Scene *scene, LazyBvh *bvh, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  for (int i : bvh->outOfTree)
+    hasIntersection |= intersectPrimitive(scene, i, ray, intersection);
+
+  if (bvh->nodes.empty())
+    return hasIntersection;
+
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  int current = 0;
+
+  while (true) {
+    const LazyBvhNode &box = bvh->nodes[current];
+    STATS_NODE();
+    float tnear, tfar;
+    if (intersectAabb(ray, box.min, box.max, &tnear, &tfar)) {
+      const LazyBvhNode &node = builtLazyNode(bvh, current);
+      if (node.count > 0) {
+        for (int i = node.offset; i < node.offset + node.count; i++)
+          hasIntersection |= intersectPrimitive(scene, bvh->refs[i].object, ray, intersection);
+      } else {
+        // visit the child on the ray origin side first
+        if (ray->sign[node.axis]) {
+          assert(stackSize < BVH_STACK_SIZE);
+          stack[stackSize++] = node.offset;
+          current = node.offset + 1;
+        } else {
+          assert(stackSize < BVH_STACK_SIZE);
+          stack[stackSize++] = node.offset + 1;
+          current = node.offset;
+        }
+        continue;
+      }
+    }
+    if (stackSize == 0)
+      break;
+    current = stack[--stackSize];
+  }
+
+  return hasIntersection;
+}
+
+bool occludedLazyBvh(Scene *scene, LazyBvh *bvh, Ray *ray) {
+  for (int i : bvh->outOfTree) {
+    if (occludedPrimitive(scene, i, ray))
+      return true;
+  }
+
+  if (bvh->nodes.empty())
+    return false;
+
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  int current = 0;
+
+  while (true) {
+    const LazyBvhNode &box = bvh->nodes[current];
+    STATS_NODE();
+    float tnear, tfar;
+    if (intersectAabb(ray, box.min, box.max, &tnear, &tfar)) {
+      const LazyBvhNode &node = builtLazyNode(bvh, current);
+      if (node.count > 0) {
+        for (int i = node.offset; i < node.offset + node.count; i++) {
+          if (occludedPrimitive(scene, bvh->refs[i].object, ray))
+            return true;
+        }
+      } else {
+        assert(stackSize < BVH_STACK_SIZE);
+        stack[stackSize++] = node.offset + 1;
+        current = node.offset;
+        continue;
+      }
+    }
+    if (stackSize == 0)
+      return false;
+    current = stack[--stackSize];
+  }
+}
+
+void lazyBvhStats(const LazyBvh *bvh, AccelStats *stats) {
+  initAccelStats(stats);
+  stats->objects = bvh->refs.size();
+  stats->memory = sizeof(LazyBvh) + bvh->nodes.size() * sizeof(LazyBvhNode) + bvh->refs.size() * sizeof(BvhRef)
+                + bvh->outOfTree.size() * sizeof(int);
+  if (bvh->nodes.empty())
+    return;
+
+  std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+  while (!stack.empty()) {
+    int index = stack.back().first, depth = stack.back().second;
+    stack.pop_back();
+    const LazyBvhNode &node = bvh->nodes[index];
+    // rays may still be building nodes, the fields of a node are only read once it is published
+    int state;
+#pragma omp atomic read seq_cst
+    state = node.state;
+    bool interior = state == LAZY_BUILT && node.count == 0;
+    addNodeStats(stats, depth, !interior, node.count, surfaceArea(node.min, node.max));
+    if (interior) {
+      stack.push_back(std::make_pair(node.offset + 1, depth + 1));
+      stack.push_back(std::make_pair(node.offset, depth + 1));
+    }
+  }
+  stats->sahCost /= surfaceArea(bvh->nodes[0].min, bvh->nodes[0].max);
+}
@@ -0,0 +1,372 @@
+#include "kdtree.h"
+#include "kdtree_types.h"
+#include "defines.h"
+#include "scene.h"
+#include "scene_types.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <omp.h>
+
+#include <vector>
+#include <algorithm>
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Linear BVH : objects are sorted along a Morton curve of their centroids and
+ *  the hierarchy is read from the sorted codes (Karras 2012, "Maximizing parallelism
+ *  in the construction of BVHs, octrees and k-d trees"). The result is a regular Bvh
+ *  with one object per leaf, traced by intersectBvh. Runs of close or equal codes can make
+ *  the hierarchy deeper than the traversal stack : subtrees at depth BVH_STACK_SIZE - 1
+ *  are collapsed into one leaf.
+ */
+
+#define LBVH_MORTON_BITS 21 //! bits per axis, 63 bits codes
+#define LBVH_RADIX_BITS 8
+#define LBVH_TASK_THRESHOLD 4096
+
+typedef struct s_mortonRef {
+  uint64_t code;
+  int object;
+} MortonRef;
+
+//! spread the 21 low bits of v so that there are two zero bits between each of them
+inline uint64_t expandBits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+//! Morton code of a point given in [0,1]^3, x bits are the most significant of each triplet
+inline uint64_t mortonCode(vec3 p) {
+  const float scale = (float)(1 << LBVH_MORTON_BITS);
+  vec3 q = min(max(p * scale, vec3(0.f)), vec3(scale - 1.f));
+  return (expandBits((uint64_t)q.x) << 2) | (expandBits((uint64_t)q.y) << 1) | expandBits((uint64_t)q.z);
+}
+
+// Parallel least significant digit radix sort of the Morton references on their codes.
+// Each thread histograms and scatters its own contiguous chunk, so the sort is stable.
+void radixSortMorton(std::vector<MortonRef> &refs) {
+  const int buckets = 1 << LBVH_RADIX_BITS;
+  size_t n = refs.size();
+  std::vector<MortonRef> tmp(n);
+  int threads = omp_get_max_threads();
+  std::vector<size_t> histograms(threads * buckets);
+
+  for (int shift = 0; shift < 3 * LBVH_MORTON_BITS; shift += LBVH_RADIX_BITS) {
+#pragma omp parallel num_threads(threads)
+    {
+      int t = omp_get_thread_num();
+      size_t chunk = (n + threads - 1) / threads;
+      size_t begin = std::min(n, t * chunk), end = std::min(n, begin + chunk);
+      size_t *histogram = &histograms[t * buckets];
+
+      std::fill(histogram, histogram + buckets, 0);
+      for (size_t i = begin; i < end; i++)
+        histogram[(refs[i].code >> shift) & (buckets - 1)]++;
+#pragma omp barrier
+#pragma omp single
+      {
+        // bucket major, thread minor exclusive prefix sum
+        size_t sum = 0;
+        for (int b = 0; b < buckets; b++) {
+          for (int i = 0; i < threads; i++) {
+            size_t count = histograms[i * buckets + b];
+            histograms[i * buckets + b] = sum;
+            sum += count;
+          }
+        }
+      }
+      for (size_t i = begin; i < end; i++)
+        tmp[histogram[(refs[i].code >> shift) & (buckets - 1)]++] = refs[i];
+    }
+    refs.swap(tmp);
+  }
+}
+
+//! length of the common prefix of the codes i and j, the index breaks ties between equal codes
+inline int commonPrefix(const std::vector<MortonRef> &refs, int i, int j) {
+  if (j < 0 || j >= (int)refs.size())
+    return -1;
+  uint64_t a = refs[i].code, b = refs[j].code;
+  if (a == b)
+    return 64 + __builtin_clz((unsigned int)(i ^ j));
+  return __builtin_clzll(a ^ b);
+}
+
+//! range of sorted objects covered by the internal node i, and its split position
+void internalNodeRange(const std::vector<MortonRef> &refs, int i, int *first, int *last, int *split) {
+  int d = (commonPrefix(refs, i, i + 1) - commonPrefix(refs, i, i - 1)) > 0 ? 1 : -1;
+  int deltaMin = commonPrefix(refs, i, i - d);
+
+  int lmax = 2;
+  while (commonPrefix(refs, i, i + lmax * d) > deltaMin)
+    lmax *= 2;
+  int l = 0;
+  for (int t = lmax / 2; t >= 1; t /= 2) {
+    if (commonPrefix(refs, i, i + (l + t) * d) > deltaMin)
+      l += t;
+  }
+  int j = i + l * d;
+
+  int deltaNode = commonPrefix(refs, i, j);
+  int s = 0;
+  for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+    if (commonPrefix(refs, i, i + (s + t) * d) > deltaNode)
+      s += t;
+    if (t == 1) break;
+  }
+
+  *first = std::min(i, j);
+  *last = std::max(i, j);
+  *split = i + s * d + std::min(d, 0);
+}
+
+//! range and split of each internal node, in the node order of Karras (root is 0)
+typedef struct s_lbvhInternal {
+  int first;
+  int last;
+  int split;
+} LbvhInternal;
+
+//! read only state shared by the tasks that write the nodes
+typedef struct s_lbvhBuild {
+  Bvh *bvh;
+  const MortonRef *refs; //! sorted references
+  const LbvhInternal *internals;
+  const vec3 *objMin; //! bounds of the objects, in sorted order
+  const vec3 *objMax;
+  bool *collapsed; //! set once a subtree has been collapsed, its slots must then be compacted
+} LbvhBuild;
+
+void emitLbvhNode(const LbvhBuild *build, int i, int nodeIndex, int depth);
+
+//! leaf of the sorted objects [first, last]
+void emitLbvhLeaf(const LbvhBuild *build, int first, int last, int nodeIndex) {
+  BvhNode &node = build->bvh->nodes[nodeIndex];
+  node.min = build->objMin[first];
+  node.max = build->objMax[first];
+  for (int k = first + 1; k <= last; k++) {
+    node.min = min(node.min, build->objMin[k]);
+    node.max = max(node.max, build->objMax[k]);
+  }
+  node.primOffset = first;
+  node.count = last - first + 1;
+  node.axis = 0;
+}
+
+//! write the child of an internal node : a leaf if its range is one object, else internal node i
+void emitLbvhChild(const LbvhBuild *build, int i, bool leaf, int nodeIndex, int depth) {
+  if (leaf)
+    emitLbvhLeaf(build, i, i, nodeIndex);
+  else
+    emitLbvhNode(build, i, nodeIndex, depth);
+}
+
+// Write the subtree of the internal node i in depth first order at nodeIndex.
+// A subtree of k objects has exactly 2k-1 nodes, so the right child slot is known in advance
+// and both children can be written by independent tasks. Bounds are merged on the way back.
+void emitLbvhNode(const LbvhBuild *build, int i, int nodeIndex, int depth) {
+  const LbvhInternal &internal = build->internals[i];
+  if (depth >= BVH_STACK_SIZE - 1) {
+    emitLbvhLeaf(build, internal.first, internal.last, nodeIndex);
+#pragma omp atomic write
+    *build->collapsed = true;
+    return;
+  }
+  int leftIndex = nodeIndex + 1;
+  int rightIndex = nodeIndex + 2 * (internal.split - internal.first + 1);
+  bool leftLeaf = internal.split == internal.first;
+  bool rightLeaf = internal.split + 1 == internal.last;
+
+  if (internal.last - internal.first >= LBVH_TASK_THRESHOLD) {
+#pragma omp task
+    emitLbvhChild(build, internal.split, leftLeaf, leftIndex, depth + 1);
+#pragma omp task
+    emitLbvhChild(build, internal.split + 1, rightLeaf, rightIndex, depth + 1);
+#pragma omp taskwait
+  } else {
+    emitLbvhChild(build, internal.split, leftLeaf, leftIndex, depth + 1);
+    emitLbvhChild(build, internal.split + 1, rightLeaf, rightIndex, depth + 1);
+  }
+
+  BvhNode *nodes = build->bvh->nodes.data();
+  BvhNode &node = nodes[nodeIndex];
+  node.min = min(nodes[leftIndex].min, nodes[rightIndex].min);
+  node.max = max(nodes[leftIndex].max, nodes[rightIndex].max);
+  node.secondChild = rightIndex;
+  node.count = 0;
+
+  // the highest bit where the codes of the range differ tells the split axis
+  uint64_t diff = build->refs[internal.first].code ^ build->refs[internal.last].code;
+  int bit = diff ? 63 - __builtin_clzll(diff) : 0;
+  node.axis = 2 - bit % 3;
+}
+
+Bvh* initLbvh(Scene *scene) {
+  Bvh *bvh = new Bvh();
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  std::vector<int> inTree;
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    if (bounds->bounded[i])
+      inTree.push_back(i);
+    else
+      bvh->outOfTree.push_back(i);
+  }
+
+  int n = inTree.size();
+  if (n == 0) {
+    bvh->buildCost = 0;
+    return bvh;
+  }
+
+  vec3 cmin = vec3(FLT_MAX), cmax = vec3(-FLT_MAX);
+#pragma omp parallel
+  {
+    vec3 localMin = vec3(FLT_MAX), localMax = vec3(-FLT_MAX);
+#pragma omp for
+    for (int i = 0; i < n; i++) {
+      vec3 c = boundsCentroid(bounds, inTree[i]);
+      localMin = min(localMin, c);
+      localMax = max(localMax, c);
+    }
+#pragma omp critical
+    {
+      cmin = min(cmin, localMin);
+      cmax = max(cmax, localMax);
+    }
+  }
+
+  std::vector<MortonRef> refs(n);
+  vec3 extent = max(cmax - cmin, vec3(FLT_MIN));
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    refs[i].code = mortonCode((boundsCentroid(bounds, inTree[i]) - cmin) / extent);
+    refs[i].object = i;
+  }
+
+  radixSortMorton(refs);
+
+  // leaves follow the sorted order, reorder bounds and object indices accordingly
+  std::vector<vec3> sortedMin(n), sortedMax(n);
+  bvh->prims.resize(n);
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    sortedMin[i] = boundsMin(bounds, inTree[refs[i].object]);
+    sortedMax[i] = boundsMax(bounds, inTree[refs[i].object]);
+    bvh->prims[i] = inTree[refs[i].object];
+  }
+
+  bvh->nodes.resize(2 * n - 1);
+  std::vector<LbvhInternal> internals(std::max(n - 1, 0));
+  bool collapsed = false;
+  LbvhBuild build = {bvh, refs.data(), internals.data(), sortedMin.data(), sortedMax.data(), &collapsed};
+  if (n == 1) {
+    emitLbvhLeaf(&build, 0, 0, 0);
+    bvh->buildCost = bvhCost(bvh);
+    return bvh;
+  }
+
+#pragma omp parallel for
+  for (int i = 0; i < n - 1; i++)
+    internalNodeRange(refs, i, &internals[i].first, &internals[i].last, &internals[i].split);
+
+#pragma omp parallel
+#pragma omp single
+  emitLbvhNode(&build, 0, 0, 0);
+  if (collapsed)
+    compactBvhNodes(bvh);
+  bvh->buildCost = bvhCost(bvh);
+
+  return bvh;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Spatial reordering of the objects : the objects are sorted along the Morton curve
+ *  of their centroids and copied, in that order, into one block of memory. Neighbouring
+ *  leaves of any structure built afterwards then reference objects that are close in
+ *  memory, with their material stored inside them.
+ */
+
+void sortSceneObjects(Scene *scene, int *newIndex) {
+  // the structure of a prototype indexes its objects, it is built again once they are sorted
+  // since the bounds of its instances are taken from it
+  freeAccel(scene->bottomLevel);
+  scene->bottomLevel = NULL;
+  for (Scene *prototype : scene->prototypes) {
+    sortSceneObjects(prototype, NULL);
+    if (prototype->accel != ACCEL_NONE)
+      prototype->bottomLevel = initAccel(prototype, prototype->accel);
+  }
+
+  int n = scene->objects.size();
+  updateInstanceBounds(scene);
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  vec3 cmin = vec3(FLT_MAX), cmax = vec3(-FLT_MAX);
+  std::vector<int> unbounded;
+  for (int i = 0; i < n; i++) {
+    if (!bounds->bounded[i]) {
+      unbounded.push_back(i);
+      continue;
+    }
+    cmin = min(cmin, boundsCentroid(bounds, i));
+    cmax = max(cmax, boundsCentroid(bounds, i));
+  }
+
+  std::vector<MortonRef> refs;
+  refs.reserve(n);
+  vec3 extent = max(cmax - cmin, vec3(FLT_MIN));
+  for (int i = 0; i < n; i++) {
+    if (bounds->bounded[i])
+      refs.push_back({mortonCode((boundsCentroid(bounds, i) - cmin) / extent), i});
+  }
+  radixSortMorton(refs);
+
+  // unbounded objects are tested by every ray whatever their place, they go last
+  std::vector<int> order(n);
+  for (unsigned int k = 0; k < refs.size(); k++)
+    order[k] = refs[k].object;
+  std::copy(unbounded.begin(), unbounded.end(), order.begin() + refs.size());
+
+  Object *block = (Object *)malloc(std::max(n, 1) * sizeof(Object));
+  ObjectBounds sorted;
+  for (int a = 0; a < 3; a++) {
+    sorted.min[a].resize(n);
+    sorted.max[a].resize(n);
+    sorted.centroid[a].resize(n);
+  }
+  sorted.bounded.resize(n);
+  // the triangles of the meshes are not moved, their bounds are cached again
+  sorted.objectCount = n;
+  for (int k = 0; k < n; k++) {
+    int i = order[k];
+    block[k] = *scene->objects[i];
+    for (int a = 0; a < 3; a++) {
+      sorted.min[a][k] = bounds->min[a][i];
+      sorted.max[a][k] = bounds->max[a][i];
+      sorted.centroid[a][k] = bounds->centroid[a][i];
+    }
+    sorted.bounded[k] = bounds->bounded[i];
+    if (newIndex)
+      newIndex[i] = k;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (!inObjectBlock(scene, scene->objects[i]))
+      freeObject(scene->objects[i]);
+  }
+  free(scene->objectBlock);
+  scene->objectBlock = block;
+  scene->objectBlockSize = n;
+  for (int k = 0; k < n; k++)
+    scene->objects[k] = &block[k];
+  scene->bounds = sorted;
+  // the primitives follow the new order too
+  scene->primitives = ScenePrimitives();
+  scenePrimitives(scene);
+}
@@ -120,6 +120,7 @@ Scene * initScene1() {
     Scene *scene = initScene();
     setCamera(scene, point3(3,0,0), vec3(0,0.3,0), vec3(0,1,0), 60, (float)WIDTH/(float)HEIGHT);
 	setSkyColor(scene, color3(0.2, 0.2, 0.7));
+    setAccelerator(scene, ACCEL_BVH);
 
     Material mat;
     mat.IOR = 1.12;
@@ -167,6 +168,7 @@ Scene *initScene2() {
     Scene *scene = initScene();
     setCamera(scene, point3(0.5,3,1), vec3(0,0,0.6), vec3(0,0,1), 60, (float)WIDTH/(float)HEIGHT);
     setSkyColor(scene, color3(0.2, 0.2, 0.7));
+    setAccelerator(scene, ACCEL_BVH);
     Material mat;
     mat.diffuseColor = color3(0.014, 0.012, 0.012);
     mat.specularColor  = color3(1.0, 0.882, 0.786);
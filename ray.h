@@ -23,10 +23,13 @@ inline void rayInit(Ray *r, point3 o, vec3 d, float tmin=0, float tmax=100000, i
     r->tmin = tmin;
     r->tmax = tmax;
     r->depth = depth;
-    r->sign[0] = r->dir.x>0?0:1;
-    r->sign[1] = r->dir.y>0?0:1;
-    r->sign[2] = r->dir.z>0?0:1;
-    r->invdir = 1.f/d;
+    // the sign is taken from dir, and a null component is replaced by a tiny one of that sign : invdir
+    // stays finite, -Ofast assumes it is and reassociates the slab tests, where inf - inf gives NaN
+    for (int a = 0; a < 3; a++) {
+        r->sign[a] = d[a]<0?1:0;
+        float safe = fabsf(d[a]) > 1e-20f ? d[a] : (r->sign[a] ? -1e-20f : 1e-20f);
+        r->invdir[a] = 1.f/safe;
+    }
 }
 
 inline point3 rayAt(const Ray r, float t) {
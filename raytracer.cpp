@@ -4,8 +4,17 @@
 #include "ray.h"
 #include "image.h"
 #include "kdtree.h"
+#include "kdtree_types.h"
 #include <stdio.h>
 #include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#if defined(__AVX512F__) || defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 #define MAX_DEPTH 10
 
@@ -14,11 +23,13 @@
 const float acne_eps = 1e-4;
 int cpt = 0;
 
-bool intersectTriangle (Ray *ray, Intersection *intersection, Object *triangle) {
-  point3 v0 = triangle->geom.triangle.v0;
-  point3 v1 = triangle->geom.triangle.v1;
-  point3 v2 = triangle->geom.triangle.v2;
-  
+// The hit* functions only compute the distance of the nearest hit of a primitive in
+// [ray->tmin, ray->tmax] : occlusion queries and the traversals stop there, the *Attributes
+// functions fill the intersection at ray->tmax. They take the geometry by value so that objects,
+// meshes and compiled primitives share them. Their *Kernel bodies are inline, the loops of the
+// traversals get them without a call.
+
+bool hitTriangleEdges(const Ray *ray, point3 v0, point3 v1, point3 v2, float *t) {
   vec3 n = cross<float>((v1 - v0), (v2 - v0));
   n = normalize<float>(n);
   float cos_theta = dot<float>(n, ray->dir);
@@ -27,11 +38,11 @@ bool intersectTriangle (Ray *ray, Intersection *intersection, Object *triangle)
   
   float D = dot<float>(-n, v0);
 
-  float t = -(dot<float>(n, ray->orig) + D) / cos_theta;
+  *t = -(dot<float>(n, ray->orig) + D) / cos_theta;
   
-  if (t < 0 || t > ray->tmax || t < ray->tmin) return false;
+  if (*t < 0 || *t > ray->tmax || *t < ray->tmin) return false;
   
-  vec3 hitPoint = rayAt(*ray, t);
+  vec3 hitPoint = rayAt(*ray, *t);
   
   vec3 edge0 = v1 - v0;
   vec3 edge1 = v2 - v1;
@@ -41,121 +52,816 @@ bool intersectTriangle (Ray *ray, Intersection *intersection, Object *triangle)
   vec3 c1 = hitPoint - v1;
   vec3 c2 = hitPoint - v2;
   
-  
-  if (dot<float>(n, cross<float>(edge0, c0)) > 0 &&
-      dot<float>(n, cross<float>(edge1, c1)) > 0 &&
-      dot<float>(n, cross<float>(edge2, c2)) > 0) {
-    intersection->normal = n;
-    intersection->position = hitPoint;
-    intersection->mat = &triangle->mat;
-    ray->tmax = t;
-    return true;
+  return dot<float>(n, cross<float>(edge0, c0)) > 0 &&
+         dot<float>(n, cross<float>(edge1, c1)) > 0 &&
+         dot<float>(n, cross<float>(edge2, c2)) > 0;
+}
+
+// Moller-Trumbore : the barycentric coordinates and the distance are solved together by Cramer's rule,
+// points on the edges are inside so that neighbour triangles leave no gap between them.
+inline bool triangleKernel(const Ray *ray, point3 v0, vec3 e1, vec3 e2, int prim, TriangleHit *hit) {
+  vec3 p = cross<float>(ray->dir, e2);
+  float det = dot<float>(e1, p);
+  if (det == 0) return false;
+  float invDet = 1.f / det;
+
+  vec3 s = ray->orig - v0;
+  float u = dot<float>(s, p) * invDet;
+  if (u < 0 || u > 1) return false;
+
+  vec3 q = cross<float>(s, e1);
+  float v = dot<float>(ray->dir, q) * invDet;
+  if (v < 0 || u + v > 1) return false;
+
+  float t = dot<float>(e2, q) * invDet;
+  if (t < ray->tmin || t > ray->tmax) return false;
+
+  hit->t = t;
+  hit->u = u;
+  hit->v = v;
+  hit->prim = prim;
+  return true;
+}
+
+bool hitTriangle(const Ray *ray, point3 v0, vec3 e1, vec3 e2, int prim, TriangleHit *hit) {
+  return triangleKernel(ray, v0, e1, e2, prim, hit);
+}
+
+// The *Intersection functions record a hit of primitive prim : only its distance, in ray->tmax, and
+// what computeHitAttributes needs are written during the traversals.
+inline void recordHit(Ray *ray, Intersection *intersection, int prim, float t, float u, float v) {
+  ray->tmax = t;
+  intersection->prim = prim;
+  intersection->u = u;
+  intersection->v = v;
+}
+
+bool triangleIntersection(Ray *ray, Intersection *intersection, point3 v0, vec3 e1, vec3 e2, int prim) {
+  TriangleHit hit;
+  if (!triangleKernel(ray, v0, e1, e2, prim, &hit)) return false;
+
+  recordHit(ray, intersection, prim, hit.t, hit.u, hit.v);
+  return true;
+}
+
+void flatAttributes(const Ray *ray, vec3 n, Material *mat, Intersection *intersection) {
+  intersection->normal = n;
+  intersection->position = rayAt(*ray, ray->tmax);
+  intersection->mat = mat;
+}
+
+vec3 triangleNormal(const Geometry &geom) {
+  return normalize<float>(cross<float>(geom.triangle.v1 - geom.triangle.v0, geom.triangle.v2 - geom.triangle.v0));
+}
+
+bool intersectTriangle (Ray *ray, Intersection *intersection, Object *triangle) {
+  const Geometry &geom = triangle->geom;
+  if (!triangleIntersection(ray, intersection, geom.triangle.v0, geom.triangle.v1 - geom.triangle.v0,
+                            geom.triangle.v2 - geom.triangle.v0, -1))
+    return false;
+
+  flatAttributes(ray, triangleNormal(geom), &triangle->mat, intersection);
+  return true;
+}
+
+bool hitMeshTriangle(const Ray *ray, const Mesh *mesh, int triangle, int prim, TriangleHit *hit) {
+  const uint32_t *index = &mesh->indices[3 * triangle];
+  point3 v0 = mesh->vertices[index[0]];
+  return triangleKernel(ray, v0, mesh->vertices[index[1]] - v0, mesh->vertices[index[2]] - v0, prim, hit);
+}
+
+//! the normals of the vertices are interpolated with the barycentric coordinates of the hit, if the mesh has some
+void meshTriangleAttributes(const Ray *ray, Mesh *mesh, int triangle, float u, float v, Intersection *intersection) {
+  const uint32_t *index = &mesh->indices[3 * triangle];
+  intersection->position = rayAt(*ray, ray->tmax);
+  if (mesh->normals.empty()) {
+    point3 v0 = mesh->vertices[index[0]];
+    intersection->normal = normalize<float>(cross<float>(mesh->vertices[index[1]] - v0, mesh->vertices[index[2]] - v0));
+  } else {
+    intersection->normal = normalize<float>((1.f - u - v) * mesh->normals[index[0]] + u * mesh->normals[index[1]]
+                                            + v * mesh->normals[index[2]]);
   }
-  
-  return false;
+  intersection->mat = &mesh->mat;
 }
 
-bool intersectPlane(Ray *ray, Intersection *intersection, Object *obj) {
-  bool hasIntersection = false;
-  
-  vec3 n = obj->geom.plane.normal;
+bool meshTriangleIntersection(Ray *ray, Intersection *intersection, const Mesh *mesh, int triangle, int prim) {
+  TriangleHit hit;
+  if (!hitMeshTriangle(ray, mesh, triangle, prim, &hit)) return false;
+
+  recordHit(ray, intersection, prim, hit.t, hit.u, hit.v);
+  return true;
+}
+
+bool intersectMeshTriangle(Ray *ray, Intersection *intersection, Mesh *mesh, int triangle) {
+  if (!meshTriangleIntersection(ray, intersection, mesh, triangle, triangle)) return false;
+
+  meshTriangleAttributes(ray, mesh, triangle, intersection->u, intersection->v, intersection);
+  return true;
+}
+
+bool occludedMeshTriangle(Ray *ray, const Mesh *mesh, int triangle) {
+  TriangleHit hit;
+  return hitMeshTriangle(ray, mesh, triangle, triangle, &hit);
+}
+
+inline bool planeKernel(const Ray *ray, vec3 n, float d, float *t) {
   vec3 dir = ray->dir;
   
-  float temp = dot<float>(n, dir);
-  
-  
-  
-  if ((hasIntersection = temp != 0)) {
-    float d = obj->geom.plane.dist;
-    point3 o = ray->orig;
-    float numerator = dot<float>(o, n) + d;
-    float denominator = dot<float>(n, dir);
+  float denominator = dot<float>(n, dir);
+  if (denominator == 0) return false;
+
+  point3 o = ray->orig;
+  float numerator = dot<float>(o, n) + d;
     
-    float t = (-numerator / denominator);
-    if (t >= ray->tmin && ray->tmax >= t) {
-      ray->tmax = t;
-      intersection->mat = &obj->mat;
-      intersection->normal = n;
-      intersection->position = rayAt(*ray, t);
-    } else {
-      hasIntersection = false;
-    }
-  }
-  
-  return hasIntersection;
+  *t = (-numerator / denominator);
+  return *t >= ray->tmin && ray->tmax >= *t;
+}
 
+bool hitPlane(const Ray *ray, vec3 n, float d, float *t) {
+  return planeKernel(ray, n, d, t);
 }
 
-bool intersectSphere(Ray *ray, Intersection *intersection, Object *obj) {
+bool planeIntersection(Ray *ray, Intersection *intersection, vec3 n, float d, int prim) {
+  float t;
+  if (!planeKernel(ray, n, d, &t)) return false;
+
+  recordHit(ray, intersection, prim, t, 0, 0);
+  return true;
+}
+
+bool intersectPlane(Ray *ray, Intersection *intersection, Object *obj) {
+  if (!planeIntersection(ray, intersection, obj->geom.plane.normal, obj->geom.plane.dist, -1)) return false;
+
+  flatAttributes(ray, obj->geom.plane.normal, &obj->mat, intersection);
+  return true;
+}
+
+inline bool sphereKernel(const Ray *ray, point3 centre_, float r, float *t) {
   bool hasIntersection = false;
   
-  // t^2 + 2t (d . (O - C)) - ((O - C) . (O - C) - R^2) = 0
+  // a t^2 + b t + c = 0, a = d . d, b = 2 (d . (O - C)), c = (O - C) . (O - C) - R^2
   
-  float t;
   vec3 d = ray->dir;
   point3 o = ray->orig;
-  point3 centre_ = obj->geom.sphere.center;
-  float r = obj->geom.sphere.radius;
   
-  float a = 1;
+  float a = dot<float>(d, d);
   vec3 tmp = (o - centre_);
   float b = 2 * (dot<float>(d, tmp));
-  float c = dot<float>(tmp, tmp) - r * r;
   
-  float delta = b * b - 4.0f * a * c;
+  // b^2 - 4ac cancels badly for rays starting far from small spheres, use the equivalent
+  // 4a (r^2 - |l|^2) where l is the point of the line closest to the centre
+  vec3 l = tmp - (b / (2 * a)) * d;
+  float delta = 4.0f * a * (r * r - dot<float>(l, l));
   
   if (delta >= 0) {
     if (delta == 0) {
-      t = -b / (2 * a);
-      hasIntersection = (t >= ray->tmin && t <= ray->tmax);
+      *t = -b / (2 * a);
+      hasIntersection = (*t >= ray->tmin && *t <= ray->tmax);
     } else {
       float res1 = (-b - sqrt(delta))/(2 * a);
       float res2 = (-b + sqrt(delta))/(2 * a);
       if (res1 >= 0 && res2 >= 0) {
-	t = (res1 < res2) ? res1 : res2;
-	hasIntersection = (t >= ray->tmin && t <= ray->tmax);
+	*t = (res1 < res2) ? res1 : res2;
+	hasIntersection = (*t >= ray->tmin && *t <= ray->tmax);
       } else if (res1 < 0 && res2 >= 0) {
-	t = res2;
-	hasIntersection = (t >= ray->tmin && t <= ray->tmax);
+	*t = res2;
+	hasIntersection = (*t >= ray->tmin && *t <= ray->tmax);
       } else if (res1 >= 0 && res2 < 0) {
-	t = res1;
-	hasIntersection = (t >= ray->tmin && t <= ray->tmax);
+	*t = res1;
+	hasIntersection = (*t >= ray->tmin && *t <= ray->tmax);
       } else {
 	hasIntersection = false;
       }
     }
-    
-    if (hasIntersection) {
-      ray->tmax = t;
-      intersection->mat = &obj->mat;
-      intersection->position = rayAt(*ray, t);
-      vec3 n = intersection->position - centre_;
-      intersection->normal = normalize<float>(n);
-    }
   }
   
   return hasIntersection;
 }
 
-bool intersectScene(const Scene *scene, Ray *ray, Intersection *intersection) {
-  bool hasIntersection = false;
+bool hitSphere(const Ray *ray, point3 center, float radius, float *t) {
+  return sphereKernel(ray, center, radius, t);
+}
+
+void sphereAttributes(const Ray *ray, point3 center, Material *mat, Intersection *intersection) {
+  intersection->mat = mat;
+  intersection->position = rayAt(*ray, ray->tmax);
+  vec3 n = intersection->position - center;
+  intersection->normal = normalize<float>(n);
+}
+
+bool sphereIntersection(Ray *ray, Intersection *intersection, point3 center, float radius, int prim) {
+  float t;
+  if (!sphereKernel(ray, center, radius, &t)) return false;
+
+  recordHit(ray, intersection, prim, t, 0, 0);
+  return true;
+}
+
+bool intersectSphere(Ray *ray, Intersection *intersection, Object *obj) {
+  if (!sphereIntersection(ray, intersection, obj->geom.sphere.center, obj->geom.sphere.radius, -1)) return false;
+
+  sphereAttributes(ray, obj->geom.sphere.center, &obj->mat, intersection);
+  return true;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Packet kernels : the lanes of a packet are tested together, with the same arithmetic as
+ *  the scalar tests. Comparisons give a bit mask of the lanes, the nearest hit is picked
+ *  among the few lanes left.
+ */
+
+#if defined(__AVX512F__)
+#define PACKET_SIMD
+typedef __m512 PacketFloat;
+inline PacketFloat packetSet(float a) { return _mm512_set1_ps(a); }
+inline PacketFloat packetLoad(const float *a) { return _mm512_loadu_ps(a); }
+inline void packetStore(float *a, PacketFloat b) { _mm512_storeu_ps(a, b); }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { return _mm512_add_ps(a, b); }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { return _mm512_sub_ps(a, b); }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { return _mm512_mul_ps(a, b); }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { return _mm512_div_ps(a, b); }
+// the masked form, _mm512_sqrt_ps reads an undefined register that gcc warns about
+inline PacketFloat packetSqrt(PacketFloat a) { return _mm512_maskz_sqrt_ps(0xffff, a); }
+inline PacketFloat packetAbs(PacketFloat a) { return _mm512_abs_ps(a); }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { return _mm512_maskz_max_ps(0xffff, a, b); }
+inline int packetLessEqual(PacketFloat a, PacketFloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+inline int packetNotEqual(PacketFloat a, PacketFloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_OQ); }
+#elif defined(__AVX__)
+#define PACKET_SIMD
+typedef __m256 PacketFloat;
+inline PacketFloat packetSet(float a) { return _mm256_set1_ps(a); }
+inline PacketFloat packetLoad(const float *a) { return _mm256_loadu_ps(a); }
+inline void packetStore(float *a, PacketFloat b) { _mm256_storeu_ps(a, b); }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { return _mm256_add_ps(a, b); }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { return _mm256_sub_ps(a, b); }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { return _mm256_mul_ps(a, b); }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { return _mm256_div_ps(a, b); }
+inline PacketFloat packetSqrt(PacketFloat a) { return _mm256_sqrt_ps(a); }
+inline PacketFloat packetAbs(PacketFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { return _mm256_max_ps(a, b); }
+inline int packetLessEqual(PacketFloat a, PacketFloat b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+inline int packetNotEqual(PacketFloat a, PacketFloat b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NEQ_OQ)); }
+#elif defined(__SSE__)
+#define PACKET_SIMD
+typedef __m128 PacketFloat;
+inline PacketFloat packetSet(float a) { return _mm_set1_ps(a); }
+inline PacketFloat packetLoad(const float *a) { return _mm_loadu_ps(a); }
+inline void packetStore(float *a, PacketFloat b) { _mm_storeu_ps(a, b); }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { return _mm_add_ps(a, b); }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { return _mm_sub_ps(a, b); }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { return _mm_mul_ps(a, b); }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { return _mm_div_ps(a, b); }
+inline PacketFloat packetSqrt(PacketFloat a) { return _mm_sqrt_ps(a); }
+inline PacketFloat packetAbs(PacketFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { return _mm_max_ps(a, b); }
+inline int packetLessEqual(PacketFloat a, PacketFloat b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+inline int packetNotEqual(PacketFloat a, PacketFloat b) { return _mm_movemask_ps(_mm_cmpneq_ps(a, b)); }
+#endif
+
+#ifdef PACKET_SIMD
+//! a . b for packets of vectors given by coordinates
+inline PacketFloat packetDot(const PacketFloat a[3], const PacketFloat b[3]) {
+  return packetAdd(packetAdd(packetMul(a[0], b[0]), packetMul(a[1], b[1])), packetMul(a[2], b[2]));
+}
+
+inline void packetCross(const PacketFloat a[3], const PacketFloat b[3], PacketFloat c[3]) {
+  c[0] = packetSub(packetMul(a[1], b[2]), packetMul(a[2], b[1]));
+  c[1] = packetSub(packetMul(a[2], b[0]), packetMul(a[0], b[2]));
+  c[2] = packetSub(packetMul(a[0], b[1]), packetMul(a[1], b[0]));
+}
+#endif
+
+int hitSphereLanes(const Ray *ray, const float *lanes, int stride, int count, float t[PACKET_WIDTH]) {
+#ifdef PACKET_SIMD
+  PacketFloat d[3] = {packetSet(ray->dir.x), packetSet(ray->dir.y), packetSet(ray->dir.z)};
+  PacketFloat tmp[3];
+  for (int a = 0; a < 3; a++)
+    tmp[a] = packetSub(packetSet(ray->orig[a]), packetLoad(lanes + a * stride));
+  PacketFloat r = packetLoad(lanes + 3 * stride);
+
+  // same roots as hitSphere
+  float da = dot<float>(ray->dir, ray->dir);
+  PacketFloat a = packetSet(da), twoA = packetSet(2 * da);
+  PacketFloat b = packetMul(packetSet(2.f), packetDot(d, tmp));
+  PacketFloat s = packetDiv(b, twoA);
+  PacketFloat l[3];
+  for (int k = 0; k < 3; k++)
+    l[k] = packetSub(tmp[k], packetMul(s, d[k]));
+  PacketFloat r2 = packetMul(r, r), l2 = packetDot(l, l);
+  PacketFloat fourA = packetMul(packetSet(4.f), a);
+  PacketFloat delta = packetMul(fourA, packetSub(r2, l2));
+  // grazing rays, as those leaving the sphere they start on, have a delta close to 0 whose sign may
+  // round differently from hitSphere : the lanes within the rounding error of r^2 - |l|^2 are kept
+  PacketFloat tolerance = packetMul(fourA, packetMul(packetSet(PACKET_EPSILON), packetAdd(r2, l2)));
+  PacketFloat zero = packetSet(0.f);
+  int mask = packetLessEqual(packetSub(zero, tolerance), delta) & ((1 << count) - 1);
+  if (mask == 0)
+    return 0;
+
+  PacketFloat root = packetSqrt(packetMax(delta, zero));
+  PacketFloat res1 = packetDiv(packetSub(packetSub(zero, b), root), twoA);
+  PacketFloat res2 = packetDiv(packetAdd(packetSub(zero, b), root), twoA);
+  // the square root of delta is off by at most 2 tolerance / (root + sqrt(tolerance)), the roots also by
+  // their own rounding. A lane is kept if either widened root is in the ray range : the one hitSphere picks
+  // depends on the sign of res1, which is not known for rays starting on the sphere.
+  PacketFloat rootError = packetDiv(packetAdd(tolerance, tolerance), packetAdd(root, packetSqrt(tolerance)));
+  PacketFloat slack = packetDiv(packetAdd(rootError, packetMul(packetSet(PACKET_EPSILON), packetAdd(packetAbs(b), root))), twoA);
+  PacketFloat tmin = packetSub(packetSet(ray->tmin), slack), tmax = packetAdd(packetSet(ray->tmax), slack);
+  int in1 = packetLessEqual(tmin, res1) & packetLessEqual(res1, tmax);
+  int in2 = packetLessEqual(tmin, res2) & packetLessEqual(res2, tmax);
+  mask &= in1 | in2;
+  // res1 <= res2, the nearest root in range, lowered by its error
+  float root1[PACKET_WIDTH], root2[PACKET_WIDTH], error[PACKET_WIDTH];
+  packetStore(root1, res1);
+  packetStore(root2, res2);
+  packetStore(error, slack);
+  for (int k = 0; k < PACKET_WIDTH; k++)
+    t[k] = ((in1 >> k) & 1 ? root1[k] : root2[k]) - error[k];
+  return mask;
+#else
+  int mask = 0;
+  for (int k = 0; k < count; k++) {
+    point3 center(lanes[k], lanes[stride + k], lanes[2 * stride + k]);
+    if (sphereKernel(ray, center, lanes[3 * stride + k], &t[k]))
+      mask |= 1 << k;
+  }
+  return mask;
+#endif
+}
+
+int hitTriangleLanes(const Ray *ray, const float *lanes, int stride, int count, float t[PACKET_WIDTH]) {
+#ifdef PACKET_SIMD
+  PacketFloat d[3] = {packetSet(ray->dir.x), packetSet(ray->dir.y), packetSet(ray->dir.z)};
+  PacketFloat e1[3], e2[3], s[3];
+  for (int a = 0; a < 3; a++) {
+    s[a] = packetSub(packetSet(ray->orig[a]), packetLoad(lanes + a * stride));
+    e1[a] = packetLoad(lanes + (3 + a) * stride);
+    e2[a] = packetLoad(lanes + (6 + a) * stride);
+  }
+
+  // same steps as hitTriangle
+  PacketFloat p[3], q[3];
+  packetCross(d, e2, p);
+  PacketFloat det = packetDot(e1, p);
+  PacketFloat zero = packetSet(0.f);
+  int mask = packetNotEqual(det, zero) & ((1 << count) - 1);
+  if (mask == 0)
+    return 0;
+  PacketFloat invDet = packetDiv(packetSet(1.f), det);
+
+  // the rounding differs from the scalar test, the edges are widened by a bound of the rounding
+  // error of u and v, which grows with the distance to the triangle over its size
+  PacketFloat size = packetSet(0.f), distance = packetSet(0.f);
+  for (int a = 0; a < 3; a++) {
+    size = packetAdd(size, packetAdd(packetAbs(e1[a]), packetAbs(e2[a])));
+    distance = packetAdd(distance, packetAbs(s[a]));
+  }
+  PacketFloat tolerance = packetMul(packetSet(PACKET_EPSILON), packetMul(packetMul(size, distance), packetAbs(invDet)));
+  PacketFloat lo = packetSub(zero, tolerance), hi = packetAdd(packetSet(1.f), tolerance);
+  PacketFloat u = packetMul(packetDot(s, p), invDet);
+  mask &= packetLessEqual(lo, u) & packetLessEqual(u, hi);
+  if (mask == 0)
+    return 0;
 
+  packetCross(s, e1, q);
+  PacketFloat v = packetMul(packetDot(d, q), invDet);
+  mask &= packetLessEqual(lo, v) & packetLessEqual(packetAdd(u, v), hi);
+  if (mask == 0)
+    return 0;
+
+  // the distance is widened by a bound of its rounding error : the one of the dot product, and the one of
+  // det relative to det, which is large for grazing rays
+  PacketFloat tt = packetMul(packetDot(e2, q), invDet);
+  PacketFloat detBound = zero, ttBound = zero;
+  for (int a = 0; a < 3; a++) {
+    detBound = packetAdd(detBound, packetAbs(packetMul(e1[a], p[a])));
+    ttBound = packetAdd(ttBound, packetAbs(packetMul(e2[a], q[a])));
+  }
+  PacketFloat slack = packetMul(packetMul(packetSet(PACKET_EPSILON), packetAbs(invDet)),
+                                packetAdd(ttBound, packetMul(packetAbs(tt), packetAdd(packetAbs(det), detBound))));
+  mask &= packetLessEqual(packetSub(packetSet(ray->tmin), slack), tt) & packetLessEqual(tt, packetAdd(packetSet(ray->tmax), slack));
+  packetStore(t, packetSub(tt, slack));
+  return mask;
+#else
+  int mask = 0;
+  for (int k = 0; k < count; k++) {
+    TriangleHit hit;
+    point3 v0(lanes[k], lanes[stride + k], lanes[2 * stride + k]);
+    vec3 e1(lanes[3 * stride + k], lanes[4 * stride + k], lanes[5 * stride + k]);
+    vec3 e2(lanes[6 * stride + k], lanes[7 * stride + k], lanes[8 * stride + k]);
+    if (triangleKernel(ray, v0, e1, e2, k, &hit)) {
+      mask |= 1 << k;
+      t[k] = hit.t;
+    }
+  }
+  return mask;
+#endif
+}
+
+// the rows of a packet follow each other, PACKET_WIDTH floats apart
+int hitSpherePacket(const Ray *ray, const SpherePacket *packet, float *t) {
+  float lanes[PACKET_WIDTH];
+  return nearestLane(hitSphereLanes(ray, packet->center[0], PACKET_WIDTH, packet->count, lanes), lanes, t);
+}
+
+int hitTrianglePacket(const Ray *ray, const TrianglePacket *packet, float *t) {
+  float lanes[PACKET_WIDTH];
+  return nearestLane(hitTriangleLanes(ray, packet->v0[0], PACKET_WIDTH, packet->count, lanes), lanes, t);
+}
+
+// The ray is moved in the prototype space, where the direction is normalized again since the
+// primitive tests expect it : distances are scaled by its length there and back.
+float instanceRay(const Ray *ray, const Object *obj, Ray *local) {
+  mat3 invOrientation = obj->geom.instance.invOrientation;
+  vec3 d = invOrientation * ray->dir;
+  float scale = length(d);
+  rayInit(local, invOrientation * (ray->orig - obj->tranlation), d / scale, ray->tmin * scale, ray->tmax * scale, ray->depth);
+  return scale;
+}
+
+bool intersectInstance(Ray *ray, Intersection *intersection, Object *obj) {
+  Scene *prototype = obj->geom.instance.prototype;
+  Ray local;
+  float scale = instanceRay(ray, obj, &local);
+
+  Intersection localIntersection;
+  bool hasIntersection;
+  if (prototype->bottomLevel != NULL)
+    hasIntersection = intersectAccel(prototype, prototype->bottomLevel, &local, &localIntersection);
+  else
+    hasIntersection = intersectScene(prototype, &local, &localIntersection);
+
+  if (hasIntersection) {
+    ray->tmax = local.tmax / scale;
+    intersection->mat = localIntersection.mat;
+    intersection->position = rayAt(*ray, ray->tmax);
+    intersection->normal = normalize<float>(transpose(obj->geom.instance.invOrientation) * localIntersection.normal);
+  }
+  return hasIntersection;
+}
+
+bool occludedInstance(Ray *ray, Object *obj) {
+  Scene *prototype = obj->geom.instance.prototype;
+  Ray local;
+  instanceRay(ray, obj, &local);
+  if (prototype->bottomLevel != NULL)
+    return occludedAccel(prototype, prototype->bottomLevel, &local);
+  return occludedScene(prototype, &local);
+}
+
+bool intersectObject(Ray *ray, Intersection *intersection, Object *obj) {
+  STATS_OBJECT();
+  switch (obj->geom.type) {
+    case SPHERE:
+      return intersectSphere(ray, intersection, obj);
+    case PLANE:
+      return intersectPlane(ray, intersection, obj);
+    case TRIANGLE:
+      return intersectTriangle(ray, intersection, obj);
+    case INSTANCE:
+      return intersectInstance(ray, intersection, obj);
+    default:
+      perror("An unhandeld object have been found\n");
+  }
+  return false;
+}
+
+bool occludedObject(Ray *ray, Object *obj) {
+  STATS_OBJECT();
+  float t;
+  const Geometry &geom = obj->geom;
+  switch (geom.type) {
+    case SPHERE:
+      return sphereKernel(ray, geom.sphere.center, geom.sphere.radius, &t);
+    case PLANE:
+      return planeKernel(ray, geom.plane.normal, geom.plane.dist, &t);
+    case TRIANGLE: {
+      TriangleHit hit;
+      return triangleKernel(ray, geom.triangle.v0, geom.triangle.v1 - geom.triangle.v0, geom.triangle.v2 - geom.triangle.v0, -1, &hit);
+    }
+    case INSTANCE:
+      return occludedInstance(ray, obj);
+    default:
+      perror("An unhandeld object have been found\n");
+  }
+  return false;
+}
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Compiled primitives : the geometry of the objects copied into one array per type and
+ *  per field. The traversals test these and only go to the object for the material of a hit.
+ */
+
+//! (re)compile object i into the arrays of its type, it keeps its slot while its type is unchanged
+void compileObject(Scene *scene, int i) {
+  ScenePrimitives &p = scene->primitives;
+  const Object *obj = scene->objects[i];
+  const Geometry &geom = obj->geom;
+  bool update = p.type[i] == geom.type && p.slot[i] >= 0;
+  p.type[i] = geom.type;
+  p.material[i] = &scene->objects[i]->mat;
+
+  switch (geom.type) {
+    case SPHERE:
+      if (!update) {
+        p.slot[i] = p.sphereRadius.size();
+        p.sphereCenter.push_back(geom.sphere.center);
+        p.sphereRadius.push_back(geom.sphere.radius);
+      }
+      p.sphereCenter[p.slot[i]] = geom.sphere.center;
+      p.sphereRadius[p.slot[i]] = geom.sphere.radius;
+      break;
+    case PLANE:
+      if (!update) {
+        p.slot[i] = p.planeDist.size();
+        p.planeNormal.push_back(geom.plane.normal);
+        p.planeDist.push_back(geom.plane.dist);
+      }
+      p.planeNormal[p.slot[i]] = geom.plane.normal;
+      p.planeDist[p.slot[i]] = geom.plane.dist;
+      break;
+    case TRIANGLE: {
+      if (!update) {
+        p.slot[i] = p.triangleV0.size();
+        p.triangleV0.resize(p.slot[i] + 1);
+        p.triangleEdge1.resize(p.slot[i] + 1);
+        p.triangleEdge2.resize(p.slot[i] + 1);
+      }
+      vec3 e1 = geom.triangle.v1 - geom.triangle.v0;
+      vec3 e2 = geom.triangle.v2 - geom.triangle.v0;
+      p.triangleV0[p.slot[i]] = geom.triangle.v0;
+      p.triangleEdge1[p.slot[i]] = e1;
+      p.triangleEdge2[p.slot[i]] = e2;
+      break;
+    }
+    default:
+      // instances are intersected through their object
+      p.slot[i] = -1;
+      break;
+  }
+}
+
+int primitiveCount(const Scene *scene) {
+  size_t count = scene->objects.size();
+  for (const Mesh *mesh : scene->meshes)
+    count += mesh->indices.size() / 3;
+  return count;
+}
+
+int firstMovedPrimitive(const Scene *scene, int count, int objectCount) {
+  int objects = scene->objects.size();
+  // objects have been removed, nothing tells which ones
+  if (count > primitiveCount(scene) || objectCount > objects)
+    return 0;
+  // the triangles of the meshes come after the objects, new objects have pushed them
+  if (objectCount < objects)
+    return std::min(count, objectCount);
+  return count;
+}
+
+const ScenePrimitives* scenePrimitives(Scene *scene) {
+  ScenePrimitives &p = scene->primitives;
+  int n = primitiveCount(scene);
+  int objects = scene->objects.size();
+  int first = firstMovedPrimitive(scene, p.type.size(), p.objectCount);
+  if (first == n && p.objectCount == objects)
+    return &p;
+  if (first == 0)
+    p = ScenePrimitives();
+
+  // the primitives that have moved are compiled as new ones
+  p.type.resize(first);
+  p.slot.resize(first);
+  p.material.resize(first);
+  p.type.resize(n, 0);
+  p.slot.resize(n, -1);
+  p.material.resize(n, NULL);
+  for (int i = first; i < objects; i++)
+    compileObject(scene, i);
+
+  p.meshFirst.resize(scene->meshes.size());
+  int prim = objects;
+  for (unsigned int m = 0; m < scene->meshes.size(); m++) {
+    p.meshFirst[m] = prim;
+    int end = prim + scene->meshes[m]->indices.size() / 3;
+    for (int i = std::max(prim, first); i < end; i++) {
+      p.type[i] = MESH;
+      p.slot[i] = m;
+      p.material[i] = &scene->meshes[m]->mat;
+    }
+    prim = end;
+  }
+  p.objectCount = objects;
+  return &p;
+}
+
+void updateScenePrimitives(Scene *scene, const int *modified, size_t count) {
+  const ScenePrimitives *p = scenePrimitives(scene);
+  // the triangles of the meshes are read from their mesh, there is nothing to compile
+  for (size_t m = 0; m < count; m++) {
+    if (modified[m] < p->objectCount)
+      compileObject(scene, modified[m]);
+  }
+}
+
+bool primitiveTriangle(const Scene *scene, int i, point3 v[3]) {
+  const ScenePrimitives &p = scene->primitives;
+  if (p.type[i] == MESH) {
+    const Mesh *mesh = scene->meshes[p.slot[i]];
+    const uint32_t *index = &mesh->indices[3 * (i - p.meshFirst[p.slot[i]])];
+    for (int k = 0; k < 3; k++)
+      v[k] = mesh->vertices[index[k]];
+    return true;
+  }
+  if (p.type[i] != TRIANGLE)
+    return false;
+  const Geometry &geom = scene->objects[i]->geom;
+  v[0] = geom.triangle.v0;
+  v[1] = geom.triangle.v1;
+  v[2] = geom.triangle.v2;
+  return true;
+}
+
+//! geometry of object i read from the compiled primitives, see recordGeometryHit
+typedef struct s_compiledGeometry {
+  const Scene *scene;
+  int i;
+  int slot;
+  point3 sphereCenter() const { return scene->primitives.sphereCenter[slot]; }
+  float sphereRadius() const { return scene->primitives.sphereRadius[slot]; }
+  vec3 planeNormal() const { return scene->primitives.planeNormal[slot]; }
+  float planeDist() const { return scene->primitives.planeDist[slot]; }
+  point3 triangleV0() const { return scene->primitives.triangleV0[slot]; }
+  vec3 triangleEdge1() const { return scene->primitives.triangleEdge1[slot]; }
+  vec3 triangleEdge2() const { return scene->primitives.triangleEdge2[slot]; }
+  Object *object() const { return scene->objects[i]; }
+} CompiledGeometry;
+
+//! geometry of an object read from the object itself, see recordGeometryHit
+typedef struct s_objectGeometry {
+  Object *obj;
+  point3 sphereCenter() const { return obj->geom.sphere.center; }
+  float sphereRadius() const { return obj->geom.sphere.radius; }
+  vec3 planeNormal() const { return obj->geom.plane.normal; }
+  float planeDist() const { return obj->geom.plane.dist; }
+  point3 triangleV0() const { return obj->geom.triangle.v0; }
+  vec3 triangleEdge1() const { return obj->geom.triangle.v1 - obj->geom.triangle.v0; }
+  vec3 triangleEdge2() const { return obj->geom.triangle.v2 - obj->geom.triangle.v0; }
+  Object *object() const { return obj; }
+} ObjectGeometry;
+
+//! record the hit of object i of the given type, its geometry read from geometry : the one switch of
+//  intersectPrimitive, on the compiled primitives, and of intersectScene, on the objects
+template <typename GeometrySource>
+inline bool recordGeometryHit(const GeometrySource &geometry, int type, int i, Ray *ray, Intersection *intersection) {
+  switch (type) {
+    case SPHERE:
+      STATS_OBJECT();
+      return sphereIntersection(ray, intersection, geometry.sphereCenter(), geometry.sphereRadius(), i);
+    case PLANE:
+      STATS_OBJECT();
+      return planeIntersection(ray, intersection, geometry.planeNormal(), geometry.planeDist(), i);
+    case TRIANGLE:
+      STATS_OBJECT();
+      return triangleIntersection(ray, intersection, geometry.triangleV0(), geometry.triangleEdge1(),
+                                  geometry.triangleEdge2(), i);
+    default:
+      if (!intersectObject(ray, intersection, geometry.object()))
+        return false;
+      intersection->prim = i;
+      return true;
+  }
+}
+
+bool intersectPrimitive(const Scene *scene, int i, Ray *ray, Intersection *intersection) {
+  const ScenePrimitives &p = scene->primitives;
+  int slot = p.slot[i];
+  if (p.type[i] == MESH) {
+    STATS_OBJECT();
+    return meshTriangleIntersection(ray, intersection, scene->meshes[slot], i - p.meshFirst[slot], i);
+  }
+  CompiledGeometry geometry = {scene, i, slot};
+  return recordGeometryHit(geometry, p.type[i], i, ray, intersection);
+}
+
+bool occludedPrimitive(const Scene *scene, int i, Ray *ray) {
+  const ScenePrimitives &p = scene->primitives;
+  int slot = p.slot[i];
+  float t;
+  switch (p.type[i]) {
+    case SPHERE:
+      STATS_OBJECT();
+      return sphereKernel(ray, p.sphereCenter[slot], p.sphereRadius[slot], &t);
+    case PLANE:
+      STATS_OBJECT();
+      return planeKernel(ray, p.planeNormal[slot], p.planeDist[slot], &t);
+    case TRIANGLE: {
+      STATS_OBJECT();
+      TriangleHit hit;
+      return triangleKernel(ray, p.triangleV0[slot], p.triangleEdge1[slot], p.triangleEdge2[slot], i, &hit);
+    }
+    case MESH:
+      STATS_OBJECT();
+      return occludedMeshTriangle(ray, scene->meshes[slot], i - p.meshFirst[slot]);
+    default:
+      return occludedObject(ray, scene->objects[i]);
+  }
+}
+
+bool occludedScene(const Scene *scene, Ray *ray) {
   for (Object *o : scene->objects) {
-    switch (o->geom.type) {
+    if (occludedObject(ray, o))
+      return true;
+  }
+  for (const Mesh *mesh : scene->meshes) {
+    for (unsigned int k = 0; k < mesh->indices.size() / 3; k++) {
+      if (occludedMeshTriangle(ray, mesh, k))
+        return true;
+    }
+  }
+  return false;
+}
+
+void computeHitAttributes(const Scene *scene, const Ray *ray, Intersection *intersection) {
+  const ScenePrimitives &p = scene->primitives;
+  int i = intersection->prim;
+  int slot = p.slot[i];
+  switch (p.type[i]) {
+    case SPHERE:
+      sphereAttributes(ray, p.sphereCenter[slot], p.material[i], intersection);
+      return;
+    case PLANE:
+      flatAttributes(ray, p.planeNormal[slot], p.material[i], intersection);
+      return;
+    case TRIANGLE:
+      // the edges are the ones of triangleNormal
+      flatAttributes(ray, normalize<float>(cross<float>(p.triangleEdge1[slot], p.triangleEdge2[slot])), p.material[i],
+                     intersection);
+      return;
+    case MESH:
+      // the slot of a mesh triangle is its mesh
+      meshTriangleAttributes(ray, scene->meshes[slot], i - p.meshFirst[slot], intersection->u, intersection->v,
+                             intersection);
+      return;
+    default:
+      // instances have filled the intersection when they were hit
+      return;
+  }
+}
+
+//! computeHitAttributes read from the objects and meshes : intersectScene does not need the compiled primitives
+void sceneHitAttributes(const Scene *scene, const Ray *ray, Intersection *intersection) {
+  int i = intersection->prim;
+  int objects = scene->objects.size();
+  if (i < objects) {
+    Object *obj = scene->objects[i];
+    switch (obj->geom.type) {
       case SPHERE:
-	hasIntersection |= intersectSphere(ray, intersection, o);
-	break;
+        sphereAttributes(ray, obj->geom.sphere.center, &obj->mat, intersection);
+        break;
       case PLANE:
-	hasIntersection |= intersectPlane(ray, intersection, o);
-	break;
+        flatAttributes(ray, obj->geom.plane.normal, &obj->mat, intersection);
+        break;
       case TRIANGLE:
-	hasIntersection |= intersectTriangle(ray, intersection, o);
-	break;
+        flatAttributes(ray, triangleNormal(obj->geom), &obj->mat, intersection);
+        break;
       default:
-	perror("An unhandeld object have been found\n");
+        // instances have filled the intersection when they were hit
+        break;
     }
+    return;
+  }
+
+  i -= objects;
+  for (Mesh *mesh : scene->meshes) {
+    int count = mesh->indices.size() / 3;
+    if (i < count) {
+      meshTriangleAttributes(ray, mesh, i, intersection->u, intersection->v, intersection);
+      return;
+    }
+    i -= count;
+  }
+}
+
+bool intersectScene(const Scene *scene, Ray *ray, Intersection *intersection) {
+  bool hasIntersection = false;
+
+  int prim = 0;
+  for (Object *o : scene->objects) {
+    ObjectGeometry geometry = {o};
+    hasIntersection |= recordGeometryHit(geometry, o->geom.type, prim++, ray, intersection);
+  }
+  for (Mesh *mesh : scene->meshes) {
+    int count = mesh->indices.size() / 3;
+    for (int k = 0; k < count; k++)
+      hasIntersection |= meshTriangleIntersection(ray, intersection, mesh, k, prim + k);
+    prim += count;
   }
 
+  if (hasIntersection)
+    sceneHitAttributes(scene, ray, intersection);
   return hasIntersection;
 }
 
@@ -321,21 +1027,33 @@ color3 shade(vec3 n, vec3 v, vec3 l, color3 lc, Material *mat ){
 	    
 }
 
-//! if tree is not null, use intersectKdTree to compute the intersection instead of intersect scene
-color3 trace_ray(Scene * scene, Ray *ray, KdTree *tree) {  
+//! if accel is not null, use intersectAccel to compute the intersection instead of intersect scene
+bool intersect(Scene *scene, Ray *ray, Intersection *intersection, Accel *accel) {
+  if (accel != NULL)
+    return intersectAccel(scene, accel, ray, intersection);
+  return intersectScene(scene, ray, intersection);
+}
+
+//! if accel is not null, use occludedAccel to test the shadow ray instead of occludedScene
+bool occluded(Scene *scene, Ray *ray, Accel *accel) {
+  if (accel != NULL)
+    return occludedAccel(scene, accel, ray);
+  return occludedScene(scene, ray);
+}
+
+color3 trace_ray(Scene * scene, Ray *ray, Accel *accel) {  
   color3 ret = color3(0.f, 0.f, 0.f);
   
   if (ray->depth > MAX_DEPTH) return ret;
   
   Intersection intersection;
-  if (intersectScene(scene, ray, &intersection)) {
+  if (intersect(scene, ray, &intersection, accel)) {
     for (Light *light : scene->lights) {
       vec3 light_dir = light->position - intersection.position;
       vec3 l = normalize<float>(light_dir);
       Ray r;
       rayInit(&r, intersection.position, l, acne_eps, length<float>(light_dir));
-      Intersection shadow;
-      if (!intersectScene(scene, &r, &shadow)) {
+      if (!occluded(scene, &r, accel)) {
 	ret += shade(intersection.normal, -ray->dir, l, light->color, intersection.mat);
       }
     }
@@ -343,7 +1061,7 @@ color3 trace_ray(Scene * scene, Ray *ray, KdTree *tree) {
     vec3 newDir = normalize<float>(reflect(ray->dir, intersection.normal));
     float LdotH = dot<float>(newDir, normalize<float>(ray->dir + newDir));
     rayInit(ray, intersection.position, newDir, acne_eps, 100000, ray->depth+1);
-    ret += RDM_Fresnel(LdotH, 1, intersection.mat->IOR) * trace_ray(scene, ray, tree);
+    ret += RDM_Fresnel(LdotH, 1, intersection.mat->IOR) * trace_ray(scene, ray, accel);
   
   } else {
     ret = scene->skyColor;
@@ -358,10 +1076,32 @@ void renderImage(Image *img, Scene *scene) {
   //! This function is already operational, you might modify it for antialiasing and kdtree initializaion
   float aspect = 1.f/scene->cam.aspect;
     
-  KdTree *tree =  NULL;
+  Accel *accel =  NULL;
 
-  tree = initKdTree(scene);
-  //! \todo initialize KdTree
+  double start = omp_get_wtime();
+#ifdef KDTREE
+#ifdef SORT_OBJECTS
+  sortSceneObjects(scene, NULL);
+  printf("sort time\t%.3fs\n", omp_get_wtime() - start);
+  start = omp_get_wtime();
+#endif
+#ifdef AUTOTUNE
+  // the parameters are kept in the scene, the following renders reuse them
+  if (!scene->kdParams.tuned && (scene->accel == ACCEL_KDTREE || scene->accel == ACCEL_KDTREE_ROPES)) {
+    tuneKdTree(scene, 64);
+    printf("tuning time\t%.3fs (leaf size %d, depth factor %.1f, cost ratio %.2f)\n", omp_get_wtime() - start,
+           scene->kdParams.leafSize, scene->kdParams.depthFactor, scene->kdParams.costRatio);
+    start = omp_get_wtime();
+  }
+#endif
+  accel = initAccel(scene, scene->accel);
+#endif
+  printf("build time\t%.3fs\n", omp_get_wtime() - start);
+#ifdef ACCEL_STATS
+  printAccelStats(accel);
+  resetTraversalStats();
+#endif
+  start = omp_get_wtime();
 
   float delta_y = 1.f / (img->height * 0.5f); //! one pixel size
   vec3 dy = delta_y * aspect * scene->cam.ydir; //! one pixel step 
@@ -387,8 +1127,15 @@ void renderImage(Image *img, Scene *scene) {
 
       Ray rx;
       rayInit(&rx, scene->cam.position, normalize(ray_dir));
-      *ptr = trace_ray(scene, &rx, tree);
+      *ptr = trace_ray(scene, &rx, accel);
 
     }
   }
+
+  printf("render time\t%.3fs\n", omp_get_wtime() - start);
+#ifdef ACCEL_STATS
+  printTraversalStats();
+#endif
+
+  freeAccel(accel);
 }
@@ -13,17 +13,119 @@ typedef struct intersection_s {
   vec3 normal; //! the normal of the intersection point
   point3 position; //! the intersection point
   Material *mat; //! the material of th intersected object
+  int prim; //! the primitive hit, the traversals only record it with u and v, see computeHitAttributes
+  float u; //! barycentric coordinates of a triangle hit
+  float v;
 } Intersection;
 
 
+//! a hit of the triangle kernel : distance, barycentric coordinates u of v1 and v of v2, and index of the object
+typedef struct triangleHit_s {
+  float t;
+  float u;
+  float v;
+  int prim;
+} TriangleHit;
 
-/// test the ray intersection against each object of the scene, the nearest intersection
+//! lanes of the packet kernels : one AVX-512, AVX or SSE register, the kernels loop over the lanes
+//  with the scalar tests without SSE
+#define PACKET_EPSILON 1e-6f
+#if defined(__AVX512F__)
+#define PACKET_WIDTH 16
+#elif defined(__AVX__)
+#define PACKET_WIDTH 8
+#else
+#define PACKET_WIDTH 4
+#endif
+
+//! up to PACKET_WIDTH spheres tested together, one array per coordinate
+typedef struct spherePacket_s {
+  float center[3][PACKET_WIDTH];
+  float radius[PACKET_WIDTH];
+  int prim[PACKET_WIDTH]; //! primitive of each lane
+  int count; //! lanes used, the first ones
+} SpherePacket;
+
+//! up to PACKET_WIDTH triangles tested together, stored like the compiled ones
+typedef struct trianglePacket_s {
+  float v0[3][PACKET_WIDTH];
+  float e1[3][PACKET_WIDTH];
+  float e2[3][PACKET_WIDTH];
+  int prim[PACKET_WIDTH];
+  int count;
+} TrianglePacket;
+
+/// test the ray intersection against each object and mesh triangle of the scene, the nearest intersection
 // is stored in the parameter intersection
 // Possible intersection are considered only between ray->tmin and ray->tmax
 // ray->tmax is updated during this process
 bool intersectScene(const Scene *scene, Ray *ray, Intersection *intersection );
+//! dispatch the intersection test on the geometry type of obj
+bool intersectObject(Ray *ray, Intersection *intersection, Object *obj);
+/// any hit query for shadow rays : true as soon as one object is hit between ray->tmin and ray->tmax.
+// Neither the ray nor any intersection is written, the objects are tested in any order
+bool occludedScene(const Scene *scene, Ray *ray);
+bool occludedObject(Ray *ray, Object *obj);
+//! primitives of the scene : its objects, then the triangles of its meshes. The acceleration
+//  structures index them in this order.
+int primitiveCount(const Scene *scene);
+//! first primitive to cache again for a cache of count primitives made when the scene had objectCount
+//  objects : the new ones, or the triangles of the meshes that have moved after new objects
+int firstMovedPrimitive(const Scene *scene, int count, int objectCount);
+//! compile the primitives added since the last call into scene->primitives, everything again if some
+//  have been removed. sceneObjectBounds calls it, so every structure is built on them.
+const ScenePrimitives* scenePrimitives(Scene *scene);
+//! compile again the objects whose geometry or material has changed (updateObjectBounds calls it).
+//  Triangles of the meshes may be listed, they are skipped.
+void updateScenePrimitives(Scene *scene, const int *modified, size_t count);
+//! vertices of primitive i if it is a triangle, object or triangle of a mesh
+bool primitiveTriangle(const Scene *scene, int i, point3 v[3]);
+//! same tests as intersectObject and occludedObject on object i, read from the compiled primitives.
+//  Also the triangles of the meshes, after the objects. A hit only updates ray->tmax and records i,
+//  u and v in the intersection : computeHitAttributes fills the rest once the nearest hit is known.
+//  Instances go through their object and fill the whole intersection.
+bool intersectPrimitive(const Scene *scene, int i, Ray *ray, Intersection *intersection);
+bool occludedPrimitive(const Scene *scene, int i, Ray *ray);
+//! position, normal and material of the hit recorded in intersection, at distance ray->tmax. Read from the
+//  compiled primitives, as the traversals of the acceleration structures leave them : the objects
+//  themselves are not touched, except for instances.
+void computeHitAttributes(const Scene *scene, const Ray *ray, Intersection *intersection);
 bool intersectCylinder (Ray *ray, Intersection *intersection, Object *cylinder);
 bool intersectTriangle (Ray *ray, Intersection *intersection, Object *triangle);
+bool intersectMeshTriangle(Ray *ray, Intersection *intersection, Mesh *mesh, int triangle);
+bool occludedMeshTriangle(Ray *ray, const Mesh *mesh, int triangle);
+//! single pass test of the triangle (v0, v0 + e1, v0 + e2) in [ray->tmin, ray->tmax], edges included.
+//  Fill hit with prim on a hit, the ray is not written.
+bool hitTriangle(const Ray *ray, point3 v0, vec3 e1, vec3 e2, int prim, TriangleHit *hit);
+//! smallest non negative root of the sphere, a hit if it is in [ray->tmin, ray->tmax]
+bool hitSphere(const Ray *ray, point3 center, float radius, float *t);
+//! the former test : plane of the triangle then side of each edge, edges excluded. Kept as a reference.
+bool hitTriangleEdges(const Ray *ray, point3 v0, point3 v1, point3 v2, float *t);
+//! one ray against all the lanes of the packet at once, same tests as hitSphere and hitTriangle, but
+//  widened by a bound of their rounding error (PACKET_EPSILON relative) : the sphere discriminant, the
+//  edges of the triangles and the ray range. The lanes hit by the scalar tests are always found, the
+//  others may be, the scalar tests confirm them. Return the lane of the nearest possible hit and a lower
+//  bound of its distance in t, -1 if none.
+int hitSpherePacket(const Ray *ray, const SpherePacket *packet, float *t);
+int hitTrianglePacket(const Ray *ray, const TrianglePacket *packet, float *t);
+//! the same tests on the first count (at most PACKET_WIDTH) lanes of rows of any length : lane k of row r
+//  is lanes[r * stride + k]. The rows are those of the packets, the centers and the radii of the spheres,
+//  v0, e1 and e2 for the triangles. PACKET_WIDTH floats are loaded from each row, they must be readable.
+//  Return the mask of the lanes that may be hit, with lower bounds of their distances in t.
+int hitSphereLanes(const Ray *ray, const float *lanes, int stride, int count, float t[PACKET_WIDTH]);
+int hitTriangleLanes(const Ray *ray, const float *lanes, int stride, int count, float t[PACKET_WIDTH]);
+
+//! lane of the smallest of the distances t whose bit is set in mask, -1 if none
+inline int nearestLane(int mask, const float t[PACKET_WIDTH], float *nearest) {
+  int lane = -1;
+  for (int k = 0; mask != 0; k++, mask >>= 1) {
+    if ((mask & 1) && (lane < 0 || t[k] < *nearest)) {
+      lane = k;
+      *nearest = t[k];
+    }
+  }
+  return lane;
+}
 bool intersectPlane(Ray *ray, Intersection *intersection, Object *plane);
 bool intersectSphere(Ray *ray, Intersection *intersection, Object *sphere);
 bool intersectEllipsoide(Ray *ray, Intersection *intersection, Object *obj);
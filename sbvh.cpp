@@ -0,0 +1,345 @@
+#include "kdtree.h"
+#include "kdtree_types.h"
+#include "defines.h"
+#include "scene.h"
+#include "scene_types.h"
+#include <stdio.h>
+
+#include <vector>
+#include <algorithm>
+
+/* --------------------------------------------------------------------------- */
+/*
+ *	Spatial split BVH (Stich et al. 2009, "Spatial splits in bounding volume hierarchies").
+ *  Next to the binned object splits, a node may be cut by a plane : the references
+ *  straddling it are clipped and referenced by both children, so that long thin
+ *  triangles no longer make sibling boxes overlap. The result is a regular Bvh whose
+ *  leaves may share objects, traced by intersectBvh.
+ */
+
+//! spatial splits are only tried when the children of the best object split overlap
+//  by more than this fraction of the root surface
+#define SBVH_ALPHA 1e-5f
+
+typedef struct s_sbvhBin {
+  vec3 min; //! bounds of the reference parts clipped to the bin
+  vec3 max;
+  int entry; //! number of references starting in this bin
+  int exit; //! number of references ending in this bin
+} SbvhBin;
+
+//! state shared by the tasks building the hierarchy
+typedef struct s_sbvhBuild {
+  Scene *scene;
+  float rootArea;
+  int refLimit; //! maximum number of references, duplicates included
+  int refCount; //! current number of references, updated atomically
+} SbvhBuild;
+
+//! nodes and leaf objects of a subtree, in depth first order
+typedef struct s_sbvhBuffer {
+  std::vector<BvhNode> nodes;
+  std::vector<int> prims;
+} SbvhBuffer;
+
+//! bounds of the part of the reference between lo and hi along axis, false if there is none
+bool clipRef(Scene *scene, const BvhRef &ref, int axis, float lo, float hi, vec3 *cmin, vec3 *cmax) {
+  vec3 bmin = ref.min, bmax = ref.max;
+  vec3 v[3];
+
+  if (primitiveTriangle(scene, ref.object, v)) {
+    // vertices inside the slab and intersections of the edges with its two planes
+    float planes[2] = {lo, hi};
+    bmin = vec3(FLT_MAX);
+    bmax = vec3(-FLT_MAX);
+    for (int i = 0; i < 3; i++) {
+      vec3 a = v[i], b = v[(i + 1) % 3];
+      if (a[axis] >= lo && a[axis] <= hi) {
+        bmin = min(bmin, a);
+        bmax = max(bmax, a);
+      }
+      for (float plane : planes) {
+        if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+          vec3 p = mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+          p[axis] = plane;
+          bmin = min(bmin, p);
+          bmax = max(bmax, p);
+        }
+      }
+    }
+    // the reference may already be a clipped part of the triangle
+    bmin = max(bmin, ref.min);
+    bmax = min(bmax, ref.max);
+  }
+
+  bmin[axis] = std::max(bmin[axis], lo);
+  bmax[axis] = std::min(bmax[axis], hi);
+  *cmin = bmin;
+  *cmax = bmax;
+  return bmin.x <= bmax.x && bmin.y <= bmax.y && bmin.z <= bmax.z;
+}
+
+inline void setRefBounds(BvhRef *ref, vec3 bmin, vec3 bmax) {
+  ref->min = bmin;
+  ref->max = bmax;
+  ref->centroid = 0.5f * (bmin + bmax);
+}
+
+// Best spatial split of the node : the references are clipped to the bins they overlap,
+// a plane between two bins is charged the references entering on its left and leaving on its right.
+float findSpatialSplit(Scene *scene, const std::vector<BvhRef> &refs, const BvhRange &range,
+                       int *bestAxis, float *bestPos) {
+  float bestCost = FLT_MAX;
+  *bestAxis = -1;
+
+  for (int axis = 0; axis < 3; axis++) {
+    float origin = range.bmin[axis];
+    float width = (range.bmax[axis] - origin) / BVH_BINS;
+    if (width <= 0) continue;
+
+    SbvhBin bins[BVH_BINS];
+    for (int b = 0; b < BVH_BINS; b++) {
+      bins[b].min = vec3(FLT_MAX);
+      bins[b].max = vec3(-FLT_MAX);
+      bins[b].entry = bins[b].exit = 0;
+    }
+
+    for (const BvhRef &ref : refs) {
+      int first = std::min(BVH_BINS - 1, std::max(0, int((ref.min[axis] - origin) / width)));
+      int last = std::min(BVH_BINS - 1, std::max(first, int((ref.max[axis] - origin) / width)));
+      for (int b = first; b <= last; b++) {
+        vec3 cmin, cmax;
+        float lo = b == 0 ? -FLT_MAX : origin + b * width;
+        float hi = b == BVH_BINS - 1 ? FLT_MAX : origin + (b + 1) * width;
+        if (clipRef(scene, ref, axis, lo, hi, &cmin, &cmax)) {
+          bins[b].min = min(bins[b].min, cmin);
+          bins[b].max = max(bins[b].max, cmax);
+        }
+      }
+      bins[first].entry++;
+      bins[last].exit++;
+    }
+
+    float rightArea[BVH_BINS];
+    int rightCount[BVH_BINS];
+    vec3 rmin = vec3(FLT_MAX), rmax = vec3(-FLT_MAX);
+    int count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      rmin = min(rmin, bins[b].min);
+      rmax = max(rmax, bins[b].max);
+      count += bins[b].exit;
+      rightArea[b] = surfaceArea(rmin, rmax);
+      rightCount[b] = count;
+    }
+
+    vec3 lmin = vec3(FLT_MAX), lmax = vec3(-FLT_MAX);
+    count = 0;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+      lmin = min(lmin, bins[b].min);
+      lmax = max(lmax, bins[b].max);
+      count += bins[b].entry;
+      if (count == 0 || rightCount[b + 1] == 0) continue;
+      float cost = surfaceArea(lmin, lmax) * count + rightArea[b + 1] * rightCount[b + 1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        *bestAxis = axis;
+        *bestPos = origin + (b + 1) * width;
+      }
+    }
+  }
+  return bestCost;
+}
+
+//! split the references on the plane pos, those straddling it are clipped into both sides
+void spatialPartition(Scene *scene, const std::vector<BvhRef> &refs, int axis, float pos,
+                      std::vector<BvhRef> &left, std::vector<BvhRef> &right) {
+  for (const BvhRef &ref : refs) {
+    if (ref.max[axis] <= pos) {
+      left.push_back(ref);
+    } else if (ref.min[axis] >= pos) {
+      right.push_back(ref);
+    } else {
+      vec3 cmin, cmax;
+      BvhRef part = ref;
+      if (clipRef(scene, ref, axis, -FLT_MAX, pos, &cmin, &cmax)) {
+        setRefBounds(&part, cmin, cmax);
+        left.push_back(part);
+      }
+      if (clipRef(scene, ref, axis, pos, FLT_MAX, &cmin, &cmax)) {
+        setRefBounds(&part, cmin, cmax);
+        right.push_back(part);
+      }
+    }
+  }
+}
+
+//! append a subtree built in its own buffer, its node and object indices are shifted
+void appendSbvhSubtree(SbvhBuffer *buffer, const SbvhBuffer &subtree) {
+  int nodeOffset = buffer->nodes.size();
+  int primOffset = buffer->prims.size();
+  for (BvhNode node : subtree.nodes) {
+    if (node.count > 0)
+      node.primOffset += primOffset;
+    else
+      node.secondChild += nodeOffset;
+    buffer->nodes.push_back(node);
+  }
+  buffer->prims.insert(buffer->prims.end(), subtree.prims.begin(), subtree.prims.end());
+}
+
+// Append the subtree of refs to the buffer : the node, its left then its right subtree.
+// The cheapest of the binned object split and of the spatial split is chosen, the latter
+// only while the duplication budget allows it. Large nodes build their subtrees as tasks.
+void buildSbvhNode(SbvhBuild *build, SbvhBuffer *buffer, std::vector<BvhRef> &refs, int depth) {
+  int n = refs.size();
+
+  BvhRange range;
+  BvhBin bins[3][BVH_BINS];
+  rangeBounds(refs.data(), 0, n, &range);
+  binRange(refs.data(), 0, n, range, bins);
+
+  int nodeIndex = buffer->nodes.size();
+  buffer->nodes.push_back(BvhNode());
+  BvhNode node;
+  node.min = range.bmin;
+  node.max = range.bmax;
+  node.axis = 0;
+  node.pad = 0;
+
+  float area = surfaceArea(range.bmin, range.bmax);
+  float leafCost = KD_INTERSECT_COST * n;
+  int objectAxis = -1, objectBin = 0;
+  float objectCost = n > 1 ? findBinnedSplit(bins, range, &objectAxis, &objectBin) : FLT_MAX;
+
+  // overlap of the children of the object split tells whether spatial splits are worth a try
+  int spatialAxis = -1;
+  float spatialPos = 0, spatialCost = FLT_MAX;
+  if (objectAxis >= 0) {
+    vec3 lmin = vec3(FLT_MAX), lmax = vec3(-FLT_MAX), rmin = vec3(FLT_MAX), rmax = vec3(-FLT_MAX);
+    for (int b = 0; b < BVH_BINS; b++) {
+      const BvhBin &bin = bins[objectAxis][b];
+      if (b <= objectBin) {
+        lmin = min(lmin, bin.min);
+        lmax = max(lmax, bin.max);
+      } else {
+        rmin = min(rmin, bin.min);
+        rmax = max(rmax, bin.max);
+      }
+    }
+    vec3 omin = max(lmin, rmin), omax = min(lmax, rmax);
+    bool overlap = omin.x < omax.x && omin.y < omax.y && omin.z < omax.z;
+    int refCount;
+#pragma omp atomic read
+    refCount = build->refCount;
+    if (overlap && surfaceArea(omin, omax) > SBVH_ALPHA * build->rootArea && refCount < build->refLimit)
+      spatialCost = findSpatialSplit(build->scene, refs, range, &spatialAxis, &spatialPos);
+  } else if (n > 1) {
+    spatialCost = findSpatialSplit(build->scene, refs, range, &spatialAxis, &spatialPos);
+  }
+
+  float bestCost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * std::min(objectCost, spatialCost) / area;
+  bool leaf = (bestCost >= leafCost && n <= BVH_MAX_LEAF) || depth >= BVH_STACK_SIZE - 1 || n == 1;
+
+  std::vector<BvhRef> left, right;
+  if (!leaf && spatialCost < objectCost) {
+    spatialPartition(build->scene, refs, spatialAxis, spatialPos, left, right);
+    int duplicates = left.size() + right.size() - n;
+    int refCount;
+#pragma omp atomic capture
+    { refCount = build->refCount; build->refCount += duplicates; }
+    if (left.empty() || right.empty() || refCount + duplicates > build->refLimit) {
+      // out of budget (or useless split), give the references back and split the objects
+#pragma omp atomic
+      build->refCount -= duplicates;
+      left.clear();
+      right.clear();
+    } else {
+      node.axis = spatialAxis;
+    }
+  }
+
+  if (!leaf && left.empty()) {
+    if (objectAxis >= 0) {
+      float scale = BVH_BINS / (range.cmax[objectAxis] - range.cmin[objectAxis]);
+      for (const BvhRef &ref : refs)
+        (binIndex(ref, objectAxis, range, scale) <= objectBin ? left : right).push_back(ref);
+      node.axis = objectAxis;
+    } else if (n > BVH_MAX_LEAF) {
+      // all centroids are at the same place, split in the middle of the list
+      left.assign(refs.begin(), refs.begin() + n / 2);
+      right.assign(refs.begin() + n / 2, refs.end());
+    } else {
+      leaf = true;
+    }
+  }
+
+  if (leaf) {
+    node.primOffset = buffer->prims.size();
+    node.count = n;
+    for (const BvhRef &ref : refs)
+      buffer->prims.push_back(ref.object);
+    buffer->nodes[nodeIndex] = node;
+    return;
+  }
+
+  refs.clear();
+  refs.shrink_to_fit();
+  node.count = 0;
+
+  if (n >= BVH_TASK_THRESHOLD) {
+    SbvhBuffer leftBuffer, rightBuffer;
+#pragma omp task shared(leftBuffer, left)
+    buildSbvhNode(build, &leftBuffer, left, depth + 1);
+#pragma omp task shared(rightBuffer, right)
+    buildSbvhNode(build, &rightBuffer, right, depth + 1);
+#pragma omp taskwait
+    appendSbvhSubtree(buffer, leftBuffer);
+    node.secondChild = buffer->nodes.size();
+    appendSbvhSubtree(buffer, rightBuffer);
+  } else {
+    buildSbvhNode(build, buffer, left, depth + 1);
+    node.secondChild = buffer->nodes.size();
+    buildSbvhNode(build, buffer, right, depth + 1);
+  }
+  buffer->nodes[nodeIndex] = node;
+}
+
+Bvh* initSbvh(Scene *scene, float duplicationBudget) {
+  Bvh *bvh = new Bvh();
+
+  const ObjectBounds *bounds = sceneObjectBounds(scene);
+  std::vector<BvhRef> refs;
+  vec3 rootMin = vec3(FLT_MAX), rootMax = vec3(-FLT_MAX);
+  for (unsigned int i = 0; i < bounds->bounded.size(); i++) {
+    BvhRef ref;
+    if (bounds->bounded[i]) {
+      ref.min = boundsMin(bounds, i);
+      ref.max = boundsMax(bounds, i);
+      ref.centroid = boundsCentroid(bounds, i);
+      ref.object = i;
+      refs.push_back(ref);
+      rootMin = min(rootMin, ref.min);
+      rootMax = max(rootMax, ref.max);
+    } else {
+      bvh->outOfTree.push_back(i);
+    }
+  }
+
+  if (!refs.empty()) {
+    SbvhBuild build;
+    build.scene = scene;
+    build.rootArea = surfaceArea(rootMin, rootMax);
+    build.refCount = refs.size();
+    build.refLimit = refs.size() * (1.f + std::max(duplicationBudget, 0.f));
+
+    SbvhBuffer buffer;
+#pragma omp parallel
+#pragma omp single
+    buildSbvhNode(&build, &buffer, refs, 0);
+    bvh->nodes.swap(buffer.nodes);
+    bvh->prims.swap(buffer.prims);
+  }
+  bvh->buildCost = bvhCost(bvh);
+
+  return bvh;
+}
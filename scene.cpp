@@ -1,5 +1,6 @@
 #include "scene.h"
 #include "scene_types.h"
+#include "kdtree.h"
 #include <string.h>
 #include <algorithm>
 
@@ -34,10 +35,36 @@ Object *initTriangle(point3 v0, point3 v1, point3 v2, Material mat) {
   return ret;
 }
 
+Object *initInstance(Scene *prototype, mat3 orientation, vec3 translation) {
+  Object *ret;
+  ret = (Object *)malloc(sizeof(Object));
+  ret->mat = Material(); // unused, hits report the material of the prototype objects
+  ret->geom.type = INSTANCE;
+  ret->geom.instance.prototype = prototype;
+  ret->geom.instance.invOrientation = inverse(orientation);
+  ret->orientation = orientation;
+  ret->tranlation = translation;
+  return ret;
+}
+
 void freeObject(Object *obj) {
     free(obj);
 }
 
+Mesh *initMesh(const point3 *vertices, int vertexCount, const uint32_t *indices, int triangleCount, const vec3 *normals, Material mat) {
+  Mesh *mesh = new Mesh;
+  mesh->vertices.assign(vertices, vertices + vertexCount);
+  mesh->indices.assign(indices, indices + 3 * triangleCount);
+  if (normals != NULL)
+    mesh->normals.assign(normals, normals + vertexCount);
+  mesh->mat = mat;
+  return mesh;
+}
+
+void freeMesh(Mesh *mesh) {
+  delete mesh;
+}
+
 Light *initLight(point3 position, color3 color) {
     Light *light = (Light*)malloc(sizeof(Light));
     light->position = position;
@@ -50,12 +77,27 @@ void freeLight(Light *light) {
 }
 
 Scene * initScene() {
-    return new Scene;
+    Scene *scene = new Scene;
+    scene->accel = ACCEL_KDTREE;
+    scene->bottomLevel = NULL;
+    scene->kdParams = defaultKdTreeParams();
+    scene->objectBlock = NULL;
+    scene->objectBlockSize = 0;
+    scene->bounds.objectCount = 0;
+    scene->primitives.objectCount = 0;
+    return scene;
 }
 
 void freeScene(Scene *scene) {
-    std::for_each(scene->objects.begin(), scene->objects.end(), freeObject);
+    for (Object *obj : scene->objects) {
+      if (!inObjectBlock(scene, obj))
+        freeObject(obj);
+    }
+    free(scene->objectBlock);
+    std::for_each(scene->meshes.begin(), scene->meshes.end(), freeMesh);
     std::for_each(scene->lights.begin(), scene->lights.end(), freeLight);
+    std::for_each(scene->prototypes.begin(), scene->prototypes.end(), freeScene);
+    freeAccel(scene->bottomLevel);
     delete scene;
 }
 
@@ -73,10 +115,22 @@ void addObject(Scene *scene, Object *obj) {
     scene->objects.push_back(obj);
 }
 
+void addMesh(Scene *scene, Mesh *mesh) {
+    scene->meshes.push_back(mesh);
+}
+
 void addLight(Scene *scene, Light *light) {
     scene->lights.push_back(light);
 }
 
+void addPrototype(Scene *scene, Scene *prototype) {
+    scene->prototypes.push_back(prototype);
+}
+
 void setSkyColor(Scene *scene, color3 c) {
     scene->skyColor = c;
-}
\ No newline at end of file
+}
+
+void setAccelerator(Scene *scene, Eaccel accel) {
+    scene->accel = accel;
+}
@@ -2,12 +2,17 @@
 #define __SCENE_H__
 
 #include "defines.h"
+#include <stdint.h>
 
 // SCENE
 typedef struct scene_s Scene;
 typedef struct object_s Object;
 typedef struct light_s Light;
 typedef struct camera_s Camera;
+typedef struct objectBounds_s ObjectBounds;
+typedef struct kdTreeParams_s KdTreeParams;
+typedef struct scenePrimitives_s ScenePrimitives;
+typedef struct mesh_s Mesh;
 
 typedef struct material_s {
   float IOR;	//! Index of refraction (for dielectric)
@@ -16,17 +21,31 @@ typedef struct material_s {
   color3 diffuseColor;	//! Base color
 } Material;
 
-enum Etype {SPHERE=1, PLANE=2, TRIANGLE=3};
+//! MESH is never the type of an object, only of the primitives made of the triangles of a Mesh
+enum Etype {SPHERE=1, PLANE=2, TRIANGLE=3, INSTANCE=4, MESH=5};
+
+//! acceleration structure used by renderImage to intersect the scene
+enum Eaccel {ACCEL_NONE=0, ACCEL_KDTREE=1, ACCEL_BVH=2, ACCEL_BVH4=3, ACCEL_LBVH=4, ACCEL_SBVH=5, ACCEL_KDTREE_ROPES=6, ACCEL_LAZY_BVH=7, ACCEL_GRID=8, ACCEL_BVH4_COMPACT=9};
 
 
 //! create a new sphere structure
 Object* initSphere(point3 center, float radius, Material mat);
 Object* initPlane(vec3 normal, float d, Material mat);
 Object* initTriangle(point3 v0, point3 v1, point3 v2, Material mat);
+//! a copy of all the objects of prototype, rotated/scaled by orientation then translated.
+//  prototype must be given to the scene with addPrototype and is shared by all its instances,
+//  its acceleration structure is built once and reused by every instance
+Object* initInstance(Scene *prototype, mat3 orientation, vec3 translation);
 
 //! release memory for the object obj
 void freeObject(Object *obj);
 
+//! triangles sharing their vertices : triangle k is made of the vertices indices[3k], indices[3k+1] and
+//  indices[3k+2]. normals is NULL or holds one normal per vertex, interpolated at the hits, otherwise the
+//  normal of the triangle is used. All the triangles have the material mat. The buffers are copied.
+Mesh* initMesh(const point3 *vertices, int vertexCount, const uint32_t *indices, int triangleCount, const vec3 *normals, Material mat);
+void freeMesh(Mesh *mesh);
+
 //! init a new light at position with a give color (no special unit here for the moment)
 Light* initLight(point3 position, color3 color);
 
@@ -42,10 +61,20 @@ void setCamera(Scene *scene, point3 position, vec3 at, vec3 up, float fov, float
 //! take ownership of obj freeScene will free obj) ... typically use addObject(scene, initPlane()
 void addObject(Scene *scene, Object *obj);
 
+//! take ownership of mesh : freeScene will free it. Its triangles are intersected one by one by
+//  the acceleration structures, without an object each.
+void addMesh(Scene *scene, Mesh *mesh);
+
 //! take ownership of light : freeScene will free light) ... typically use addObject(scene, initLight()
 void addLight(Scene *scene, Light *light);
 
+//! take ownership of a scene whose objects are instanced by initInstance : freeScene will free it
+void addPrototype(Scene *scene, Scene *prototype);
+
 void setSkyColor(Scene *scene, color3 c);
 
+//! choose the acceleration structure built to render the scene (ACCEL_KDTREE by default)
+void setAccelerator(Scene *scene, Eaccel accel);
+
 
 #endif
@@ -42,16 +42,21 @@ typedef struct geometry_s {
 	    vec3 v1;
 	    vec3 v2;
         } triangle;
+        struct {
+            // instance, placed by the object orientation and tranlation
+            Scene *prototype;
+            mat3 invOrientation; //! world to prototype space
+        } instance;
     };
 } Geometry;
 
 typedef struct object_s {
-  /** not used yet, but you should use it to transform ray before
+  /** used by instances only : rays are transformed in the prototype space before
    *  computing intersection (and thu have a better control on 3D position
    */
   mat3 orientation; 
   
-  /** not used yet, but you should use it to transform ray before
+  /** used by instances only : rays are transformed in the prototype space before
    *  computing intersection (and thu have a better control on 3D position
    */
   vec3 tranlation; 
@@ -60,14 +65,76 @@ typedef struct object_s {
     Material mat;
 } Object;
 
+//! see initMesh
+typedef struct mesh_s {
+  std::vector<point3> vertices;
+  std::vector<uint32_t> indices; //! three per triangle
+  std::vector<vec3> normals; //! one per vertex, or empty
+  Material mat; //! the material of all the triangles
+} Mesh;
+
 typedef std::vector<Object*> Objects;
+typedef std::vector<Mesh*> Meshes;
 typedef std::vector<Light*> Lights;
+typedef std::vector<Scene*> Scenes;
+
+//! build parameters of the kd-tree, see tuneKdTree
+typedef struct kdTreeParams_s {
+  int leafSize; //! nodes with at most this many objects are not split
+  float depthFactor; //! the depth is limited to 8 + depthFactor * log2(number of objects), and by the traversal stack
+  float costRatio; //! SAH cost of a traversal step relative to the intersection of an object
+  bool tuned; //! chosen for this scene by tuneKdTree
+} KdTreeParams;
+
+//! bounds and centroids of the primitives, one array per coordinate, indexed like the primitives :
+//  the objects, then the triangles of the meshes.
+//  Cached for the builders of the acceleration structures, see sceneObjectBounds.
+typedef struct objectBounds_s {
+  std::vector<float> min[3];
+  std::vector<float> max[3];
+  std::vector<float> centroid[3];
+  std::vector<char> bounded; //! false for unbounded objects (planes), their other values are meaningless
+  int objectCount; //! objects when the bounds were cached, see firstMovedPrimitive
+} ObjectBounds;
+
+//! the objects compiled for the intersection loops : the geometry of each type in its own arrays,
+//  one per field, indexed through type and slot by object, and the material of every primitive, read by
+//  computeHitAttributes for the nearest hit only. The triangles of the meshes follow the objects, they are
+//  read from their mesh. Built and kept up to date by scenePrimitives.
+typedef struct scenePrimitives_s {
+  std::vector<char> type; //! Etype of each primitive
+  std::vector<int> slot; //! index of each object in the arrays of its type, -1 for instances, index of the mesh of a triangle
+  std::vector<vec3> sphereCenter;
+  std::vector<float> sphereRadius;
+  std::vector<vec3> planeNormal;
+  std::vector<float> planeDist;
+  std::vector<point3> triangleV0; //! triangles are stored as they are tested : first vertex,
+  std::vector<vec3> triangleEdge1; //! and edges from it to the second and third vertices
+  std::vector<vec3> triangleEdge2;
+  std::vector<int> meshFirst; //! primitive of the first triangle of each mesh
+  std::vector<Material*> material; //! of each primitive, in its object or its mesh
+  int objectCount; //! objects when the primitives were compiled
+} ScenePrimitives;
 
 typedef struct scene_s {
   Lights lights; //! the scene have several lights
   Objects objects; //! the scene have several objects
+  Meshes meshes; //! and several meshes
   Camera cam; //! the scene have one camera
   color3 skyColor; //! the sky color, could be extended to a sky function ;)
+  Eaccel accel; //! the acceleration structure to use for this scene
+  Scenes prototypes; //! scenes instanced by the objects of this one
+  struct s_accel *bottomLevel; //! structure shared by the instances of this scene, when it is a prototype
+  ObjectBounds bounds; //! cached bounds of the objects
+  ScenePrimitives primitives; //! compiled objects, read by the traversals
+  KdTreeParams kdParams; //! used by initKdTree
+  Object *objectBlock; //! objects moved together by sortSceneObjects, freed as a whole
+  size_t objectBlockSize;
 } Scene;
 
+//! true if obj has been moved into the object block of the scene by sortSceneObjects
+inline bool inObjectBlock(const Scene *scene, const Object *obj) {
+  return obj >= scene->objectBlock && obj < scene->objectBlock + scene->objectBlockSize;
+}
+
 #endif
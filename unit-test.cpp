@@ -6,15 +6,248 @@
 #include "defines.h"
 #include "ray.h"
 #include "scene.h"
+#include "scene_types.h"
 #include "raytracer.h"
 #include "image.h"
+#include "kdtree.h"
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "expected.h"
+#include <vector>
 
 void validTest(const char *desc, bool value, bool expected){
   printf("%s \t: [%s]\n", desc, value == expected ? "OK":"fail"); 
 }
 
+bool accelMatchesScene(Scene *scene, Accel *accel){
+  bool ok=true;
+  for(int i=0; i<1000; i++) {
+    vec3 dir = normalize(vec3(sinf(i*0.37f), cosf(i*0.11f), cosf(i*0.23f)));
+    Ray r1, r2;
+    Intersection i1, i2;
+    rayInit(&r1, point3(sinf(i*1.3f), cosf(i*0.7f), 3), dir);
+    rayInit(&r2, point3(sinf(i*1.3f), cosf(i*0.7f), 3), dir);
+    bool h1 = intersectScene(scene, &r1, &i1);
+    bool h2 = intersectAccel(scene, accel, &r2, &i2);
+    // both attributes are computed by computeHitAttributes from the same hit
+    ok &= (h1 == h2) && (!h1 || (r1.tmax == r2.tmax && i1.mat == i2.mat && i1.position == i2.position && i1.normal == i2.normal));
+  }
+  return ok;
+}
+
+//! shadow rays of random length, occluded must agree with the nearest intersection
+bool accelOccludesLikeScene(Scene *scene, Eaccel type){
+  Accel *accel = initAccel(scene, type);
+  bool ok=true;
+  for(int i=0; i<1000; i++) {
+    vec3 dir = normalize(vec3(sinf(i*0.37f), cosf(i*0.11f), cosf(i*0.23f)));
+    Ray r1, r2;
+    Intersection i1;
+    rayInit(&r1, point3(sinf(i*1.3f), cosf(i*0.7f), 3), dir, 0, 1+(i%7));
+    rayInit(&r2, point3(sinf(i*1.3f), cosf(i*0.7f), 3), dir, 0, 1+(i%7));
+    bool h1 = intersectScene(scene, &r1, &i1);
+    ok &= (h1 == occludedScene(scene, &r2)) && (h1 == occludedAccel(scene, accel, &r2));
+  }
+  freeAccel(accel);
+  return ok;
+}
+
+//! rays aimed at random points of random triangles, inside or outside with a margin : the triangle kernel
+//  must agree with the former edge test, and its barycentric coordinates must give back the aimed point
+bool triangleKernelMatchesEdges(bool inside){
+  bool ok=true;
+  srand(7);
+  for(int i=0; i<10000; i++) {
+    point3 v0(rand()%100*0.1f-5, rand()%100*0.1f-5, rand()%100*0.1f-5);
+    point3 v1 = v0 + vec3(rand()%20*0.1f+0.5f, rand()%10*0.1f, rand()%10*0.1f);
+    point3 v2 = v0 + vec3(rand()%10*0.1f, rand()%20*0.1f+0.5f, rand()%10*0.1f-0.5f);
+    float a = 0.05f + rand()%90*0.01f, b = 0.05f + rand()%90*0.01f;
+    if(inside && a + b > 0.95f) {
+      a = 0.95f - a;
+      b = 0.95f - b;
+    }
+    if(!inside)
+      b = 1.05f - a + rand()%50*0.01f;
+    point3 target = v0 + a*(v1 - v0) + b*(v2 - v0);
+    point3 orig(rand()%100*0.2f-10, rand()%100*0.2f-10, 12);
+    Ray ray;
+    rayInit(&ray, orig, normalize(target - orig));
+    float t;
+    TriangleHit hit;
+    bool h1 = hitTriangleEdges(&ray, v0, v1, v2, &t);
+    bool h2 = hitTriangle(&ray, v0, v1 - v0, v2 - v0, i, &hit);
+    ok &= h1 == inside && h2 == inside;
+    if(inside && h2)
+      ok &= fabsf(hit.t - t) <= 1e-4f * t && fabsf(hit.u - a) < 1e-3f && fabsf(hit.v - b) < 1e-3f && hit.prim == i;
+  }
+  return ok;
+}
+
+//! packets of random spheres or triangles, against rays aimed at one of their lanes : the nearest lane
+//  must be the one of the scalar tests, its distance a close lower bound of theirs
+bool packetsMatchScalar(bool spheres){
+  bool ok=true;
+  srand(11);
+  for(int i=0; i<2000; i++) {
+    SpherePacket sp;
+    TrianglePacket tp;
+    sp.count = tp.count = 1 + rand()%PACKET_WIDTH;
+    for(int k=0; k<sp.count; k++) {
+      for(int a=0; a<3; a++) {
+        sp.center[a][k] = tp.v0[a][k] = rand()%100*0.05f-2.5f;
+        tp.e1[a][k] = rand()%10*0.05f-0.25f;
+        tp.e2[a][k] = rand()%10*0.05f-0.25f;
+      }
+      // well shaped triangles, facing the rays
+      tp.e1[0][k] += 0.75f;
+      tp.e2[1][k] += 0.75f;
+      sp.radius[k] = 0.1f + rand()%10*0.05f;
+      sp.prim[k] = tp.prim[k] = k;
+    }
+    int aimed = rand()%sp.count;
+    point3 target = spheres ? point3(sp.center[0][aimed], sp.center[1][aimed], sp.center[2][aimed])
+                            : point3(tp.v0[0][aimed] + 0.3f*tp.e1[0][aimed] + 0.3f*tp.e2[0][aimed],
+                                     tp.v0[1][aimed] + 0.3f*tp.e1[1][aimed] + 0.3f*tp.e2[1][aimed],
+                                     tp.v0[2][aimed] + 0.3f*tp.e1[2][aimed] + 0.3f*tp.e2[2][aimed]);
+    point3 orig(rand()%100*0.2f-10, rand()%100*0.2f-10, 8);
+    Ray ray;
+    rayInit(&ray, orig, normalize(target - orig));
+
+    int nearest = -1;
+    float tn = 0;
+    for(int k=0; k<sp.count; k++) {
+      float t;
+      TriangleHit hit;
+      point3 center(sp.center[0][k], sp.center[1][k], sp.center[2][k]);
+      point3 v0(tp.v0[0][k], tp.v0[1][k], tp.v0[2][k]);
+      vec3 e1(tp.e1[0][k], tp.e1[1][k], tp.e1[2][k]), e2(tp.e2[0][k], tp.e2[1][k], tp.e2[2][k]);
+      bool h = spheres ? hitSphere(&ray, center, sp.radius[k], &t) : hitTriangle(&ray, v0, e1, e2, k, &hit);
+      if(!spheres) t = hit.t;
+      if(h && (nearest < 0 || t < tn)) {
+        nearest = k;
+        tn = t;
+      }
+    }
+    float t;
+    int lane = spheres ? hitSpherePacket(&ray, &sp, &t) : hitTrianglePacket(&ray, &tp, &t);
+    ok &= nearest >= 0 && lane == nearest && t <= tn && tn - t <= 1e-3f * tn;
+  }
+  return ok;
+}
+
+//! shadow rays leaving the surface of the spheres of a dense particle field, as the renderer casts them :
+//  the structure must find the same occluders as occludedScene, the sphere they start on included
+bool surfaceShadowsMatchScene(Eaccel type){
+  Material dummy;
+  Scene *scene = initScene();
+  srand(5);
+  for(int i=0; i<5000; i++)
+    addObject(scene, initSphere(point3(rand()%1000*0.01f-5, rand()%1000*0.01f-5, rand()%1000*0.01f-5),
+                                0.02f + rand()%100*0.0001f, dummy));
+  Accel *accel = initAccel(scene, type);
+  const point3 lights[] = {point3(10, 10, -10), point3(-10, 3, 0), point3(0, -10, 10)};
+  bool ok=true;
+  for(int i=0; i<20000; i++) {
+    Ray ray;
+    Intersection hit;
+    rayInit(&ray, point3(0, 0, -12), normalize(vec3(sinf(i*0.37f)*0.4f, cosf(i*0.11f)*0.4f, 1)));
+    if(!intersectScene(scene, &ray, &hit))
+      continue;
+    for(const point3 &light : lights) {
+      vec3 toLight = light - hit.position;
+      Ray r1, r2;
+      rayInit(&r1, hit.position, normalize(toLight), 1e-4f, length(toLight));
+      rayInit(&r2, hit.position, normalize(toLight), 1e-4f, length(toLight));
+      ok &= occludedScene(scene, &r1) == occludedAccel(scene, accel, &r2);
+    }
+  }
+  freeAccel(accel);
+  freeScene(scene);
+  return ok;
+}
+
+//! camera and shadow rays along the axes, their null components signed both ways, from origins off the
+//  planes of the boxes : the slab tests must agree with intersectScene and occludedScene
+bool axisRaysMatchScene(Scene *scene, Eaccel type){
+  Accel *accel = initAccel(scene, type);
+  const vec3 axes[] = {vec3(1,0,0), vec3(0,1,0), vec3(0,0,1), -vec3(1,0,0), -vec3(0,1,0), -vec3(0,0,1),
+                       vec3(-0.f,0,1), vec3(1,-0.f,-0.f)};
+  bool ok=true;
+  for(const vec3 &dir : axes) {
+    for(int i=0; i<400; i++) {
+      Ray r1, r2;
+      Intersection i1, i2;
+      point3 orig = point3(i%20*0.2f-1.99f, i/20*0.2f-1.99f, (i%3)*0.1f+0.01f) - 3.f*dir;
+      rayInit(&r1, orig, dir);
+      rayInit(&r2, orig, dir);
+      bool h1 = intersectScene(scene, &r1, &i1);
+      ok &= h1 == intersectAccel(scene, accel, &r2, &i2) && (!h1 || r1.tmax == r2.tmax);
+      if(!h1)
+        continue;
+      for(const vec3 &toLight : axes) {
+        Ray s1, s2;
+        rayInit(&s1, i1.position, toLight, 1e-3f, 2);
+        rayInit(&s2, i1.position, toLight, 1e-3f, 2);
+        ok &= occludedScene(scene, &s1) == occludedAccel(scene, accel, &s2);
+      }
+    }
+  }
+  freeAccel(accel);
+  return ok;
+}
+
+//! the compiled geometry of the spheres must be the one of their objects
+bool primitivesMatchObjects(Scene *scene){
+  const ScenePrimitives *p = scenePrimitives(scene);
+  bool ok = p->type.size() == scene->objects.size();
+  for(unsigned int i=0; ok && i<scene->objects.size(); i++) {
+    const Object *o = scene->objects[i];
+    ok &= p->type[i] == o->geom.type;
+    if(o->geom.type == SPHERE)
+      ok &= p->sphereCenter[p->slot[i]] == o->geom.sphere.center && p->sphereRadius[p->slot[i]] == o->geom.sphere.radius;
+  }
+  return ok;
+}
+
+//! tiny spheres at 2^m along each axis and a pile of them at the origin : Morton codes and splits peel
+//  them off one by one, the structure must stay within its fixed traversal stack
+bool deepSceneMatches(Eaccel type){
+  Material dummy;
+  Scene *scene = initScene();
+  for(int m=0; m<=20; m++) {
+    float p = (float)(1 << m);
+    addObject(scene, initSphere(point3(p, 0, 0), 1e-4f, dummy));
+    addObject(scene, initSphere(point3(0, p, 0), 1e-4f, dummy));
+    addObject(scene, initSphere(point3(0, 0, p), 1e-4f, dummy));
+  }
+  addObject(scene, initSphere(point3((float)(1 << 21)), 1e-4f, dummy));
+  for(int i=0; i<64; i++)
+    addObject(scene, initSphere(point3(0), 1e-4f, dummy));
+  Accel *accel = initAccel(scene, type);
+  bool ok=true;
+  for(int i=0; i<100; i++) {
+    Ray r1, r2, r3;
+    Intersection i1, i2;
+    vec3 dir = i == 0 ? normalize(vec3(1)) : normalize(vec3(1) + 1e-3f * vec3(sinf(i*0.37f), cosf(i*0.11f), cosf(i*0.23f)));
+    rayInit(&r1, point3(-1), dir);
+    rayInit(&r2, point3(-1), dir);
+    rayInit(&r3, point3(-1), dir);
+    bool h1 = intersectScene(scene, &r1, &i1);
+    ok &= h1 == intersectAccel(scene, accel, &r2, &i2) && (!h1 || r1.tmax == r2.tmax);
+    ok &= h1 == occludedAccel(scene, accel, &r3);
+  }
+  freeAccel(accel);
+  freeScene(scene);
+  return ok;
+}
+
+bool accelMatchesScene(Scene *scene, Eaccel type){
+  Accel *accel = initAccel(scene, type);
+  bool ok = accelMatchesScene(scene, accel);
+  freeAccel(accel);
+  return ok;
+}
+
 int main(void){
   
   Material dummy;
@@ -44,11 +277,226 @@ int main(void){
   validTest("r2 to plane1", intersectPlane(&r, &dummyInter, plane1), false);
   validTest("r2 to plane2", intersectPlane(&r, &dummyInter, plane2), false);
 
+  validTest("triangle kernel inside", triangleKernelMatchesEdges(true), true);
+  validTest("triangle kernel outside", triangleKernelMatchesEdges(false), true);
+  validTest("sphere packets", packetsMatchScalar(true), true);
+  validTest("surface shadows bvh", surfaceShadowsMatchScene(ACCEL_BVH), true);
+  validTest("surface shadows bvh4", surfaceShadowsMatchScene(ACCEL_BVH4), true);
+  validTest("triangle packets", packetsMatchScalar(false), true);
+
   freeObject(plane1);
   freeObject(plane2);
   freeObject(sphere1);
   freeObject(sphere2);
 
+  // each acceleration structure must find the same nearest intersection as the brute force intersectScene
+  Scene *scene = initScene();
+  for(int i=0; i<10; i++)
+    for(int j=0; j<10; j++)
+      addObject(scene, initSphere(point3(i*0.4f-2, j*0.4f-2, (i+j)%3*0.2f), 0.15f, dummy));
+  addObject(scene, initTriangle(point3(-2,-2,1), point3(2,-2,1), point3(0,2,1.5f), dummy));
+  addObject(scene, initPlane(vec3(0,0,1), 2, dummy));
+  validTest("kdtree vs scene", accelMatchesScene(scene, ACCEL_KDTREE), true);
+  validTest("kdtree ropes vs scene", accelMatchesScene(scene, ACCEL_KDTREE_ROPES), true);
+  validTest("bvh vs scene", accelMatchesScene(scene, ACCEL_BVH), true);
+  validTest("bvh4 vs scene", accelMatchesScene(scene, ACCEL_BVH4), true);
+  validTest("compact bvh4 vs scene", accelMatchesScene(scene, ACCEL_BVH4_COMPACT), true);
+  validTest("lbvh vs scene", accelMatchesScene(scene, ACCEL_LBVH), true);
+  validTest("sbvh vs scene", accelMatchesScene(scene, ACCEL_SBVH), true);
+  validTest("lazy bvh vs scene", accelMatchesScene(scene, ACCEL_LAZY_BVH), true);
+  validTest("grid vs scene", accelMatchesScene(scene, ACCEL_GRID), true);
+  validTest("deep bvh", deepSceneMatches(ACCEL_BVH), true);
+  validTest("deep lbvh", deepSceneMatches(ACCEL_LBVH), true);
+  validTest("deep bvh4", deepSceneMatches(ACCEL_BVH4), true);
+  validTest("deep compact bvh4", deepSceneMatches(ACCEL_BVH4_COMPACT), true);
+  validTest("deep lazy bvh", deepSceneMatches(ACCEL_LAZY_BVH), true);
+  validTest("kdtree occluded", accelOccludesLikeScene(scene, ACCEL_KDTREE), true);
+  validTest("bvh occluded", accelOccludesLikeScene(scene, ACCEL_BVH), true);
+  validTest("bvh4 occluded", accelOccludesLikeScene(scene, ACCEL_BVH4), true);
+  validTest("compact bvh4 occluded", accelOccludesLikeScene(scene, ACCEL_BVH4_COMPACT), true);
+  validTest("lazy bvh occluded", accelOccludesLikeScene(scene, ACCEL_LAZY_BVH), true);
+  validTest("grid occluded", accelOccludesLikeScene(scene, ACCEL_GRID), true);
+  validTest("kdtree axis rays", axisRaysMatchScene(scene, ACCEL_KDTREE), true);
+  validTest("kdtree ropes axis rays", axisRaysMatchScene(scene, ACCEL_KDTREE_ROPES), true);
+  validTest("bvh axis rays", axisRaysMatchScene(scene, ACCEL_BVH), true);
+  validTest("bvh4 axis rays", axisRaysMatchScene(scene, ACCEL_BVH4), true);
+  validTest("compact bvh4 axis rays", axisRaysMatchScene(scene, ACCEL_BVH4_COMPACT), true);
+  validTest("lbvh axis rays", axisRaysMatchScene(scene, ACCEL_LBVH), true);
+  validTest("sbvh axis rays", axisRaysMatchScene(scene, ACCEL_SBVH), true);
+  validTest("lazy bvh axis rays", axisRaysMatchScene(scene, ACCEL_LAZY_BVH), true);
+  validTest("grid axis rays", axisRaysMatchScene(scene, ACCEL_GRID), true);
+
+  // other kd-tree build parameters, chosen or not by the tuner, must give the same results
+  setCamera(scene, point3(0,0,-5), vec3(0,0,0), vec3(0,1,0), 60, 1.f);
+  tuneKdTree(scene, 8);
+  validTest("tuned kdtree vs scene", scene->kdParams.tuned && accelMatchesScene(scene, ACCEL_KDTREE), true);
+  scene->kdParams.leafSize = 8;
+  scene->kdParams.costRatio = 4.f;
+  validTest("kdtree leaf size 8 vs scene", accelMatchesScene(scene, ACCEL_KDTREE), true);
+  scene->kdParams = defaultKdTreeParams();
+
+  // move some spheres, the refitted bvh must follow
+  Accel *accel = initAccel(scene, ACCEL_BVH);
+  int moved[] = {3, 17, 42, 43, 99};
+  for(int m : moved)
+    scene->objects[m]->geom.sphere.center += vec3(0.1f, -0.2f, 0.3f);
+  bool rebuilt = refitAccel(scene, accel, moved, 5);
+  validTest("bvh refit", rebuilt, false);
+  validTest("refitted bvh vs scene", accelMatchesScene(scene, accel), true);
+  validTest("refitted primitives", primitivesMatchObjects(scene), true);
+  freeAccel(accel);
+
+  // sorted objects must be found under their new index
+  std::vector<Object> unsorted;
+  for(Object *o : scene->objects)
+    unsorted.push_back(*o);
+  std::vector<int> newIndex(scene->objects.size());
+  sortSceneObjects(scene, newIndex.data());
+  bool sorted=true;
+  for(unsigned int i=0; i<unsorted.size(); i++) {
+    const Object *o = scene->objects[newIndex[i]];
+    sorted &= o->geom.type == unsorted[i].geom.type && o->mat.diffuseColor == unsorted[i].mat.diffuseColor;
+    if(o->geom.type == SPHERE)
+      sorted &= o->geom.sphere.center == unsorted[i].geom.sphere.center;
+    else if(o->geom.type == TRIANGLE)
+      sorted &= o->geom.triangle.v2 == unsorted[i].geom.triangle.v2;
+  }
+  validTest("sorted objects", sorted, true);
+  validTest("sorted kdtree vs scene", accelMatchesScene(scene, ACCEL_KDTREE), true);
+  freeScene(scene);
+
+  // instances of a prototype must hit like the transformed copies of its objects
+  Scene *prototype = initScene();
+  for(int i=0; i<5; i++)
+    addObject(prototype, initSphere(point3(i*0.2f-0.4f, (i%2)*0.2f, 0), 0.1f, dummy));
+  addObject(prototype, initTriangle(point3(-0.5f,-0.3f,0.2f), point3(0.5f,-0.3f,0.2f), point3(0,0.4f,0.3f), dummy));
+  Scene *instanced = initScene();
+  Scene *copies = initScene();
+  addPrototype(instanced, prototype);
+  for(int i=0; i<4; i++) {
+    for(int j=0; j<4; j++) {
+      mat3 orientation = 0.8f * mat3(rotate(mat4(1.f), i*0.5f+j*0.3f, normalize(vec3(i, j, 1))));
+      vec3 translation = vec3(i-1.5f, j-1.5f, (i+j)%2*0.3f);
+      addObject(instanced, initInstance(prototype, orientation, translation));
+      for(Object *o : prototype->objects) {
+        if(o->geom.type == SPHERE)
+          addObject(copies, initSphere(orientation*o->geom.sphere.center+translation, 0.8f*o->geom.sphere.radius, dummy));
+        else
+          addObject(copies, initTriangle(orientation*o->geom.triangle.v0+translation, orientation*o->geom.triangle.v1+translation,
+                                         orientation*o->geom.triangle.v2+translation, dummy));
+      }
+    }
+  }
+  Accel *instanceAccel = initAccel(instanced, ACCEL_BVH);
+  bool instances=true;
+  for(int i=0; i<1000; i++) {
+    vec3 dir = normalize(vec3(sinf(i*0.37f), cosf(i*0.11f), -1-cosf(i*0.23f)));
+    Ray r1, r2;
+    Intersection i1, i2;
+    rayInit(&r1, point3(2*sinf(i*1.3f), 2*cosf(i*0.7f), 3), dir);
+    rayInit(&r2, point3(2*sinf(i*1.3f), 2*cosf(i*0.7f), 3), dir);
+    bool h1 = intersectScene(copies, &r1, &i1);
+    bool h2 = intersectAccel(instanced, instanceAccel, &r2, &i2);
+    instances &= (h1 == h2) && (!h1 || (fabsf(r1.tmax - r2.tmax) < 1e-4f && dot(i1.normal, i2.normal) > 0.999f));
+  }
+  validTest("instances vs copies", instances, true);
+  validTest("instanced bvh vs scene", accelMatchesScene(instanced, instanceAccel), true);
+  validTest("instanced kdtree vs scene", accelMatchesScene(instanced, ACCEL_KDTREE), true);
+  validTest("instanced occluded", accelOccludesLikeScene(instanced, ACCEL_BVH), true);
+  freeAccel(instanceAccel);
+
+  // sorting the instances sorts their prototype too, and rebuilds its structure
+  sortSceneObjects(instanced, NULL);
+  validTest("sorted instances", accelMatchesScene(instanced, ACCEL_BVH), true);
+  validTest("sorted instances occluded", accelOccludesLikeScene(instanced, ACCEL_BVH), true);
+  freeScene(instanced);
+  freeScene(copies);
+
+  // a mesh must be hit like the same triangles given one by one
+  const int side = 12;
+  std::vector<point3> vertices;
+  std::vector<uint32_t> indices;
+  for(int j=0; j<=side; j++)
+    for(int i=0; i<=side; i++)
+      vertices.push_back(point3(i*4.f/side-2, j*4.f/side-2, 0.3f*sinf(i*0.9f)*cosf(j*0.7f)));
+  for(int j=0; j<side; j++) {
+    for(int i=0; i<side; i++) {
+      uint32_t v = j*(side+1)+i;
+      uint32_t quad[6] = {v, v+1, v+side+2, v, v+side+2, v+side+1};
+      indices.insert(indices.end(), quad, quad+6);
+    }
+  }
+  Scene *meshScene = initScene();
+  Scene *triangles = initScene();
+  addObject(meshScene, initSphere(point3(0.5f, 0.5f, 0.5f), 0.3f, dummy));
+  addObject(triangles, initSphere(point3(0.5f, 0.5f, 0.5f), 0.3f, dummy));
+  addMesh(meshScene, initMesh(vertices.data(), vertices.size(), indices.data(), indices.size()/3, NULL, dummy));
+  for(unsigned int k=0; k<indices.size(); k+=3)
+    addObject(triangles, initTriangle(vertices[indices[k]], vertices[indices[k+1]], vertices[indices[k+2]], dummy));
+  bool mesh=true;
+  for(int i=0; i<1000; i++) {
+    vec3 dir = normalize(vec3(sinf(i*0.37f), cosf(i*0.11f), -1-cosf(i*0.23f)));
+    Ray r1, r2;
+    Intersection i1, i2;
+    rayInit(&r1, point3(2*sinf(i*1.3f), 2*cosf(i*0.7f), 3), dir);
+    rayInit(&r2, point3(2*sinf(i*1.3f), 2*cosf(i*0.7f), 3), dir);
+    bool h1 = intersectScene(triangles, &r1, &i1);
+    bool h2 = intersectScene(meshScene, &r2, &i2);
+    mesh &= (h1 == h2) && (!h1 || (fabsf(r1.tmax - r2.tmax) < 1e-5f && dot(i1.normal, i2.normal) > 0.9999f));
+  }
+  validTest("mesh vs triangles", mesh, true);
+  validTest("mesh kdtree vs scene", accelMatchesScene(meshScene, ACCEL_KDTREE), true);
+  validTest("mesh bvh vs scene", accelMatchesScene(meshScene, ACCEL_BVH), true);
+  validTest("mesh sbvh vs scene", accelMatchesScene(meshScene, ACCEL_SBVH), true);
+  validTest("mesh occluded", accelOccludesLikeScene(meshScene, ACCEL_BVH4), true);
+  // the triangles of the mesh move after a new object
+  addObject(meshScene, initSphere(point3(-0.5f, 0.5f, 0.2f), 0.3f, dummy));
+  validTest("mesh after new object", accelMatchesScene(meshScene, ACCEL_GRID), true);
+  // move the vertices of the first rows of quads, the refitted bvh must follow
+  Accel *meshAccel = initAccel(meshScene, ACCEL_BVH);
+  Mesh *moving = meshScene->meshes[0];
+  for(int v=0; v<3*(side+1); v++)
+    moving->vertices[v].z += 0.2f;
+  std::vector<int> movedTriangles;
+  for(int k=0; k<3*2*side; k++)
+    movedTriangles.push_back(meshScene->objects.size() + k);
+  refitAccel(meshScene, meshAccel, movedTriangles.data(), movedTriangles.size());
+  validTest("refitted mesh bvh vs scene", accelMatchesScene(meshScene, meshAccel), true);
+  freeAccel(meshAccel);
+  freeScene(meshScene);
+  freeScene(triangles);
+
+  // with normals per vertex, the normal of a hit is interpolated from those of its triangle
+  std::vector<vec3> normals;
+  for(const point3 &v : vertices)
+    normals.push_back(normalize(vec3(v.x, v.y, 2.f)));
+  Scene *smooth = initScene();
+  addMesh(smooth, initMesh(vertices.data(), vertices.size(), indices.data(), indices.size()/3, normals.data(), dummy));
+  Accel *smoothAccel = initAccel(smooth, ACCEL_BVH);
+  bool interpolated=true;
+  int smoothHits=0;
+  for(int i=0; i<1000; i++) {
+    vec3 dir = normalize(vec3(sinf(i*0.37f), cosf(i*0.11f), -1-cosf(i*0.23f)));
+    Ray r;
+    Intersection hit;
+    rayInit(&r, point3(2*sinf(i*1.3f), 2*cosf(i*0.7f), 3), dir);
+    if(!intersectAccel(smooth, smoothAccel, &r, &hit))
+      continue;
+    smoothHits++;
+    // barycentric coordinates of the hit, from the areas of the triangles it makes with the edges
+    const uint32_t *t = &indices[3*hit.prim];
+    point3 a = vertices[t[0]], b = vertices[t[1]], c = vertices[t[2]];
+    vec3 n = cross(b-a, c-a);
+    float wb = dot(n, cross(hit.position-a, c-a)) / dot(n, n);
+    float wc = dot(n, cross(b-a, hit.position-a)) / dot(n, n);
+    vec3 expected = normalize((1-wb-wc)*normals[t[0]] + wb*normals[t[1]] + wc*normals[t[2]]);
+    interpolated &= dot(expected, hit.normal) > 0.9999f;
+  }
+  validTest("mesh normals", interpolated && smoothHits > 0, true);
+  validTest("mesh normals bvh4 vs scene", accelMatchesScene(smooth, ACCEL_BVH4), true);
+  freeAccel(smoothAccel);
+  freeScene(smooth);
+
   bool beckmann=true;
   for(int i=0; i<beckmannExpectedCount; i++){
     beckmann &= abs(beckmannExpected[i].res - RDM_Beckmann(beckmannExpected[i].NdotH, beckmannExpected[i].alpha))<0.0001f;